@@ -43,6 +43,7 @@ ASTERISK_REGISTER_FILE()
 #include "asterisk/cdr.h"
 #include "asterisk/module.h"
 #include "asterisk/res_mongodb.h"
+#include "asterisk/time.h"
 
 static const char NAME[] = "cdr_mongodb";
 static const char CATEGORY[] = "cdr";
@@ -63,12 +64,17 @@ static mongoc_client_pool_t *dbpool = NULL;
 static bson_oid_t *serverid = NULL;
 static void* apm_context = NULL;
 static int apm_enabled = 0;
+// 0 = disable logging of slow insertions
+static unsigned slow_query_ms = 0;
 
 static int mongodb_log(struct ast_cdr *cdr)
 {
     int ret = -1;
     bson_t *doc = NULL;
     mongoc_collection_t *collection = NULL;
+    struct timeval start = ast_tvnow();
+    int64_t pool_us = 0;
+    int64_t server_us = 0;
 
     if(dbpool == NULL) {
         ast_log(LOG_ERROR, "unexpected error, no connection pool\n");
@@ -80,6 +86,7 @@ static int mongodb_log(struct ast_cdr *cdr)
         ast_log(LOG_ERROR, "unexpected error, no client allocated\n");
         return ret;
     }
+    pool_us = ast_tvdiff_us(ast_tvnow(), start);
 
     do {
         bson_error_t error;
@@ -118,12 +125,20 @@ static int mongodb_log(struct ast_cdr *cdr)
         if (serverid)
             BSON_APPEND_OID(doc, SERVERID, serverid);
 
+        start = ast_tvnow();
         if(!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, doc, NULL, &error))
             ast_log(LOG_ERROR, "insertion failed, %s\n", error.message);
+        server_us = ast_tvdiff_us(ast_tvnow(), start);
 
         ret = 0; // success
     } while(0);
 
+    if (slow_query_ms && pool_us + server_us >= (int64_t)slow_query_ms * 1000) {
+        char timing[64];
+
+        snprintf(timing, sizeof(timing), "pool=%lldus, server=%lldus", (long long)pool_us, (long long)server_us);
+        ast_mongo_slow_query(NAME, "insert", dbname, dbcollection, NULL, doc, 1, pool_us + server_us, timing);
+    }
     if (collection)
         mongoc_collection_destroy(collection);
     if (doc)
@@ -220,6 +235,12 @@ static int mongodb_load_module(int reload)
            apm_enabled = 0;
         }
 
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "slow_query_ms"))
+        && (sscanf(tmp, "%u", &slow_query_ms) != 1)) {
+           ast_log(LOG_WARNING, "slow_query_ms must be milliseconds, not '%s'\n", tmp);
+           slow_query_ms = 0;
+        }
+
         if (apm_context)
             ast_mongo_apm_stop(apm_context);
 
@@ -29,6 +29,26 @@
     <support_level>extended</support_level>
  ***/
 
+/*** DOCUMENTATION
+    <manager name="MongoDBLatency" language="en_US">
+        <synopsis>
+            List latencies of the realtime MongoDB configuration engine.
+        </synopsis>
+        <syntax>
+            <xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+            <parameter name="Reset">
+                <para>If <literal>yes</literal>, the latencies are reset after listed.</para>
+            </parameter>
+        </syntax>
+        <description>
+            <para>A <literal>MongoDBLatency</literal> event is listed for each table, callback and phase,
+            which is one of <literal>pool</literal>, <literal>server</literal> or <literal>conversion</literal>,
+            with the count, the mean, the 50th, 99th and 99.9th percentiles in microseconds,
+            followed by a <literal>MongoDBLatencyComplete</literal> event.</para>
+        </description>
+    </manager>
+ ***/
+
 #include "asterisk.h"
 #ifdef ASTERISK_REGISTER_FILE   /* deprecated from 15.0.0 */
 ASTERISK_REGISTER_FILE()
@@ -40,8 +60,16 @@ ASTERISK_REGISTER_FILE()
 #include "asterisk/config.h"
 #include "asterisk/module.h"
 #include "asterisk/lock.h"
+#include "asterisk/localtime.h"
 #include "asterisk/utils.h"
 #include "asterisk/threadstorage.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/cli.h"
+#include "asterisk/manager.h"
+#include "asterisk/dlinkedlists.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/strings.h"
+#include "asterisk/test.h"
 #include "asterisk/res_mongodb.h"
 
 #define HANDLE_ID_AS_OID 1
@@ -55,18 +83,102 @@ ASTERISK_REGISTER_FILE()
             bson_free(str); \
         }
 
+/*!
+ * \brief trace a bson of a table as json
+ *
+ * The bson is serialized only if the debug level of the module is 1 or more,
+ * or the trace of the table is enabled, which records it in the ring of traces.
+ */
+#define TRACE_BSON(table, fmt, bson, ...) do { \
+            bool _debug = DEBUG_ATLEAST(1); \
+            bool _trace = trace_enabled(table); \
+            if (_debug || _trace) { \
+                char *_str = bson_as_json(bson, NULL); \
+                if (_debug) \
+                    ast_log(LOG_DEBUG, fmt, _str, ##__VA_ARGS__); \
+                if (_trace) \
+                    trace_add(table, fmt, _str, ##__VA_ARGS__); \
+                bson_free(_str); \
+            } \
+        } while(0)
+
 static const int MAXTOKENS = 3;
 static const char NAME[] = "mongodb";
 static const char CATEGORY[] = "config";
 static const char CONFIG_FILE[] = "ast_mongo.conf";
 static const char SERVERID[] = "serverid";
-
-AST_MUTEX_DEFINE_STATIC(model_lock);
+static const char REVERSED_SUFFIX[] = "__reversed";
+static const int CACHE_BUCKETS = 563;
+static const int QUERY_TEMPLATE_MAX = 1000;
+static const unsigned PREFETCH_QUEUE = 1000;
+static const int WATCH_AWAIT_MS = 100;
+static const int WATCH_RETRY_SEC = 5;
+static const char TABLE_CATEGORY_PREFIX[] = "config/";
+static const int TABLE_BUCKETS = 17;
+static const int SNAPSHOT_BUCKETS = 563;
+static const unsigned INDEX_SHAPE_MAX = 1000;
+static const unsigned INDEX_PER_TABLE = 8;
+static const unsigned INDEX_KEYS_MAX = 32;
+static const unsigned QUERY_STATS_MAX = 1000;
+static const unsigned EXPLAIN_TOP = 10;
+static const unsigned EXPLAIN_TTL_SEC = 300;
+static const unsigned OP_STATS_MAX = 1000;
+static const int TRACE_BUCKETS = 17;
+static const unsigned SCHEMA_PLANS_MAX = 8;
+#define TRACE_RING_SIZE 256
+#define DOC_VALUE_WORK 32       /* enough for an oid, an integer or a double formatted */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_EXP_MAX 40    /* up to about 12 days in microseconds */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_EXP_MAX - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+AST_MUTEX_DEFINE_STATIC(schema_lock);   // writers of schemas only
+AST_MUTEX_DEFINE_STATIC(cache_lock);
+AST_THREADSTORAGE(cache_key_buf);
+AST_THREADSTORAGE(query_shape_buf);
+AST_THREADSTORAGE(index_shape_buf);
+AST_MUTEX_DEFINE_STATIC(watch_lock);
+AST_MUTEX_DEFINE_STATIC(flight_lock);
+AST_MUTEX_DEFINE_STATIC(index_lock);
+AST_MUTEX_DEFINE_STATIC(trace_lock);
+AST_MUTEX_DEFINE_STATIC(write_lock);
 static mongoc_client_pool_t* dbpool = NULL;
-static bson_t* models = NULL;
+// schemas of tables required, see struct schema_registry
+static struct schema_registry *schemas = NULL;
+static struct schema *schema_all = NULL;
 static bson_oid_t *serverid = NULL;
 static void* apm_context = NULL;
+static struct ao2_container *query_templates = NULL;
 static int apm_enabled = 0;
+// 0 = disable caching of realtime() results
+static unsigned cache_ttl = 0;
+static unsigned cache_size = 1000;
+// 0 = disable caching of keys not found by realtime()
+static unsigned negative_cache_ttl = 0;
+static unsigned negative_cache_size = 10000;
+// 0 != invalidate the cached results by change streams
+static unsigned cache_watch = 0;
+// 0 != project fields of the model required unless a table specifies its projection
+static unsigned require_projection = 0;
+// 0 != create indexes for shapes of queries observed
+static unsigned auto_index = 0;
+// 0 = disable logging of slow operations
+static unsigned slow_query_ms = 0;
+// delay to coalesce writes written behind in milliseconds, and max number of them pending
+static unsigned write_behind_ms = 100;
+static unsigned write_behind_max = 10000;
+// max number of rows returned by realtime_multi(), 0 = unlimited
+static unsigned max_rows = 0;
+// 0 != replay static configuration fetched before while unchanged
+static unsigned load_cache = 0;
+static char load_version_field[64] = "lastModified";
+static struct ao2_container *load_entries = NULL;
+// files fetched by prefetch_files at load of the module, each used once by load()
+static struct ao2_container *load_staged = NULL;
+// options of tables and snapshots of the collections
+static AO2_GLOBAL_OBJ_STATIC(table_configs);
+static AO2_GLOBAL_OBJ_STATIC(snapshots);
+static unsigned snapshot_count = 0;
 
 static int str_split(char* str, const char* delim, const char* tokens[] ) {
     char* token;
@@ -98,6 +210,171 @@ static const char *key_asterisk2mongo(const char *key)
     //return strcmp(key, "id") == 0 ? "_id" : key;
 }
 
+/*!
+ * \brief a trace recorded in the ring
+ */
+struct trace_entry {
+    struct timeval when;
+    char table[64];
+    char *text;                 /*!< formatted trace, owned */
+};
+
+// tables traced, and the ring of the recent traces guarded by trace_lock
+static struct ao2_container *trace_tables = NULL;
+static struct trace_entry trace_ring[TRACE_RING_SIZE];
+static unsigned trace_next = 0;
+
+/*!
+ * \brief check if the trace of a table is enabled
+ */
+static bool trace_enabled(const char *table)
+{
+    struct ao2_container *tables = trace_tables;
+    void *found;
+
+    if (!tables || !ao2_container_count(tables) || !table)
+        return false;
+    found = ao2_find(tables, table, OBJ_SEARCH_KEY);
+    ao2_cleanup(found);
+    return found != NULL;
+}
+
+/*!
+ * \brief record a trace of a table in the ring, overwriting the oldest one
+ */
+static void __attribute__((format(printf, 2, 3))) trace_add(const char *table, const char *fmt, ...)
+{
+    struct trace_entry *entry;
+    char *text = NULL;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (ast_vasprintf(&text, fmt, ap) < 0)
+        text = NULL;
+    va_end(ap);
+    if (!text)
+        return;
+
+    ast_mutex_lock(&trace_lock);
+    entry = &trace_ring[trace_next++ % TRACE_RING_SIZE];
+    ast_free(entry->text);
+    entry->when = ast_tvnow();
+    ast_copy_string(entry->table, table, sizeof(entry->table));
+    entry->text = text;
+    ast_mutex_unlock(&trace_lock);
+}
+
+/*!
+ * \brief set tables traced by the options trace of [config/<table>]
+ */
+static void trace_config(struct ast_config *cfg)
+{
+    const char *category = NULL;
+    const char *tmp;
+
+    if (!trace_tables)
+        return;
+    ao2_callback(trace_tables, OBJ_NODATA | OBJ_MULTIPLE | OBJ_UNLINK, NULL, NULL);
+    while ((category = ast_category_browse(cfg, category))) {
+        if (strncmp(category, TABLE_CATEGORY_PREFIX, strlen(TABLE_CATEGORY_PREFIX)))
+            continue;
+        if ((tmp = ast_variable_retrieve(cfg, category, "trace")) && ast_true(tmp))
+            ast_str_container_add(trace_tables, category + strlen(TABLE_CATEGORY_PREFIX));
+    }
+}
+
+static int trace_init(void)
+{
+    trace_tables = ast_str_container_alloc_options(AO2_ALLOC_OPT_LOCK_RWLOCK, TRACE_BUCKETS);
+    if (!trace_tables) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void trace_destroy(void)
+{
+    int i;
+
+    ao2_cleanup(trace_tables);
+    trace_tables = NULL;
+    ast_mutex_lock(&trace_lock);
+    for (i = 0; i < TRACE_RING_SIZE; i++) {
+        ast_free(trace_ring[i].text);
+        trace_ring[i].text = NULL;
+    }
+    trace_next = 0;
+    ast_mutex_unlock(&trace_lock);
+}
+
+static char *handle_cli_set_trace(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    const char *table;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "mongodb set trace {on|off}";
+            e->usage =
+                "Usage: mongodb set trace {on|off} <table>\n"
+                "       Enable or disable the trace of queries, updates and documents\n"
+                "       of a table, recorded in the ring shown by 'mongodb show trace'.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 5)
+        return CLI_SHOWUSAGE;
+
+    table = a->argv[4];
+    if (!strcasecmp(a->argv[3], "on")) {
+        if (!trace_enabled(table))
+            ast_str_container_add(trace_tables, table);
+        ast_cli(a->fd, "trace of %s enabled.\n", table);
+    }
+    else {
+        ast_str_container_remove(trace_tables, table);
+        ast_cli(a->fd, "trace of %s disabled.\n", table);
+    }
+    return CLI_SUCCESS;
+}
+
+static char *handle_cli_show_trace(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    const char *table;
+    unsigned i;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "mongodb show trace";
+            e->usage =
+                "Usage: mongodb show trace [<table>]\n"
+                "       Show the recent traces of the tables enabled by 'mongodb set trace on',\n"
+                "       or of the specified table, oldest first.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3 && a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    table = a->argc == 4 ? a->argv[3] : NULL;
+    ast_mutex_lock(&trace_lock);
+    for (i = 0; i < TRACE_RING_SIZE; i++) {
+        const struct trace_entry *entry = &trace_ring[(trace_next + i) % TRACE_RING_SIZE];
+        struct ast_tm tm;
+        char when[32];
+
+        if (!entry->text || (table && strcmp(entry->table, table)))
+            continue;
+        ast_localtime(&entry->when, &tm, NULL);
+        ast_strftime(when, sizeof(when), "%F %T.%3q", &tm);
+        ast_cli(a->fd, "[%s] %s: %s", when, entry->table, entry->text);
+    }
+    ast_mutex_unlock(&trace_lock);
+    return CLI_SUCCESS;
+}
+
 /*!
  *  check if the specified string is integer
  *
@@ -118,6 +395,68 @@ static bool is_integer(const char* value, long long* result)
     return true;
 }
 
+/*!
+ * \brief   parse a decimal integer as atoll() does, without its locale and errno handling
+ */
+static long long str2int(const char *value)
+{
+    unsigned long long n = 0;
+    bool negative = false;
+
+    while (*value == ' ' || (*value >= '\t' && *value <= '\r'))
+        value++;
+    if (*value == '-' || *value == '+')
+        negative = *value++ == '-';
+    while (*value >= '0' && *value <= '9')
+        n = n * 10 + (*value++ - '0');
+    return negative ? -(long long)n : (long long)n;
+}
+
+/*!
+ * \brief   parse a date of "YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS" as UTC
+ * \param[out] msec    is milliseconds since the epoch
+ * \retval  false if not a date, e.g. "0000-00-00".
+ */
+static bool str2date(const char *value, int64_t *msec)
+{
+    int y, m, d;
+    int hh = 0, mm = 0, ss = 0;
+    int len = 0;
+    int tlen = 0;
+    int era, yoe, doy;
+    int64_t days;
+
+    if (sscanf(value, "%4d-%2d-%2d%n", &y, &m, &d, &len) != 3)
+        return false;
+    if ((value[len] == ' ' || value[len] == 'T')
+    &&  sscanf(value + len + 1, "%2d:%2d:%2d%n", &hh, &mm, &ss, &tlen) == 3)
+        len += 1 + tlen;
+    if (value[len] != '\0' || m < 1 || m > 12 || d < 1 || d > 31
+    ||  hh < 0 || hh > 23 || mm < 0 || mm > 59 || ss < 0 || ss > 60)
+        return false;
+    // days since the epoch of a civil date, see http://howardhinnant.github.io/date_algorithms.html
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    days = (int64_t)era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    *msec = (((days * 24 + hh) * 60 + mm) * 60 + ss) * 1000;
+    return true;
+}
+
+/*!
+ * \brief   check if a value is a plain decimal integer exact in a double, e.g. "60" or "-1"
+ */
+static bool is_small_int(const char *value)
+{
+    const char *p = value + (*value == '-' || *value == '+');
+    const char *digits = p;
+
+    while (*p >= '0' && *p <= '9')
+        p++;
+    return *p == '\0' && p > digits && p - digits <= 15;
+}
+
 /*!
  *  check if the specified string is real number
  *
@@ -193,254 +532,597 @@ static const char* strcopy(const char* src, char* dst, int size)
 }
 
 /*!
- * \brief   make a condition to query
+ * \brief   escape metacharacters of regular expression
+ * \param   src     is a literal string
+ * \param   dst     is a buffer to be stored the escaped string
+ * \param   size    is size of dst
+ * \retval  false if dst is not enough.
+ */
+static bool regex_escape(const char* src, char* dst, size_t size)
+{
+    size_t i = 0;
+
+    for (; *src != '\0'; src++) {
+        if (strchr("\\^$.|?*+()[]{}", *src)) {
+            if (i + 1 >= size)
+                break;
+            dst[i++] = '\\';
+        }
+        if (i + 1 >= size)
+            break;
+        dst[i++] = *src;
+    }
+    dst[i] = '\0';
+    if (*src != '\0') {
+        ast_log(LOG_WARNING, "size of dst is not enough.\n");
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief   reverse a string by utf-8 characters, not by bytes
+ * \param   src
+ * \param   dst     is a buffer to be stored the reversed string,
+ *                  which is as long as src.
+ */
+static void utf8_reverse(const char* src, char* dst)
+{
+    size_t len = strlen(src);
+    const char* end = src + len;
+
+    dst[len] = '\0';
+    while (src < end) {
+        size_t n = 1;
+        // continuation bytes follow the leading byte of a character
+        while (src + n < end && (src[n] & 0xc0) == 0x80)
+            n++;
+        len -= n;
+        memcpy(dst + len, src, n);
+        src += n;
+    }
+}
+
+/*!
+ * \brief   append a condition of a prefix to query
+ * \param   doc     is a document to be appended
+ * \param   key     is name of field
+ * \param   prefix  is a literal prefix
+ * \retval  true if appended as follows;
+ *      { key: { $gte: "prefix", $lt: "prefiy" } }, which an index can be used for.
+ *      { key: { $regex: "^prefix" } }, if the last letter can't be incremented.
+ */
+static bool append_prefix(bson_t *doc, const char *key, const char *prefix)
+{
+    bson_t condition;
+    size_t len = strlen(prefix);
+    char upper[1024];
+    const char *p;
+
+    // the upper bound must be a valid utf-8 string as well, so only for ascii
+    for (p = prefix; *p && (unsigned char)*p < 0x7f; p++)
+        ;
+    if (len && *p == '\0' && len < sizeof(upper)) {
+        strcpy(upper, prefix);
+        upper[len - 1]++;
+        return BSON_APPEND_DOCUMENT_BEGIN(doc, key, &condition)
+            && BSON_APPEND_UTF8(&condition, "$gte", prefix)
+            && BSON_APPEND_UTF8(&condition, "$lt", upper)
+            && bson_append_document_end(doc, &condition);
+    }
+    upper[0] = '^';
+    if (!regex_escape(prefix, upper + 1, sizeof(upper) - 1))
+        return false;
+    return BSON_APPEND_DOCUMENT_BEGIN(doc, key, &condition)
+        && BSON_APPEND_UTF8(&condition, "$regex", upper)
+        && bson_append_document_end(doc, &condition);
+}
+
+/*!
+ * \brief   append a condition to query
+ * \param   doc     is a document to be appended
+ * \param   key     is name of field
  * \param   sql     is pattern for sql
- * \retval  a bson to query as follows;
+ * \param   reversed    is true if the field has a reversed shadow field, key + REVERSED_SUFFIX.
+ * \retval  true if appended as follows;
  *      sql patern      generated bson to query
  *      ----------      --------------------------------------
- *      %               { $exists: true, $not: { $size: 0} } }
- *      %patern%        { $regex: "patern" }
- *      patern%         { $regex: "^patern" }
- *      %patern         { $regex: "patern$" }
- *      any other       NULL
+ *      %               { key: { $exists: true, $not: { $size: 0} } }
+ *      %patern%        { key: { $regex: "patern" } }
+ *      patern%         { key: { $gte: "patern", $lt: "paterO" } }
+ *      %patern         { key__reversed: { $gte: "nretap", $lt: "nretaq" } } if reversed,
+ *                      { key: { $regex: "patern$" } } otherwise.
+ *      any other       false
+ *      metacharacters of regular expression in patern are escaped.
  */
-static const bson_t* make_condition(const char* sql)
+static bool append_condition(bson_t *doc, const char *key, const char *sql, bool reversed)
 {
-    bson_t* condition = NULL;
+    bson_t condition;
     char patern[1020];
     char tmp[1024];
+    size_t sql_len = strlen(sql);
     char head = *sql;
-    char tail = *(sql + strlen(sql) - 1);
+    char tail = sql_len ? sql[sql_len - 1] : '\0';
 
     if (strcmp(sql, "%") == 0) {
-        const char* json = "{ \"$exists\": true, \"$not\": {\"$size\": 0}}";
-        bson_error_t error;
-        condition = bson_new_from_json((const uint8_t*)json, -1, &error);
-        if (!condition)
-            ast_log(LOG_ERROR, "cannot generated condition from \"%s\", %d.%d:%s\n", json, error.domain, error.code, error.message);
+        bson_t not;
+        return BSON_APPEND_DOCUMENT_BEGIN(doc, key, &condition)
+            && BSON_APPEND_BOOL(&condition, "$exists", true)
+            && BSON_APPEND_DOCUMENT_BEGIN(&condition, "$not", &not)
+            && BSON_APPEND_INT32(&not, "$size", 0)
+            && bson_append_document_end(&condition, &not)
+            && bson_append_document_end(doc, &condition);
     }
     else if (head == '%' && tail == '%') {
         strcopy(sql+1, patern, sizeof(patern)-1);
-        snprintf(tmp, sizeof(tmp), "%s", patern);
-        condition = bson_new();
-        BSON_APPEND_UTF8(condition, "$regex", tmp);
+        if (!regex_escape(patern, tmp, sizeof(tmp)))
+            return false;
+    }
+    else if (head == '%' && reversed) {
+        char name[1024];
+        strcopy(sql+1, patern, sizeof(patern)-1);
+        utf8_reverse(patern, tmp);
+        snprintf(name, sizeof(name), "%s%s", key, REVERSED_SUFFIX);
+        return append_prefix(doc, name, tmp);
     }
     else if (head == '%') {
         strcopy(sql+1, patern, sizeof(patern)-1);
-        snprintf(tmp, sizeof(tmp), "%s$", patern);
-        condition = bson_new();
-        BSON_APPEND_UTF8(condition, "$regex", tmp);
+        if (!regex_escape(patern, tmp, sizeof(tmp) - 1))
+            return false;
+        strcat(tmp, "$");
     }
     else if (tail == '%') {
         strcopy(sql, patern, sizeof(patern));
-        snprintf(tmp, sizeof(tmp), "^%s", patern);
-        condition = bson_new();
-        BSON_APPEND_UTF8(condition, "$regex", tmp);
+        return append_prefix(doc, key, patern);
     }
     else {
         ast_log(LOG_WARNING, "not supported condition, \"%s\"\n", sql);
+        return false;
+    }
+    return BSON_APPEND_DOCUMENT_BEGIN(doc, key, &condition)
+        && BSON_APPEND_UTF8(&condition, "$regex", tmp)
+        && bson_append_document_end(doc, &condition);
+}
+
+/*!
+ * \brief operators of a term to query
+ */
+enum query_op {
+    QUERY_SKIP,                 /*!< too long name, ignored */
+    QUERY_EQ,
+    QUERY_LIKE,
+    QUERY_NE,
+    QUERY_GT,
+    QUERY_LTE,
+};
+
+/*!
+ * \brief a term of a query template, made for a field
+ */
+struct query_term {
+    enum query_op op;
+    bool maybe_oid;             /*!< "id" might be queried as _id */
+    bool reversed;              /*!< the field has a reversed shadow field */
+    bson_type_t btype;          /*!< type of values by typed_storage, 0 = strings */
+    char *name;                 /*!< name of field in mongo */
+};
+
+/*!
+ * \brief a compiled query for a shape of fields
+ *
+ * It's never changed once made, so it can be shared without any lock.
+ */
+struct query_template {
+    size_t count;
+    struct query_term *terms;   /*!< a term for each field in order */
+    char shape[0];              /*!< made by query_shape() */
+};
+
+static void query_template_destructor(void *obj)
+{
+    struct query_template *tmpl = obj;
+    size_t i;
+
+    for (i = 0; tmpl->terms && i < tmpl->count; i++)
+        ast_free(tmpl->terms[i].name);
+    ast_free(tmpl->terms);
+}
+
+static int query_template_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct query_template *)obj)->shape;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
     }
+    return ast_str_hash(key);
+}
+
+static int query_template_cmp(void *obj, void *arg, int flags)
+{
+    const struct query_template *tmpl = obj;
+    const char *key;
 
-    if (condition) {
-        // LOG_BSON_AS_JSON(LOG_DEBUG, "generated condition is \"%s\"\n", condition);
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct query_template *)arg)->shape;
+            break;
+        default:
+            return 0;
     }
-    else
-        ast_log(LOG_WARNING, "no condition generated\n");
+    return strcmp(tmpl->shape, key) ? 0 : CMP_MATCH;
+}
 
-    return (const bson_t*)condition;
+/*!
+ * \brief make a shape of query, names of fields with operators without any value.
+ * \retval a thread local string,
+ * \retval NULL if something wrong.
+ */
+static const char *query_shape(const char *table, const struct ast_variable *fields)
+{
+    struct ast_str *buf = ast_str_thread_get(&query_shape_buf, 128);
+
+    if (!buf)
+        return NULL;
+    ast_str_set(&buf, 0, "%s", table);
+    for (; fields; fields = fields->next)
+        ast_str_append(&buf, 0, "\x1e%s", fields->name);
+    return ast_str_buffer(buf);
 }
 
+struct table_config;
+static struct table_config *table_config_get(const char *table);
+static bool table_config_reversed(const struct table_config *tc, const char *field);
+static bool table_config_reversed_len(const struct table_config *tc, const char *field, size_t len);
+static bool table_config_typed(const struct table_config *tc);
+static bool table_projected(const char *table);
+static bool reversed_field(const char *table, const char *field);
+static bson_type_t typed_btype(const char *table, const char *field);
+static bool append_typed(bson_t *doc, const char *key, bson_type_t btype, const char *value);
+
 /*!
- * \brief make a query
- * \param fields
- * \param orderby
- * \retval  a bson object to query,
- * \retval  NULL if something wrong.
+ * \brief compile a query template
+ * \param shape     is made by query_shape()
+ * \param table
+ * \param fields    is a list containing one or more field/operator/value set.
+ * \retval a template,
+ * \retval NULL if the fields are not supported.
  */
-static bson_t *make_query(const struct ast_variable *fields, const char *orderby)
+static struct query_template *query_template_new(const char *shape, const char *table, const struct ast_variable *fields)
 {
-    bson_t *root = NULL;
-    bson_t *query = NULL;
-    bson_t *order = NULL;
+    struct query_template *tmpl;
+    const struct ast_variable *field;
+    size_t i;
 
-    do {
-        bool err;
+    tmpl = ao2_alloc_options(sizeof(*tmpl) + strlen(shape) + 1, query_template_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!tmpl) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    strcpy(tmpl->shape, shape);
+    for (field = fields; field; field = field->next)
+        tmpl->count++;
+    tmpl->terms = ast_calloc(tmpl->count ? tmpl->count : 1, sizeof(*tmpl->terms));
+    if (!tmpl->terms) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        ao2_ref(tmpl, -1);
+        return NULL;
+    }
 
-        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
-        order = orderby ? BCON_NEW(key_asterisk2mongo(orderby), BCON_DOUBLE(1)) : bson_new();
+    for (i = 0, field = fields; field; field = field->next, i++) {
+        struct query_term *term = &tmpl->terms[i];
+        const char *tokens[MAXTOKENS];
+        char buf[1024];
+        int count;
 
-        for(err = false; fields && !err; fields = fields->next) {
-            const bson_t *condition = NULL;
-            const char *tokens[MAXTOKENS];
-            char buf[1024];
-            int count;
-            long long ll_number;
+        if (strlen(field->name) >= (sizeof(buf) - 1)) {
+            ast_log(LOG_WARNING, "too long key, \"%s\".\n", field->name);
+            term->op = QUERY_SKIP;
+            continue;
+        }
+        strcpy(buf, field->name);
+        count = str_split(buf, " ", tokens);
+        if (count == 1) {
+            term->op = QUERY_EQ;
+            term->maybe_oid = strcmp(field->name, "id") == 0;
+            term->btype = typed_btype(table, key_asterisk2mongo(tokens[0]));
+        }
+        else if (count == 2 && !strcasecmp(tokens[1], "LIKE")) {
+            term->op = QUERY_LIKE;
+            term->reversed = reversed_field(table, key_asterisk2mongo(tokens[0]));
+        }
+        else if (count == 2 && (!strcasecmp(tokens[1], "!=") || !strcasecmp(tokens[1], ">") || !strcasecmp(tokens[1], "<="))) {
+            term->op = !strcasecmp(tokens[1], "!=") ? QUERY_NE : !strcasecmp(tokens[1], ">") ? QUERY_GT : QUERY_LTE;
+            term->btype = typed_btype(table, key_asterisk2mongo(tokens[0]));
+        }
+        else {
+            if (count == 2)
+                ast_log(LOG_WARNING, "unexpected operator \"%s\" of \"%s\" \"%s\".\n", tokens[1], field->name, field->value);
+            else
+                ast_log(LOG_WARNING, "not handled, name=%s, value=%s.\n", field->name, field->value);
+            ao2_ref(tmpl, -1);
+            return NULL;
+        }
+        term->name = ast_strdup(key_asterisk2mongo(tokens[0]));
+        if (!term->name) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            ao2_ref(tmpl, -1);
+            return NULL;
+        }
+    }
+    return tmpl;
+}
 
-            if (strlen(fields->name) >= (sizeof(buf) - 1)) {
-                ast_log(LOG_WARNING, "too long key, \"%s\".\n", fields->name);
-                continue;
-            }
-            strcpy(buf, fields->name);
-            count = str_split(buf, " ", tokens);
-            err = true;
+/*!
+ * \brief get a query template, compiling it at the first time.
+ * \retval a reference to the template,
+ * \retval NULL if something wrong.
+ */
+static struct query_template *query_template_get(const struct ast_variable *fields, const char *table)
+{
+    struct query_template *tmpl;
+    struct query_template *found;
+    const char *shape = query_shape(table, fields);
 
-            switch(count) {
-                case 1:
+    if (!shape || !query_templates)
+        return NULL;
+    tmpl = ao2_find(query_templates, shape, OBJ_SEARCH_KEY);
+    if (tmpl)
+        return tmpl;
+
+    tmpl = query_template_new(shape, table, fields);
+    if (!tmpl)
+        return NULL;
+    ao2_lock(query_templates);
+    found = ao2_find(query_templates, shape, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+    if (!found && ao2_container_count(query_templates) < QUERY_TEMPLATE_MAX)
+        ao2_link_flags(query_templates, tmpl, OBJ_NOLOCK);
+    ao2_unlock(query_templates);
+    if (found) {
+        ao2_ref(tmpl, -1);
+        tmpl = found;
+    }
+    return tmpl;
+}
+
+/*!
+ * \brief make a filter from a template and values of the fields
+ * \retval  a bson object to query,
+ * \retval  NULL if something wrong.
+ */
+static bson_t *query_template_apply(const struct query_template *tmpl, const struct ast_variable *fields)
+{
+    bson_t *query;
+    bson_t condition;
+    bool err;
+    size_t i;
+
+    query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+    if (!query) {
+        ast_log(LOG_WARNING, "not enough memory\n");
+        return NULL;
+    }
+    err = false;
+
+    for (i = 0; fields && i < tmpl->count && !err; fields = fields->next, i++) {
+        const struct query_term *term = &tmpl->terms[i];
+        long long ll_number;
+
+        switch (term->op) {
+            case QUERY_SKIP:
+                break;
+            case QUERY_EQ:
 #ifdef HANDLE_ID_AS_OID
-                    if ((strcmp(fields->name, "id") == 0)
-                    &&  bson_oid_is_valid(fields->value, strlen(fields->value))) {
-                        bson_oid_t oid;
-                        bson_oid_init_from_string(&oid, fields->value);
-                        err = !BSON_APPEND_OID(query, "_id", &oid);
-                    }
-                    else
+                if (term->maybe_oid && bson_oid_is_valid(fields->value, strlen(fields->value))) {
+                    bson_oid_t oid;
+                    bson_oid_init_from_string(&oid, fields->value);
+                    err = !BSON_APPEND_OID(query, "_id", &oid);
+                    break;
+                }
 #endif
-                        err = !BSON_APPEND_UTF8(query, key_asterisk2mongo(fields->name), fields->value);
+                if (term->btype)
+                    err = !append_typed(query, term->name, term->btype, fields->value);
+                else
+                    err = !BSON_APPEND_UTF8(query, term->name, fields->value);
+                break;
+            case QUERY_LIKE:
+                err = !append_condition(query, term->name, fields->value, term->reversed);
+                break;
+            case QUERY_NE:
+                // { name: { "$exists" : true, "$ne" : value } }
+                err = !BSON_APPEND_DOCUMENT_BEGIN(query, term->name, &condition)
+                    || !BSON_APPEND_BOOL(&condition, "$exists", true)
+                    || !(term->btype ? append_typed(&condition, "$ne", term->btype, fields->value)
+                                     : BSON_APPEND_UTF8(&condition, "$ne", fields->value))
+                    || !bson_append_document_end(query, &condition);
+                break;
+            case QUERY_GT:
+            case QUERY_LTE:
+                // { name: { "$gt" or "$lte" : value } }
+                err = !BSON_APPEND_DOCUMENT_BEGIN(query, term->name, &condition);
+                if (err)
                     break;
-                case 2:
-                    if (!strcasecmp(tokens[1], "LIKE")) {
-                        condition = make_condition(fields->value);
-                    }
-                    else if (!strcasecmp(tokens[1], "!=")) {
-                        // {
-                        //     tokens[0]: {
-                        //         "$exists" : true,
-                        //         "$ne" : value
-                        //     }
-                        // }
-                        condition = BCON_NEW(
-                            "$exists", BCON_BOOL(1),
-                            "$ne", BCON_UTF8(fields->value)
-                        );
-                    }
-                    else if (!strcasecmp(tokens[1], ">")) {
-                        // {
-                        //     tokens[0]: {
-                        //         "$gt" : value
-                        //     }
-                        // }
-                        if (is_integer(fields->value, &ll_number))
-                            condition = BCON_NEW("$gt", BCON_INT64(ll_number));
-                        else
-                            condition = BCON_NEW("$gt", BCON_UTF8(fields->value));
-                    }
-                    else if (!strcasecmp(tokens[1], "<=")) {
-                        // {
-                        //     tokens[0]: {
-                        //         "$lte" : value
-                        //     }
-                        // }
-                        if (is_integer(fields->value, &ll_number))
-                            condition = BCON_NEW("$lte", BCON_INT64(ll_number));
-                        else
-                            condition = BCON_NEW("$lte", BCON_UTF8(fields->value));
-                    }
-                    else {
-                        ast_log(LOG_WARNING, "unexpected operator \"%s\" of \"%s\" \"%s\".\n", tokens[1], fields->name, fields->value);
-                        break;
-                    }
-                    if (!condition) {
-                        ast_log(LOG_ERROR, "something wrong.\n");
-                        break;
-                    }
-
-                    err = !BSON_APPEND_DOCUMENT(query, key_asterisk2mongo(tokens[0]), condition);
-
-                    break;
-                default:
-                    ast_log(LOG_WARNING, "not handled, name=%s, value=%s.\n", fields->name, fields->value);
-            }
-            if (condition)
-                bson_destroy((bson_t*)condition);
-            else if (count > 1) {
-                ast_log(LOG_ERROR, "something wrong.\n");
+                if (term->btype)
+                    err = !append_typed(&condition, term->op == QUERY_GT ? "$gt" : "$lte", term->btype, fields->value);
+                else if (is_integer(fields->value, &ll_number))
+                    err = !BSON_APPEND_INT64(&condition, term->op == QUERY_GT ? "$gt" : "$lte", ll_number);
+                else
+                    err = !BSON_APPEND_UTF8(&condition, term->op == QUERY_GT ? "$gt" : "$lte", fields->value);
+                err = !bson_append_document_end(query, &condition) || err;
                 break;
-            }
-        }
-        if (err) {
-            ast_log(LOG_ERROR, "something wrong.\n");
-            break;
-        }
-        root = BCON_NEW("$query", BCON_DOCUMENT(query),
-                        "$orderby", BCON_DOCUMENT(order));
-        if (!root) {    // current BCON_NEW might not return any error such as NULL...
-            ast_log(LOG_WARNING, "not enough memory\n");
-            break;
         }
-    } while(0);
-    if (query)
+    }
+    if (err) {
+        ast_log(LOG_ERROR, "something wrong.\n");
         bson_destroy(query);
-    if (order)
-        bson_destroy(order);
-    // if (root) {
-    //     LOG_BSON_AS_JSON(LOG_DEBUG, "generated query is %s\n", root);
-    // }
-    return root;
+        return NULL;
+    }
+    return query;
 }
 
 /*!
- * \brief   check if the models library has specified collection.
- * \param   collection  is name of model to be retrieved.
- * \retval  true if the library poses the specified collection or any error,
- * \retval  false if not exist.
+ * \brief make a filter to query
+ * \param fields
+ * \param table     is name of collection, the shape of fields is compiled per collection.
+ * \retval  a bson object to query,
+ * \retval  NULL if something wrong.
  */
-static bool model_check(const char* collection)
+static bson_t *make_query(const struct ast_variable *fields, const char *table)
 {
-    bson_iter_t iter;
-    return bson_iter_init(&iter, models) && bson_iter_find(&iter, collection);
+    struct query_template *tmpl = query_template_get(fields, table);
+    bson_t *query;
+
+    if (!tmpl)
+        return NULL;
+    query = query_template_apply(tmpl, fields);
+    ao2_ref(tmpl, -1);
+    return query;
+}
+
+static int query_template_init(void)
+{
+    if (query_templates)
+        return 0;
+    query_templates = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, CACHE_BUCKETS,
+                                               query_template_hash, NULL, query_template_cmp);
+    if (!query_templates) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return -1;
+    }
+    return 0;
 }
 
 /*!
- * \param[in]   model_name  is name of model to be retrieved.
- * \param[in]   property
- * \param[in]   value
- * \retval  bson type
+ * \brief forget all templates, which depend on options of tables
  */
-static bson_type_t model_get_btype(const char* model_name, const char* property, const char* value)
+static void query_template_purge(void)
 {
-    bson_type_t btype = BSON_TYPE_UNDEFINED;
-    bson_iter_t iroot;
-    bson_iter_t imodel;
+    if (query_templates)
+        ao2_callback(query_templates, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL);
+}
 
-    ast_mutex_lock(&model_lock);
-    do {
-        if (value) {
-            if (is_bool(value, NULL))
-                btype = BSON_TYPE_BOOL;
-            else if (is_real(value, NULL))
-                btype = BSON_TYPE_DOUBLE;
-            else
-                btype = BSON_TYPE_UTF8;
-        }
-        if (model_check(model_name) &&
-            bson_iter_init_find (&iroot, models, model_name) &&
-            BSON_ITER_HOLDS_DOCUMENT (&iroot) &&
-            bson_iter_recurse (&iroot, &imodel) &&
-            bson_iter_find(&imodel, property))
-        {
-            btype = (bson_type_t)bson_iter_as_int64(&imodel);
-        }
-    } while(0);
-    ast_mutex_unlock(&model_lock);
-    return btype;
+static void query_template_destroy(void)
+{
+    ao2_cleanup(query_templates);
+    query_templates = NULL;
 }
 
-static void model_register(const char *collection, const bson_t *model)
+/*!
+ * \brief   check if a value matches the sql pattern as append_condition() does.
+ * \param   value   is a value to be tested
+ * \param   sql     is pattern for sql
+ * \retval  true if it matches.
+ */
+static bool like_match(const char* value, const char* sql)
 {
-    ast_mutex_lock(&model_lock);
-    do {
-        if (model_check(collection))
-            ast_log(LOG_DEBUG, "%s already registered\n", collection);
-        else if (!BSON_APPEND_DOCUMENT(models, collection, model))
-            ast_log(LOG_ERROR, "cannot register %s\n", collection);
-        else {
-            LOG_BSON_AS_JSON(LOG_DEBUG, "models is \"%s\"\n", models);
+    char patern[1020];
+    size_t sql_len = strlen(sql);
+    size_t value_len = strlen(value);
+    size_t patern_len;
+    char head = *sql;
+    char tail = sql_len ? sql[sql_len - 1] : '\0';
+
+    if (strcmp(sql, "%") == 0)
+        return true;
+    if (head == '%')
+        strcopy(sql+1, patern, sizeof(patern)-1);
+    else if (tail == '%')
+        strcopy(sql, patern, sizeof(patern));
+    else
+        return false;
+    patern_len = strlen(patern);
+
+    if (head == '%' && tail == '%')
+        return strstr(value, patern) != NULL;
+    if (patern_len > value_len)
+        return false;
+    if (head == '%')
+        return strcmp(value + value_len - patern_len, patern) == 0;
+    return strncmp(value, patern, patern_len) == 0;
+}
+
+/*!
+ * \brief check if a key-value list matches the fields to query.
+ * \param vars      is a key-value list made from a document
+ * \param fields    is a list containing one or more field/operator/value set.
+ * \retval true if it matches,
+ * \retval false if not or it cannot be evaluated.
+ */
+static bool match_fields(const struct ast_variable *vars, const struct ast_variable *fields)
+{
+    for (; fields; fields = fields->next) {
+        const struct ast_variable *var;
+        const char *tokens[MAXTOKENS];
+        const char *name;
+        char buf[1024];
+        long long lhs;
+        long long rhs;
+        int count;
+        int cmp;
+
+        if (strlen(fields->name) >= (sizeof(buf) - 1))
+            return false;
+        strcpy(buf, fields->name);
+        count = str_split(buf, " ", tokens);
+        if (count < 1 || count > 2)
+            return false;
+        name = key_asterisk2mongo(tokens[0]);
+#ifdef HANDLE_ID_AS_OID
+        if ((count == 1)
+        &&  (strcmp(tokens[0], "id") == 0)
+        &&  bson_oid_is_valid(fields->value, strlen(fields->value)))
+            name = "_id";
+#endif
+        for (var = vars; var && strcmp(var->name, name); var = var->next)
+            ;
+        if (!var)
+            return false;
+
+        if (count == 1) {
+            cmp = strcmp(name, "_id") ? strcmp(var->value, fields->value) : strcasecmp(var->value, fields->value);
+            if (cmp)
+                return false;
         }
-    } while(0);
-    ast_mutex_unlock(&model_lock);
+        else if (!strcasecmp(tokens[1], "LIKE")) {
+            if (!like_match(var->value, fields->value))
+                return false;
+        }
+        else if (!strcasecmp(tokens[1], "!=")) {
+            if (!strcmp(var->value, fields->value))
+                return false;
+        }
+        else if (!strcasecmp(tokens[1], ">") || !strcasecmp(tokens[1], "<=")) {
+            if (*var->value && *fields->value
+            &&  is_integer(fields->value, &rhs) && is_integer(var->value, &lhs))
+                cmp = (lhs > rhs) - (lhs < rhs);
+            else
+                cmp = strcmp(var->value, fields->value);
+            if (!strcasecmp(tokens[1], ">") ? (cmp <= 0) : (cmp > 0))
+                return false;
+        }
+        else
+            return false;
+    }
+    return true;
 }
 
-static bson_type_t rtype2btype (require_type rtype)
+/*!
+ * \brief   bson type to store a type required
+ * \param   typed   is true to store integers as int32 or int64 and dates as dates,
+ *                  false to store all numbers as double and dates as strings.
+ */
+static bson_type_t rtype2btype(require_type rtype, bool typed)
 {
     bson_type_t btype;
     switch(rtype) {
@@ -451,14 +1133,20 @@ static bson_type_t rtype2btype (require_type rtype)
         case RQ_INTEGER3:
         case RQ_UINTEGER3:
         case RQ_INTEGER4:
+            btype = typed ? BSON_TYPE_INT32 : BSON_TYPE_DOUBLE;
+            break;
         case RQ_UINTEGER4:
         case RQ_INTEGER8:
         case RQ_UINTEGER8:
+            btype = typed ? BSON_TYPE_INT64 : BSON_TYPE_DOUBLE;
+            break;
         case RQ_FLOAT:
             btype = BSON_TYPE_DOUBLE;
             break;
         case RQ_DATE:
         case RQ_DATETIME:
+            btype = typed ? BSON_TYPE_DATE_TIME : BSON_TYPE_UTF8;
+            break;
         case RQ_CHAR:
             btype = BSON_TYPE_UTF8;
             break;
@@ -470,1009 +1158,7570 @@ static bson_type_t rtype2btype (require_type rtype)
 }
 
 /*!
- *  Make a document from key-value list
+ * \brief   a field of a compiled schema
+ */
+struct schema_field {
+    char *name;                 /*!< NULL for an empty slot */
+    require_type rtype;         /*!< required */
+    bson_type_t btype;          /*!< to store by default */
+    bson_type_t typed;          /*!< to store by typed_storage */
+};
+
+/*!
+ * \brief   a model required of a table, compiled into a hash of its fields.
+ *          immutable once published, so that it's read without any lock.
+ */
+struct schema {
+    struct schema *next;        /*!< in schema_all to be freed at unload */
+    unsigned mask;              /*!< number of slots - 1, a power of 2 - 1 */
+    unsigned count;             /*!< number of fields */
+    struct schema_field *slots; /*!< open addressing by hash of name */
+    struct schema_plan *plans;  /*!< compiled by fields2doc(), see struct schema_plan */
+    char table[0];
+};
+
+/*!
+ * \brief   schemas of all the tables required, immutable once published.
  *
- *  \param[in]  table
- *  \param[in]  fields
- *  \param[out] doc
- *  \retval  true if success
-*/
-static bool fields2doc(const char* table, const struct ast_variable *fields, bson_t *doc)
+ * schema_register() publishes a new version with a schema added instead of
+ * changing the current one, and readers take neither lock nor reference.
+ * Former versions are kept until unload, since a reader may still be looking
+ * at one, and they are as many as the tables required.
+ */
+struct schema_registry {
+    struct schema_registry *retired;    /*!< former version */
+    unsigned mask;                      /*!< number of slots - 1, a power of 2 - 1 */
+    struct schema *slots[0];            /*!< open addressing by hash of table */
+};
+
+/*!
+ * \brief   number of slots of a hash of count entries, at most half full
+ */
+static unsigned schema_slots(unsigned count)
 {
-    bool err;
-    const char* key;
+    unsigned slots = 8;
 
-    for (err = false; fields && !err; fields = fields->next) {
-        bson_type_t btype;
+    while (slots < count * 2)
+        slots <<= 1;
+    return slots;
+}
 
-        if (strlen(fields->value) == 0)
-            continue;
-        key = key_asterisk2mongo(fields->name);
-        btype = model_get_btype(table, key, fields->value);
-        switch(btype) {
-            case BSON_TYPE_UTF8:
-                err = !BSON_APPEND_UTF8(doc, key, fields->value);
-                break;
-            case BSON_TYPE_BOOL:
-                err = !BSON_APPEND_BOOL(doc, key,
-                    strcmp(fields->value, "true") ? false : true);
-                break;
-            case BSON_TYPE_INT32:
-                err = !BSON_APPEND_INT32(doc, key, atol(fields->value));
-                break;
-            case BSON_TYPE_INT64:
-                err = !BSON_APPEND_INT64(doc, key, atoll(fields->value));
-                break;
-            case BSON_TYPE_DOUBLE:
-                err = !BSON_APPEND_DOUBLE(doc, key, atof(fields->value));
-                break;
-            default:
-                ast_log(LOG_WARNING, "unexpected data type: key=%s, value=%s\n", key, fields->value);
-                break;
-        }
+/*!
+ * \brief   look up the schema of a table in a version of the registry
+ * \retval  NULL if the table is not there.
+ */
+static const struct schema *schema_lookup(const struct schema_registry *registry, const char *table)
+{
+    unsigned i;
+
+    if (!registry || !table)
+        return NULL;
+    for (i = ast_str_hash(table) & registry->mask; registry->slots[i]; i = (i + 1) & registry->mask) {
+        if (!strcmp(registry->slots[i]->table, table))
+            return registry->slots[i];
     }
-    return !err;
+    return NULL;
 }
 
 /*!
- *  Get a value from a document
- *
- *  \param[in,out]  iter    is a bson iterator of a document
- *  \param[out]     key     is stored pointer to key name of value
- *  \param[out]     value   is a buffer to be stored a string of value
- *  \param[in]      size    is size of buffer for value
- *  \retval  true if value is valid.
-*/
-static bool doc2value(bson_iter_t* iter, const char** key, char value[], int size)
+ * \brief   look up the schema of a table without any lock
+ * \retval  NULL if the table has not been required.
+ */
+static const struct schema *schema_get(const char *table)
 {
-    if (size < 25) {
-        ast_log(LOG_ERROR, "size of value is too small\n");
-        return false;
-    }
-    if (BSON_ITER_HOLDS_OID(iter)) {
-        const bson_oid_t * oid;
-        if (strcmp(bson_iter_key(iter), SERVERID) == 0) {
-            // SERVERID is hidden property for application
-            return false;
-        }
-        oid = bson_iter_oid(iter);
-        bson_oid_to_string(oid, value);
-    }
-    else if (BSON_ITER_HOLDS_UTF8(iter)) {
-        uint32_t length;
-        const char* str = bson_iter_utf8(iter, &length);
-        if (!bson_utf8_validate(str, length, false)) {
-            ast_log(LOG_WARNING, "unexpected invalid bson found\n");
-            return false;
-        }
-        snprintf(value, size, "%s", str);
-    }
-    else if (BSON_ITER_HOLDS_BOOL(iter)) {
-        bool d = bson_iter_bool(iter);
-        snprintf(value, size, "%s", d ? "true" : "false");
-    }
-    else if (BSON_ITER_HOLDS_INT32(iter)) {
-        long d = bson_iter_int32(iter);
-        snprintf(value, size, "%ld", d);
-    }
-    else if (BSON_ITER_HOLDS_INT64(iter)) {
-        long long d = bson_iter_int64(iter);
-        snprintf(value, size, "%Ld", d);
-    }
-    else if (BSON_ITER_HOLDS_DOUBLE(iter)) {
-        double d = bson_iter_double(iter);
-        snprintf(value, size, "%.10g", d);
+    return schema_lookup(__atomic_load_n(&schemas, __ATOMIC_ACQUIRE), table);
+}
+
+/*!
+ * \brief   look up a field of a schema
+ * \retval  NULL if the field is not in the schema.
+ */
+static const struct schema_field *schema_field(const struct schema *schema, const char *name)
+{
+    unsigned i;
+
+    for (i = ast_str_hash(name) & schema->mask; schema->slots[i].name; i = (i + 1) & schema->mask) {
+        if (!strcmp(schema->slots[i].name, name))
+            return &schema->slots[i];
     }
-    else {
-        // see http://api.mongodb.org/libbson/current/bson_iter_type.html
-        ast_log(LOG_WARNING, "unexpected bson type, %x\n", bson_iter_type(iter));
-        return false;
+    return NULL;
+}
+
+/*!
+ * \param[in]   schema      is of the table, or NULL if not required.
+ * \param[in]   property
+ * \param[in]   value
+ * \param[in]   typed       is true by typed_storage of the table.
+ * \retval  bson type of the schema, or inferred from the value if the field is not there.
+ */
+static bson_type_t schema_btype(const struct schema *schema, const char* property, const char* value, bool typed)
+{
+    const struct schema_field *field = schema ? schema_field(schema, property) : NULL;
+
+    if (field)
+        return typed ? field->typed : field->btype;
+    if (!value)
+        return BSON_TYPE_UNDEFINED;
+    if (is_bool(value, NULL))
+        return BSON_TYPE_BOOL;
+    if (is_small_int(value) || is_real(value, NULL))
+        return BSON_TYPE_DOUBLE;
+    return BSON_TYPE_UTF8;
+}
+
+static void schema_plans_free(struct schema_plan *plans);
+
+static void schema_free(struct schema *schema)
+{
+    unsigned i;
+
+    schema_plans_free(schema->plans);
+    if (schema->slots) {
+        for (i = 0; i <= schema->mask; i++)
+            ast_free(schema->slots[i].name);
+        ast_free(schema->slots);
     }
-    *key = key_mongo2asterisk(bson_iter_key(iter));
-    return true;
+    ast_free(schema);
 }
 
 /*!
- * \brief Update documents in collection that match selector.
- * \param[in] collection    is a mongoc_collection_t.
- * \param[in] selector      is a bson_t containing the query to match documents for updating.
- * \param[in] update        is a bson_t containing the update to perform.
- *
- * \retval number of rows affected
- * \retval -1 on failure
-*/
-static int _collection_update(
-    mongoc_collection_t *collection, const bson_t *selector, const bson_t *update)
+ * \brief   compile a model, a document of field names to require types.
+ */
+static struct schema *schema_compile(const char *table, const bson_t *model)
 {
-    int ret = -1;
-    bson_t *cmd = NULL;
-    bson_t *opts = NULL;
-    bson_t *updates = NULL;
-    bson_t array = BSON_INITIALIZER;
-    bson_t reply = BSON_INITIALIZER;
+    struct schema *schema = ast_calloc(1, sizeof(*schema) + strlen(table) + 1);
+    bson_iter_t iter;
 
-    LOG_BSON_AS_JSON(LOG_DEBUG, "selector=%s\n", selector);
-    LOG_BSON_AS_JSON(LOG_DEBUG, "update=%s\n", update);
+    if (!schema)
+        return NULL;
+    strcpy(schema->table, table);
+    schema->mask = schema_slots(bson_count_keys(model)) - 1;
+    schema->slots = ast_calloc(schema->mask + 1, sizeof(*schema->slots));
+    if (!schema->slots || !bson_iter_init(&iter, model)) {
+        schema_free(schema);
+        return NULL;
+    }
+    while (bson_iter_next(&iter)) {
+        const char *name = bson_iter_key(&iter);
+        unsigned i = ast_str_hash(name) & schema->mask;
+
+        while (schema->slots[i].name && strcmp(schema->slots[i].name, name))
+            i = (i + 1) & schema->mask;
+        if (!schema->slots[i].name) {
+            if (!(schema->slots[i].name = ast_strdup(name))) {
+                schema_free(schema);
+                return NULL;
+            }
+            schema->count++;
+        }
+        schema->slots[i].rtype = bson_iter_as_int64(&iter);
+        schema->slots[i].btype = rtype2btype(bson_iter_as_int64(&iter), false);
+        schema->slots[i].typed = rtype2btype(bson_iter_as_int64(&iter), true);
+    }
+    return schema;
+}
 
-    do {
-        bson_error_t error;
-        bson_iter_t iter;
+static void schema_link(struct schema_registry *registry, struct schema *schema)
+{
+    unsigned i = ast_str_hash(schema->table) & registry->mask;
 
-        opts = bson_new();
-        updates = BCON_NEW(
-            "q", BCON_DOCUMENT(selector),
-            "u", BCON_DOCUMENT(update),
-            "multi", BCON_BOOL(true)
-        );
-        bson_append_document(&array, "0", -1, updates);
-        cmd = BCON_NEW(
-           "update", BCON_UTF8(mongoc_collection_get_name(collection)),
-           "updates", BCON_ARRAY(&array)
-        );
+    while (registry->slots[i])
+        i = (i + 1) & registry->mask;
+    registry->slots[i] = schema;
+}
 
-        if (!mongoc_collection_write_command_with_opts(
-            collection, cmd, opts, &reply, &error))
-        {
-            ast_log(LOG_ERROR, "update failed, error=%s\n", error.message);
-            LOG_BSON_AS_JSON(LOG_ERROR, "cmd=%s\n", cmd);
+static void schema_register(const char *table, const bson_t *model)
+{
+    ast_mutex_lock(&schema_lock);
+    do {
+        struct schema_registry *former = schemas;
+        struct schema_registry *registry;
+        struct schema *schema;
+        unsigned count = 1;
+        unsigned slots;
+        unsigned i;
+
+        if (schema_get(table)) {
+            ast_log(LOG_DEBUG, "%s already registered\n", table);
             break;
         }
-        LOG_BSON_AS_JSON(LOG_DEBUG, "reply=%s\n", &reply);
-
-        if (!bson_iter_init(&iter, &reply)
-        || !bson_iter_find(&iter, "nModified")
-        || !BSON_ITER_HOLDS_INT32(&iter)) {
-            ast_log(LOG_ERROR, "no \"nModified\" field found.\n");
+        for (i = 0; former && i <= former->mask; i++)
+            count += former->slots[i] != NULL;
+        slots = schema_slots(count);
+        if (!(schema = schema_compile(table, model)) ||
+            !(registry = ast_calloc(1, sizeof(*registry) + slots * sizeof(registry->slots[0])))) {
+            ast_log(LOG_ERROR, "cannot register %s\n", table);
+            if (schema)
+                schema_free(schema);
             break;
         }
-        ret = bson_iter_int32(&iter);
+        registry->mask = slots - 1;
+        registry->retired = former;
+        for (i = 0; former && i <= former->mask; i++) {
+            if (former->slots[i])
+                schema_link(registry, former->slots[i]);
+        }
+        schema_link(registry, schema);
+        schema->next = schema_all;
+        schema_all = schema;
+        __atomic_store_n(&schemas, registry, __ATOMIC_RELEASE);
+        // templates compiled before may query typed fields by strings
+        query_template_purge();
+        ast_log(LOG_DEBUG, "%s registered with %u fields, %u tables\n", table, schema->count, count);
     } while(0);
-
-    bson_destroy(&reply);
-    bson_destroy(&array);
-    if (updates)
-        bson_destroy(updates);
-    if (opts)
-        bson_destroy(opts);
-    if (cmd)
-        bson_destroy(cmd);
-    return ret;
+    ast_mutex_unlock(&schema_lock);
 }
 
 /*!
- * \brief Execute an SQL query and return ast_variable list
- * \param database  is name of database
- * \param table     is name of collection to find specified records
- * \param ap list containing one or more field/operator/value set.
- *
- * Select database and perform query on table, prepare the sql statement
- * Sub-in the values to the prepared statement and execute it. Return results
- * as a ast_variable list.
- *
- * \retval var on success
- * \retval NULL on failure
- *
- * \see http://api.mongodb.org/c/current/finding-document.html
-*/
-static struct ast_variable *realtime(const char *database, const char *table, const struct ast_variable *fields)
+ * \brief   free all the versions of the registry and the schemas, at unload.
+ */
+static void schema_destroy(void)
 {
-    struct ast_variable *var = NULL;
-    mongoc_client_t *dbclient;
-    mongoc_collection_t *collection = NULL;
-    mongoc_cursor_t *cursor = NULL;
-    const bson_t *doc = NULL;
-    bson_t *query = NULL;
-
-    if (!database || !table || !fields) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return NULL;
+    struct schema_registry *registry = schemas;
+    struct schema *schema;
+
+    schemas = NULL;
+    while (registry) {
+        struct schema_registry *retired = registry->retired;
+        ast_free(registry);
+        registry = retired;
     }
-    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+    while ((schema = schema_all)) {
+        schema_all = schema->next;
+        schema_free(schema);
+    }
+}
 
-    if(dbpool == NULL) {
-        ast_log(LOG_ERROR, "no connection pool\n");
-        return NULL;
+/*!
+ * \brief append a field to a projection unless it's there.
+ */
+static bool append_projected(bson_t *projection, const char *field)
+{
+    return bson_has_field(projection, field) || BSON_APPEND_INT32(projection, field, 1);
+}
+
+/*!
+ * \brief make a projection of the fields of a model
+ * \param[in]   table       is name of model to be retrieved.
+ * \param[out]  projection  is appended the fields
+ * \retval  true if the model is registered.
+ */
+static bool schema_projection(const char* table, bson_t *projection)
+{
+    const struct schema *schema = schema_get(table);
+    bool found = schema != NULL;
+    unsigned i;
+
+    for (i = 0; found && i <= schema->mask; i++) {
+        if (schema->slots[i].name)
+            found = append_projected(projection, schema->slots[i].name);
     }
+    return found;
+}
 
-    dbclient = mongoc_client_pool_pop(dbpool);
-    if(dbclient == NULL) {
-        ast_log(LOG_ERROR, "no client allocated\n");
-        return NULL;
+/*!
+ * \brief   append a value to a document as a bson type
+ * \param   tc      is options of the table for reversed shadow fields, or NULL.
+ * \retval  false if the document cannot be appended.
+ */
+typedef bool (*value_converter)(bson_t *doc, const char *key, const char *value, const struct table_config *tc);
+
+static bool convert_utf8(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
+{
+    if (!BSON_APPEND_UTF8(doc, key, value))
+        return false;
+    if (table_config_reversed(tc, key)) {
+        // shadow field to query "%patern" by an index
+        char *name = ast_alloca(strlen(key) + sizeof(REVERSED_SUFFIX));
+        char *shadow = ast_alloca(strlen(value) + 1);
+        sprintf(name, "%s%s", key, REVERSED_SUFFIX);
+        utf8_reverse(value, shadow);
+        return BSON_APPEND_UTF8(doc, name, shadow);
     }
+    return true;
+}
 
-    do {
-        query = make_query(fields, NULL);
-        if(query == NULL) {
-            ast_log(LOG_ERROR, "cannot make a query to find\n");
-            break;
-        }
-        LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s, database=%s, table=%s\n", query, database, table);
+static bool convert_bool(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
+{
+    return BSON_APPEND_BOOL(doc, key, value[0] == 't' && !strcmp(value, "true"));
+}
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
-        cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 1, 0, query, NULL, NULL);
-        if (!cursor) {
-            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s, database=%s, table=%s\n", query, database, table);
-            break;
-        }
-        if (mongoc_cursor_next(cursor, &doc)) {
-            bson_iter_t iter;
-            const char* key;
-            const char* value;
-            char work[128];
-            struct ast_variable *prev = NULL;
+static bool convert_int32(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
+{
+    return BSON_APPEND_INT32(doc, key, (int32_t)str2int(value));
+}
 
-            LOG_BSON_AS_JSON(LOG_DEBUG, "query found %s\n", doc);
+static bool convert_int64(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
+{
+    return BSON_APPEND_INT64(doc, key, str2int(value));
+}
 
-            if (!bson_iter_init(&iter, doc)) {
-                ast_log(LOG_ERROR, "unexpected bson error!\n");
-                break;
-            }
-            while (bson_iter_next(&iter)) {
-                if (!doc2value(&iter, &key, work, sizeof(work)))
-                    continue;
-                value = work;
-                if (prev) {
-                    prev->next = ast_variable_new(key, value, "");
-                    if (prev->next)
-                        prev = prev->next;
-                }
-                else
-                    prev = var = ast_variable_new(key, value, "");
-            }
-        }
-    } while(0);
+static bool convert_double(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
+{
+    return BSON_APPEND_DOUBLE(doc, key, is_small_int(value) ? (double)str2int(value) : atof(value));
+}
 
-    if (doc)
-        bson_destroy((bson_t *)doc);
-    if (query)
-        bson_destroy((bson_t *)query);
-    if (cursor)
-        mongoc_cursor_destroy(cursor);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
-    return var;
+static bool convert_date(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
+{
+    int64_t msec;
+
+    // a value not a date, e.g. "0000-00-00", is kept as it is
+    return str2date(value, &msec) ? BSON_APPEND_DATE_TIME(doc, key, msec) : convert_utf8(doc, key, value, tc);
 }
 
-/*!
- * \brief Execute an Select query and return ast_config list
- * \param database  is name of database
- * \param table     is name of collection to find specified records
- * \param fields    is a list containing one or more field/operator/value set.
- *
- * Select database and preform query on table, prepare the sql statement
- * Sub-in the values to the prepared statement and execute it.
- * Execute this prepared query against MongoDB.
- * Return results as an ast_config variable.
- *
- * \retval var on success
- * \retval NULL on failure
- *
- * \see http://api.mongodb.org/c/current/finding-document.html
-*/
-static struct ast_config* realtime_multi(const char *database, const char *table, const struct ast_variable *fields)
+static bool convert_unexpected(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
 {
-    struct ast_config *cfg = NULL;
-    struct ast_category *cat = NULL;
-    struct ast_variable *var = NULL;
-    mongoc_collection_t *collection = NULL;
-    mongoc_cursor_t* cursor = NULL;
-    mongoc_client_t* dbclient = NULL;
-    const bson_t* doc = NULL;
-    const bson_t* query = NULL;
-    const char *initfield;
-    char *op;
+    ast_log(LOG_WARNING, "unexpected data type: key=%s, value=%s\n", key, value);
+    return true;
+}
 
-    if (!database || !table || !fields) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return NULL;
+static value_converter converter_of(bson_type_t btype)
+{
+    switch(btype) {
+        case BSON_TYPE_UTF8:
+            return convert_utf8;
+        case BSON_TYPE_BOOL:
+            return convert_bool;
+        case BSON_TYPE_INT32:
+            return convert_int32;
+        case BSON_TYPE_INT64:
+            return convert_int64;
+        case BSON_TYPE_DOUBLE:
+            return convert_double;
+        case BSON_TYPE_DATE_TIME:
+            return convert_date;
+        default:
+            return convert_unexpected;
     }
-    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+}
 
-    if(dbpool == NULL) {
-        ast_log(LOG_ERROR, "no connection pool\n");
+/*!
+ * \brief   append a value of a query by the type stored
+ */
+static bool append_typed(bson_t *doc, const char *key, bson_type_t btype, const char *value)
+{
+    if (!*value)
+        return BSON_APPEND_UTF8(doc, key, value);
+    return converter_of(btype)(doc, key, value, NULL);
+}
+
+/*!
+ * \brief   converter of a field not in the model, inferring the type from the value
+ */
+static bool convert_inferred(bson_t *doc, const char *key, const char *value, const struct table_config *tc)
+{
+    return converter_of(schema_btype(NULL, key, value, false))(doc, key, value, tc);
+}
+
+/*!
+ * \brief   a step of a plan, converting a field
+ */
+struct schema_step {
+    const char *name;           /*!< of the field in asterisk */
+    const char *key;            /*!< of the field in mongodb */
+    value_converter convert;    /*!< to store by default */
+    value_converter typed;      /*!< to store by typed_storage */
+};
+
+/*!
+ * \brief   converters of the fields of a table in the order passed by the caller,
+ *          compiled once from the schema since sorcery always passes the same order.
+ *          immutable once published, kept until unload as the schema is.
+ */
+struct schema_plan {
+    struct schema_plan *next;
+    unsigned depth;             /*!< number of plans of the schema up to this */
+    unsigned count;             /*!< number of steps */
+    struct schema_step steps[0];    /*!< followed by names of the fields */
+};
+
+/*!
+ * \brief   compile a plan of the fields of a schema
+ */
+static struct schema_plan *schema_plan_compile(const struct schema *schema, const struct ast_variable *fields)
+{
+    const struct ast_variable *field;
+    struct schema_plan *plan;
+    unsigned count = 0;
+    size_t size = 0;
+    char *names;
+
+    for (field = fields; field; field = field->next) {
+        count++;
+        size += strlen(field->name) + 1;
+    }
+    plan = ast_calloc(1, sizeof(*plan) + count * sizeof(plan->steps[0]) + size);
+    if (!plan)
         return NULL;
+    plan->count = count;
+    names = (char *)&plan->steps[count];
+    for (count = 0, field = fields; field; field = field->next, count++) {
+        struct schema_step *step = &plan->steps[count];
+        const struct schema_field *f;
+
+        step->name = strcpy(names, field->name);
+        names += strlen(names) + 1;
+        step->key = key_asterisk2mongo(step->name);
+        f = schema_field(schema, step->key);
+        step->convert = f ? converter_of(f->btype) : convert_inferred;
+        step->typed = f ? converter_of(f->typed) : convert_inferred;
     }
+    return plan;
+}
 
-    dbclient = mongoc_client_pool_pop(dbpool);
-    if(dbclient == NULL) {
-        ast_log(LOG_ERROR, "no client allocated\n");
-        return NULL;
+static void schema_plans_free(struct schema_plan *plans)
+{
+    while (plans) {
+        struct schema_plan *next = plans->next;
+        ast_free(plans);
+        plans = next;
     }
-    initfield = ast_strdupa(fields->name);
-    if ((op = strchr(initfield, ' '))) {
-        *op = '\0';
+}
+
+/*!
+ * \brief   find the plan of fields in the order passed, or compile one.
+ * \retval  NULL if the schema has too many plans already or on error.
+ */
+static const struct schema_plan *schema_plan_get(struct schema *schema, const struct ast_variable *fields)
+{
+    struct schema_plan *head = __atomic_load_n(&schema->plans, __ATOMIC_ACQUIRE);
+    struct schema_plan *plan;
+
+    for (plan = head; plan; plan = plan->next) {
+        const struct ast_variable *field = fields;
+        unsigned i;
+
+        for (i = 0; i < plan->count && field && !strcmp(plan->steps[i].name, field->name); i++)
+            field = field->next;
+        if (i == plan->count && !field)
+            return plan;
     }
+    if (head && head->depth >= SCHEMA_PLANS_MAX)
+        return NULL;
+    if (!(plan = schema_plan_compile(schema, fields)))
+        return NULL;
+    // prepend it, a racing thread may publish the same plan, which is harmless
     do {
-        query = make_query(fields, initfield);
-        if(query == NULL) {
-            ast_log(LOG_ERROR, "cannot make a query to find\n");
-            break;
+        plan->next = head;
+        plan->depth = head ? head->depth + 1 : 1;
+        if (plan->depth > SCHEMA_PLANS_MAX) {
+            ast_free(plan);
+            return NULL;
         }
+    } while (!__atomic_compare_exchange_n(&schema->plans, &head, plan, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return plan;
+}
 
-        cfg = ast_config_new();
-        if (!cfg) {
-            ast_log(LOG_WARNING, "out of memory!\n");
-            break;
-        }
+/*!
+ * \brief   convert fields by a plan compiled for them
+ */
+static bool fields2doc_planned(const struct schema_plan *plan, const struct ast_variable *fields,
+                               const struct table_config *tc, bson_t *doc)
+{
+    const struct schema_step *step = plan->steps;
+    bool typed = table_config_typed(tc);
+    bool err = false;
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
+    for (; fields && !err; fields = fields->next, step++) {
+        if (fields->value[0])
+            err = !(typed ? step->typed : step->convert)(doc, step->key, fields->value, tc);
+    }
+    return !err;
+}
 
-        LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s, database=%s, table=%s\n", query, database, table);
+/*!
+ * \brief   convert fields looking up the schema for each of them
+ * \param   schema  is of the table, or NULL to infer all the types from the values.
+ */
+static bool fields2doc_inferred(const struct schema *schema, const struct ast_variable *fields,
+                                const struct table_config *tc, bson_t *doc)
+{
+    bool typed = table_config_typed(tc);
+    bool err = false;
 
-        cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 0, 0, query, NULL, NULL);
-        if (!cursor) {
-            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s, database=%s, table=%s\n", query, database, table);
-            break;
-        }
+    for (; fields && !err; fields = fields->next) {
+        const char *key;
 
-        while (mongoc_cursor_next(cursor, &doc)) {
-            bson_iter_t iter;
-            const char* key;
-            const char* value;
-            char work[128];
+        if (!fields->value[0])
+            continue;
+        key = key_asterisk2mongo(fields->name);
+        err = !converter_of(schema_btype(schema, key, fields->value, typed))(doc, key, fields->value, tc);
+    }
+    return !err;
+}
 
-            LOG_BSON_AS_JSON(LOG_DEBUG, "query found %s\n", doc);
+/*!
+ *  Make a document from key-value list
+ *
+ *  \param[in]  table
+ *  \param[in]  fields
+ *  \param[out] doc
+ *  \retval  true if success
+*/
+static bool fields2doc(const char* table, const struct ast_variable *fields, bson_t *doc)
+{
+    struct schema *schema = (struct schema *)schema_get(table);
+    const struct schema_plan *plan = schema ? schema_plan_get(schema, fields) : NULL;
+    struct table_config *tc = table_config_get(table);
+    bool ok;
+
+    if (!tc)
+        tc = table_config_get("");
+    ok = plan ? fields2doc_planned(plan, fields, tc, doc)
+              : fields2doc_inferred(schema, fields, tc, doc);
+    ao2_cleanup(tc);
+    return ok;
+}
 
-            if (!bson_iter_init(&iter, doc)) {
-                ast_log(LOG_ERROR, "unexpected bson error!\n");
-                break;
-            }
-            cat = ast_category_new("", "", 99999);
-            if (!cat) {
-                ast_log(LOG_WARNING, "out of memory!\n");
-                break;
-            }
-            while (bson_iter_next(&iter)) {
-                if (!doc2value(&iter, &key, work, sizeof(work)))
-                    continue;
-                value = work;
-                if (!strcmp(initfield, key))
-                    ast_category_rename(cat, value);
-                var = ast_variable_new(key, value, "");
-                ast_variable_append(cat, var);
-            }
-            ast_category_append(cfg, cat);
-        }
-    } while(0);
-    ast_log(LOG_DEBUG, "end of query.\n");
+/*!
+ * \brief format an integer in decimal, two digits at once instead of snprintf
+ * \param[in]  value
+ * \param[out] buf     is at least DOC_VALUE_WORK bytes
+ * \retval a pointer same as buf.
+ */
+static const char *int2str(long long value, char *buf)
+{
+    static const char digits[] =
+        "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+        "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    char *q = buf;
+
+    while (u >= 100) {
+        unsigned i = (u % 100) * 2;
+        u /= 100;
+        *--p = digits[i + 1];
+        *--p = digits[i];
+    }
+    if (u >= 10) {
+        *--p = digits[u * 2 + 1];
+        *--p = digits[u * 2];
+    }
+    else
+        *--p = '0' + u;
+    if (value < 0)
+        *q++ = '-';
+    memcpy(q, p, tmp + sizeof(tmp) - p);
+    q[tmp + sizeof(tmp) - p] = '\0';
+    return buf;
+}
 
-    if (query)
-        bson_destroy((bson_t *)query);
-    if (cursor)
-        mongoc_cursor_destroy(cursor);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
-    return cfg;
+/*!
+ * \brief format a date stored by typed_storage as "YYYY-MM-DD HH:MM:SS" in UTC
+ * \param[in]  msec    is milliseconds since the epoch
+ * \param[out] buf     is at least DOC_VALUE_WORK bytes
+ * \param[in]  date    is true to format only "YYYY-MM-DD", for a field required as RQ_DATE
+ * \retval buf
+ */
+static const char *date2str(int64_t msec, char *buf, bool date)
+{
+    time_t sec = (time_t)(msec >= 0 ? msec / 1000 : (msec - 999) / 1000);
+    struct tm tm;
+
+    if (!gmtime_r(&sec, &tm) || !strftime(buf, DOC_VALUE_WORK, date ? "%Y-%m-%d" : "%Y-%m-%d %H:%M:%S", &tm))
+        return int2str(msec, buf);
+    return buf;
 }
 
 /*!
- * \brief Execute an UPDATE query
- * \param database  is name of database
- * \param table     is name of collection to update records
- * \param keyfield  where clause field
- * \param lookup    value of field for where clause
- * \param fields    is a list containing one or more field/value set(s).
+ *  Get a value from a document
  *
- * Update a database table, prepare the sql statement using keyfield and lookup
- * control the number of records to change. All values to be changed are stored in ap list.
- * Sub-in the values to the prepared statement and execute it.
+ *  A string is not copied but points into the document, which is valid
+ *  while the document is, so that ast_variable_new() copies it only once
+ *  in an allocation sized by its length. Other types are formatted in work.
  *
- * \retval number of rows affected
- * \retval -1 on failure
+ *  \param[in,out]  iter    is a bson iterator of a document
+ *  \param[out]     key     is stored pointer to key name of value
+ *  \param[out]     work    is a buffer of DOC_VALUE_WORK bytes to format a value
+ *  \param[in]      schema  is of the table, or NULL if not required, to format dates as required
+ *  \param[in]      tc      is options of the table, or NULL, to hide the reversed shadow fields
+ *  \retval  a string of the value,
+ *  \retval  NULL if it's hidden or invalid.
 */
-static int update(const char *database, const char *table, const char *keyfield, const char *lookup, const struct ast_variable *fields)
+static const char *doc2value(bson_iter_t* iter, const char** key, char work[DOC_VALUE_WORK],
+                             const struct schema *schema, const struct table_config *tc)
 {
-    int ret = -1;
-    bson_t *query = NULL;
-    bson_t *data = NULL;
-    bson_t *update = NULL;
-    mongoc_client_t *dbclient = NULL;
-    mongoc_collection_t *collection = NULL;
-
-    if (!database || !table || !keyfield || !lookup || !fields) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return -1;
-    }
-    ast_log(LOG_DEBUG, "database=%s, table=%s, keyfield=%s, lookup=%s.\n", database, table, keyfield, lookup);
-
-    if(dbpool == NULL) {
-        ast_log(LOG_ERROR, "no connection pool\n");
-        return -1;
-    }
-    dbclient = mongoc_client_pool_pop(dbpool);
-    if(dbclient == NULL) {
-        ast_log(LOG_ERROR, "no client allocated\n");
-        return -1;
-    }
-
-    do {
-        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
-        if (!query) {
-            ast_log(LOG_ERROR, "not enough memory\n");
-            break;
-        }
-        if (!BSON_APPEND_UTF8(query, key_asterisk2mongo(keyfield), lookup)) {
-            ast_log(LOG_ERROR, "cannot make a query\n");
-            break;
-        }
+    const char *value;
 
-        data = bson_new();
-        if (!data) {
-            ast_log(LOG_ERROR, "not enough memory\n");
-            break;
-        }
-        update = bson_new();
-        if (!update) {
-            ast_log(LOG_ERROR, "not enough memory\n");
-            break;
+    if (BSON_ITER_HOLDS_OID(iter)) {
+        if (strcmp(bson_iter_key(iter), SERVERID) == 0) {
+            // SERVERID is hidden property for application
+            return NULL;
         }
-        if (!fields2doc(table, fields, data)) {
-            ast_log(LOG_ERROR, "cannot make data to update\n");
-            break;
+        bson_oid_to_string(bson_iter_oid(iter), work);
+        value = work;
+    }
+    else if (BSON_ITER_HOLDS_UTF8(iter)) {
+        uint32_t length;
+        const char* str = bson_iter_utf8(iter, &length);
+        const char *name = bson_iter_key(iter);
+        size_t name_len = strlen(name);
+        if (tc && name_len > sizeof(REVERSED_SUFFIX) - 1
+        && strcmp(name + name_len - (sizeof(REVERSED_SUFFIX) - 1), REVERSED_SUFFIX) == 0
+        && table_config_reversed_len(tc, name, name_len - (sizeof(REVERSED_SUFFIX) - 1))) {
+            // shadow field made by fields2doc() for reversed_fields is hidden as well
+            return NULL;
         }
-        if (!BSON_APPEND_DOCUMENT(update, "$set", data)) {
-            ast_log(LOG_ERROR,
-                "cannot make data to update, database=%s, table=%s, keyfield=%s, lookup=%s\n",
-                database, table, keyfield, lookup);
-            break;
+        if (!bson_utf8_validate(str, length, false)) {
+            ast_log(LOG_WARNING, "unexpected invalid bson found\n");
+            return NULL;
         }
-
-        collection = mongoc_client_get_collection(dbclient, database, table);
-        ret = _collection_update(collection, query, update);
-    } while(0);
-
-    if (data)
-        bson_destroy((bson_t *)data);
-    if (update)
-        bson_destroy((bson_t *)update);
-    if (query)
-        bson_destroy((bson_t *)query);
-    if (collection)
-        mongoc_collection_destroy(collection);
-
-    mongoc_client_pool_push(dbpool, dbclient);
-    return ret;
+        value = str;
+    }
+    else if (BSON_ITER_HOLDS_BOOL(iter)) {
+        value = bson_iter_bool(iter) ? "true" : "false";
+    }
+    else if (BSON_ITER_HOLDS_INT32(iter)) {
+        value = int2str(bson_iter_int32(iter), work);
+    }
+    else if (BSON_ITER_HOLDS_INT64(iter)) {
+        value = int2str(bson_iter_int64(iter), work);
+    }
+    else if (BSON_ITER_HOLDS_DOUBLE(iter)) {
+        snprintf(work, DOC_VALUE_WORK, "%.10g", bson_iter_double(iter));
+        value = work;
+    }
+    else if (BSON_ITER_HOLDS_DATE_TIME(iter)) {
+        const struct schema_field *field = schema ? schema_field(schema, key_mongo2asterisk(bson_iter_key(iter))) : NULL;
+        value = date2str(bson_iter_date_time(iter), work, field && field->rtype == RQ_DATE);
+    }
+    else {
+        // see http://api.mongodb.org/libbson/current/bson_iter_type.html
+        ast_log(LOG_WARNING, "unexpected bson type, %x\n", bson_iter_type(iter));
+        return NULL;
+    }
+    *key = key_mongo2asterisk(bson_iter_key(iter));
+    return value;
 }
 
 /*!
- * \brief Callback for ast_realtime_require
- * \retval 0 Required fields met specified standards
- * \retval -1 One or more fields was missing or insufficient
- */
-static int require(const char *database, const char *table, va_list ap)
+ *  Make a key-value list from a document
+ *
+ *  \param[in]  doc
+ *  \param[in]  table   is name of collection of the document
+ *  \param[in]  tc      is options of the table, or NULL if none
+ *  \retval  a list of ast_variable,
+ *  \retval  NULL if no value or something wrong.
+*/
+static struct ast_variable *doc2variables(const bson_t *doc, const char *table, const struct table_config *tc)
 {
-    bson_t *model = bson_new();
-    char *elm;
+    const struct schema *schema = schema_get(table);
+    struct ast_variable *var = NULL;
+    struct ast_variable *prev = NULL;
+    bson_iter_t iter;
+    const char* key;
+    const char* value;
+    char work[DOC_VALUE_WORK];
 
-    if (!database || !table) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return -1;
+    if (!bson_iter_init(&iter, doc)) {
+        ast_log(LOG_ERROR, "unexpected bson error!\n");
+        return NULL;
     }
-    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
-
-    while ((elm = va_arg(ap, char *))) {
-        int type = va_arg(ap, require_type);
-        // int size =
-        va_arg(ap, int);
-        // ast_log(LOG_DEBUG, "elm=%s, type=%d, size=%d\n", elm, type, size);
-        BSON_APPEND_INT64(model, elm, rtype2btype(type));
+    while (bson_iter_next(&iter)) {
+        if (!(value = doc2value(&iter, &key, work, schema, tc)))
+            continue;
+        if (prev) {
+            prev->next = ast_variable_new(key, value, "");
+            if (prev->next)
+                prev = prev->next;
+        }
+        else
+            prev = var = ast_variable_new(key, value, "");
     }
-    LOG_BSON_AS_JSON(LOG_DEBUG, "required model is \"%s\"\n", model);
-
-    model_register(table, model);
-    bson_destroy(model);
-    return 0;
+    return var;
 }
 
 /*!
- * \brief Execute an UPDATE query
- * \param database  is name of database
- * \param table     is name of collection to update records
- * \param ap list containing one or more field/value set(s).
+ * \brief an entry of the caches of realtime()
+ */
+struct cache_entry {
+    AST_DLLIST_ENTRY(cache_entry) list;
+    struct ast_variable *var;   /*!< cached result owned by the entry, NULL for a miss */
+    struct ast_variable *fields;/*!< fields queried, owned by the entry */
+    struct timeval expires;
+    const char *database;       /*!< points into key[] */
+    const char *table;          /*!< points into key[] */
+    char key[0];
+};
+
+/*!
+ * \brief a cache of realtime()
  *
- * Update a database table, preparing the sql statement from a list of
- * key/value pairs specified in ap.  The lookup pairs are specified first
- * and are separated from the update pairs by a sentinel value.
- * Sub-in the values to the prepared statement and execute it.
+ * Entries are kept in the hash container for lookup and in the list
+ * ordered by recent use, both protected by cache_lock.
+ */
+struct cache {
+    struct ao2_container *entries;
+    AST_DLLIST_HEAD_NOLOCK(, cache_entry) lru;
+    unsigned *ttl;              /*!< lifetime of entries in seconds */
+    unsigned *size;             /*!< max number of entries */
+};
+
+/*!
+ * \brief a cache of keys not found in a collection
  *
- * \retval number of rows affected
- * \retval -1 on failure
-*/
-static int update2(const char *database, const char *table, const struct ast_variable *lookup_fields, const struct ast_variable *update_fields)
-{
-    int ret = -1;
-    bson_t *query = NULL;
-    bson_t *data = NULL;
-    bson_t *update = NULL;
-    mongoc_client_t *dbclient = NULL;
-    mongoc_collection_t *collection = NULL;
+ * It also keeps the generation of the caches of the collection, so that
+ * a result found before a purge is not cached after it.
+ */
+struct miss_cache {
+    AST_LIST_ENTRY(miss_cache) list;
+    struct cache cache;
+    unsigned generation;        /*!< bumped whenever the caches of the collection are purged or refreshed */
+    const char *table;          /*!< points into database[] */
+    char database[0];
+};
 
-    if (!database || !table || !lookup_fields || !update_fields) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return -1;
-    }
-    ast_log(LOG_DEBUG, "database=%s, table=%s\n", database, table);
+static struct cache results = { .ttl = &cache_ttl, .size = &cache_size };
+static AST_LIST_HEAD_NOLOCK_STATIC(misses, miss_cache);
 
-    if(dbpool == NULL) {
-        ast_log(LOG_ERROR, "no connection pool\n");
-        return -1;
-    }
-    dbclient = mongoc_client_pool_pop(dbpool);
-    if(dbclient == NULL) {
-        ast_log(LOG_ERROR, "no client allocated\n");
-        return -1;
-    }
+static void cache_entry_destructor(void *obj)
+{
+    struct cache_entry *entry = obj;
+    if (entry->var)
+        ast_variables_destroy(entry->var);
+    if (entry->fields)
+        ast_variables_destroy(entry->fields);
+}
 
-    do {
-        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
-        if (!query) {
-            ast_log(LOG_ERROR, "not enough memory\n");
+static int cache_entry_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
             break;
-        }
-        if (!fields2doc(table, lookup_fields, query)) {
-            ast_log(LOG_ERROR, "cannot make data to update\n");
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct cache_entry *)obj)->key;
             break;
-        }
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
 
-        LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s\n", query);
+static int cache_entry_cmp(void *obj, void *arg, int flags)
+{
+    const struct cache_entry *entry = obj;
+    const char *key;
 
-        data = bson_new();
-        if (!data) {
-            ast_log(LOG_ERROR, "not enough memory\n");
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
             break;
-        }
-        if (!fields2doc(table, update_fields, data)) {
-            ast_log(LOG_ERROR, "cannot make data to update\n");
-            break;
-        }
-        update = bson_new();
-        if (!update) {
-            ast_log(LOG_ERROR, "not enough memory\n");
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct cache_entry *)arg)->key;
             break;
-        }
-        if (!BSON_APPEND_DOCUMENT(update, "$set", data)) {
-            ast_log(LOG_ERROR, "cannot make data to update, database=%s, table=%s\n",
-                    database, table);
-            break;
-        }
+        default:
+            return 0;
+    }
+    return strcmp(entry->key, key) ? 0 : CMP_MATCH;
+}
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
-        ret = _collection_update(collection, query, update);
+/*!
+ * \brief make a key to the caches
+ *
+ * The key consists of the database, the table and the field list,
+ * in which the whitespaces between a name and an operator are collapsed
+ * and the operator LIKE is normalized to upper case.
+ *
+ * \retval a thread local string valid until the next call,
+ * \retval NULL if something wrong.
+ */
+static const char *cache_key(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_str *buf = ast_str_thread_get(&cache_key_buf, 256);
 
-    } while(0);
+    if (!buf)
+        return NULL;
+    ast_str_set(&buf, 0, "%s\x1f%s", database, table);
+    for (; fields; fields = fields->next) {
+        const char *tokens[MAXTOKENS];
+        char name[1024];
+        int count;
+
+        if (strlen(fields->name) >= (sizeof(name) - 1))
+            return NULL;
+        strcpy(name, fields->name);
+        count = str_split(name, " ", tokens);
+        if (count < 1)
+            return NULL;
+        ast_str_append(&buf, 0, "\x1e%s", tokens[0]);
+        if (count > 1)
+            ast_str_append(&buf, 0, " %s", strcasecmp(tokens[1], "LIKE") ? tokens[1] : "LIKE");
+        ast_str_append(&buf, 0, "\x1f%s", fields->value);
+    }
+    return ast_str_buffer(buf);
+}
 
-    if (data)
-        bson_destroy((bson_t *)data);
-    if (update)
-        bson_destroy((bson_t *)update);
-    if (query)
-        bson_destroy((bson_t *)query);
-    if (collection)
-        mongoc_collection_destroy(collection);
+static int cache_new(struct cache *cache)
+{
+    AST_DLLIST_HEAD_INIT_NOLOCK(&cache->lru);
+    cache->entries = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, CACHE_BUCKETS,
+                                              cache_entry_hash, NULL, cache_entry_cmp);
+    return cache->entries ? 0 : -1;
+}
 
-    mongoc_client_pool_push(dbpool, dbclient);
-    return ret;
+/*!
+ * \brief remove an entry from a cache, cache_lock must be held.
+ */
+static void cache_unlink(struct cache *cache, struct cache_entry *entry)
+{
+    AST_DLLIST_REMOVE(&cache->lru, entry, list);
+    ao2_unlink_flags(cache->entries, entry, OBJ_NOLOCK);
 }
 
 /*!
- * \brief Execute an INSERT query
- * \param database
- * \param table
- * \param ap list containing one or more field/value set(s)
- *
- * Insert a new record into database table, prepare the sql statement.
- * All values to be changed are stored in ap list.
- * Sub-in the values to the prepared statement and execute it.
- *
- * \retval number of rows affected
- * \retval -1 on failure
-*/
-static int store(const char *database, const char *table, const struct ast_variable *fields)
+ * \brief look up a cache, cache_lock must be held.
+ * \param[in]   cache
+ * \param[in]   key     made by cache_key()
+ * \param[out]  var     is stored a copy of the cached result
+ * \retval  true if a valid entry found.
+ */
+static bool cache_lookup(struct cache *cache, const char *key, struct ast_variable **var)
 {
-    int ret = -1;
-    bson_t *document = NULL;
-    mongoc_client_t *dbclient = NULL;
-    mongoc_collection_t *collection = NULL;
+    struct cache_entry *entry;
+    bool hit = false;
 
-    if (!database || !table || !fields) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return -1;
+    if (!cache->entries)
+        return false;
+    entry = ao2_find(cache->entries, key, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+    if (!entry)
+        return false;
+    if (ast_tvcmp(entry->expires, ast_tvnow()) <= 0)
+        cache_unlink(cache, entry);
+    else {
+        AST_DLLIST_REMOVE(&cache->lru, entry, list);
+        AST_DLLIST_INSERT_HEAD(&cache->lru, entry, list);
+        *var = entry->var ? ast_variables_dup(entry->var) : NULL;
+        hit = (*var != NULL) || (entry->var == NULL);
     }
-    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+    ao2_ref(entry, -1);
+    return hit;
+}
 
-    if(dbpool == NULL) {
-        ast_log(LOG_ERROR, "no connection pool\n");
-        return -1;
-    }
-    dbclient = mongoc_client_pool_pop(dbpool);
-    if(dbclient == NULL) {
-        ast_log(LOG_ERROR, "no client allocated\n");
-        return -1;
+/*!
+ * \brief store an entry to a cache, cache_lock must be held.
+ *  the least recently used entries are evicted if the cache is full.
+ */
+static void cache_link(struct cache *cache, struct cache_entry *entry)
+{
+    struct cache_entry *old;
+
+    if (!cache->entries)
+        return;
+    old = ao2_find(cache->entries, entry->key, OBJ_SEARCH_KEY | OBJ_NOLOCK | OBJ_UNLINK);
+    if (old) {
+        AST_DLLIST_REMOVE(&cache->lru, old, list);
+        ao2_ref(old, -1);
     }
+    while (ao2_container_count(cache->entries) >= *cache->size && AST_DLLIST_LAST(&cache->lru))
+        cache_unlink(cache, AST_DLLIST_LAST(&cache->lru));
+    if (ao2_link_flags(cache->entries, entry, OBJ_NOLOCK))
+        AST_DLLIST_INSERT_HEAD(&cache->lru, entry, list);
+}
+
+/*!
+ * \brief purge entries of a cache, cache_lock must be held.
+ * \param cache
+ * \param database  is name of database, or NULL for any databases
+ * \param table     is name of collection, or NULL for any collections
+ * \retval number of entries purged
+ */
+static int cache_evict(struct cache *cache, const char *database, const char *table)
+{
+    struct cache_entry *entry;
+    struct cache_entry *next;
+    int count = 0;
+
+    for (entry = AST_DLLIST_FIRST(&cache->lru); entry; entry = next) {
+        next = AST_DLLIST_NEXT(entry, list);
+        if (database && strcmp(entry->database, database))
+            continue;
+        if (table && strcmp(entry->table, table))
+            continue;
+        cache_unlink(cache, entry);
+        count++;
+    }
+    return count;
+}
+
+/*!
+ * \brief find the cache of misses of a collection, cache_lock must be held.
+ * \param create    is true to create it if not exists.
+ */
+static struct miss_cache *miss_cache_find(const char *database, const char *table, bool create)
+{
+    struct miss_cache *miss;
+    size_t database_len = strlen(database) + 1;
+    size_t table_len = strlen(table) + 1;
+
+    AST_LIST_TRAVERSE(&misses, miss, list) {
+        if (!strcmp(miss->database, database) && !strcmp(miss->table, table))
+            return miss;
+    }
+    if (!create || !(miss = ast_calloc(1, sizeof(*miss) + database_len + table_len)))
+        return NULL;
+    memcpy(miss->database, database, database_len);
+    miss->table = miss->database + database_len;
+    memcpy((char *)miss->table, table, table_len);
+    miss->cache.ttl = &negative_cache_ttl;
+    miss->cache.size = &negative_cache_size;
+    if (cache_new(&miss->cache)) {
+        ast_free(miss);
+        return NULL;
+    }
+    AST_LIST_INSERT_TAIL(&misses, miss, list);
+    return miss;
+}
+
+/*!
+ * \brief look up the caches
+ * \param[in]   database
+ * \param[in]   table
+ * \param[in]   key     made by cache_key()
+ * \param[out]  var     is stored a copy of the cached result, or NULL for a miss
+ * \retval  true if a valid entry found.
+ */
+static bool cache_get(const char *database, const char *table, const char *key, struct ast_variable **var)
+{
+    struct miss_cache *miss;
+    bool hit = false;
+
+    ast_mutex_lock(&cache_lock);
+    if (negative_cache_ttl && (miss = miss_cache_find(database, table, false)))
+        hit = cache_lookup(&miss->cache, key, var);
+    if (!hit && cache_ttl)
+        hit = cache_lookup(&results, key, var);
+    ast_mutex_unlock(&cache_lock);
+    return hit;
+}
+
+/*!
+ * \brief get the generation of the caches of a collection
+ *
+ * It is to be got before querying the server for a result to be cached.
+ */
+static unsigned cache_generation(const char *database, const char *table)
+{
+    struct miss_cache *miss;
+    unsigned generation = 0;
+
+    ast_mutex_lock(&cache_lock);
+    if ((miss = miss_cache_find(database, table, true)))
+        generation = miss->generation;
+    ast_mutex_unlock(&cache_lock);
+    return generation;
+}
+
+/*!
+ * \brief store a copy of the result to the caches
+ * \param var           is the result to be cached, or NULL to cache a miss.
+ * \param generation    is got by cache_generation() before the query,
+ *                      nothing is cached if the caches were purged since.
+ */
+static void cache_put(const char *database, const char *table, const char *key,
+                      const struct ast_variable *fields, const struct ast_variable *var,
+                      unsigned generation)
+{
+    struct cache_entry *entry;
+    struct miss_cache *miss;
+    size_t key_len = strlen(key) + 1;
+    size_t database_len = strlen(database) + 1;
+    size_t table_len = strlen(table) + 1;
+    unsigned ttl = var ? cache_ttl : negative_cache_ttl;
+
+    if (!ttl || !(var ? cache_size : negative_cache_size))
+        return;
+
+    entry = ao2_alloc_options(sizeof(*entry) + key_len + database_len + table_len,
+                              cache_entry_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!entry) {
+        ast_log(LOG_WARNING, "not enough memory\n");
+        return;
+    }
+    memcpy(entry->key, key, key_len);
+    entry->database = entry->key + key_len;
+    memcpy((char *)entry->database, database, database_len);
+    entry->table = entry->database + database_len;
+    memcpy((char *)entry->table, table, table_len);
+    entry->expires = ast_tvadd(ast_tvnow(), ast_tv(ttl, 0));
+    entry->fields = ast_variables_dup((struct ast_variable *)fields);
+    if (var)
+        entry->var = ast_variables_dup((struct ast_variable *)var);
+    if (!entry->fields || (var && !entry->var)) {
+        ast_log(LOG_WARNING, "not enough memory\n");
+        ao2_ref(entry, -1);
+        return;
+    }
+
+    ast_mutex_lock(&cache_lock);
+    miss = miss_cache_find(database, table, true);
+    if (!miss || miss->generation != generation)
+        ast_log(LOG_DEBUG, "not cached as purged meanwhile, database=%s, table=%s\n", database, table);
+    else if (var)
+        cache_link(&results, entry);
+    else
+        cache_link(&miss->cache, entry);
+    ast_mutex_unlock(&cache_lock);
+    ao2_ref(entry, -1);
+}
+
+/*!
+ * \brief purge the cached results and misses
+ * \param database  is name of database, or NULL for any databases
+ * \param table     is name of collection, or NULL for any collections
+ * \retval number of entries purged
+ */
+static int load_cache_purge(const char *database, const char *table);
+
+static int cache_purge(const char *database, const char *table)
+{
+    struct miss_cache *miss;
+    int count = load_cache_purge(database, table);
+
+    ast_mutex_lock(&cache_lock);
+    count += cache_evict(&results, database, table);
+    AST_LIST_TRAVERSE(&misses, miss, list) {
+        if (database && strcmp(miss->database, database))
+            continue;
+        if (table && strcmp(miss->table, table))
+            continue;
+        count += cache_evict(&miss->cache, NULL, NULL);
+        miss->generation++;
+    }
+    ast_mutex_unlock(&cache_lock);
+    if (count)
+        ast_log(LOG_DEBUG, "%d entries purged, database=%s, table=%s\n",
+                count, S_OR(database, "*"), S_OR(table, "*"));
+    return count;
+}
+
+/*!
+ * \brief refresh the caches with a document changed.
+ *
+ * The results holding the document are patched if it still matches
+ * their query, or evicted if not or if find() of the table projects fields,
+ * since the document is not projected. The misses which the document matches
+ * now are evicted as well.
+ *
+ * \param database  is name of database
+ * \param table     is name of collection
+ * \param id        is _id of the document changed
+ * \param vars      is the document changed, or NULL if it was deleted.
+ * \retval number of entries evicted or patched
+ */
+static int cache_refresh(const char *database, const char *table, const char *id, const struct ast_variable *vars)
+{
+    struct cache_entry *entry;
+    struct cache_entry *next;
+    struct miss_cache *miss;
+    bool projected = vars && table_projected(table);
+    int count = 0;
+
+    ast_mutex_lock(&cache_lock);
+    if ((miss = miss_cache_find(database, table, false)))
+        miss->generation++;
+    for (entry = AST_DLLIST_FIRST(&results.lru); entry; entry = next) {
+        const struct ast_variable *var;
+
+        next = AST_DLLIST_NEXT(entry, list);
+        if (strcmp(entry->database, database) || strcmp(entry->table, table))
+            continue;
+        for (var = entry->var; var && strcmp(var->name, "_id"); var = var->next)
+            ;
+        if (!var || strcasecmp(var->value, id))
+            continue;
+        if (vars && !projected && match_fields(vars, entry->fields)) {
+            struct ast_variable *patched = ast_variables_dup((struct ast_variable *)vars);
+            if (patched) {
+                ast_variables_destroy(entry->var);
+                entry->var = patched;
+                count++;
+                continue;
+            }
+        }
+        cache_unlink(&results, entry);
+        count++;
+    }
+    if (vars && miss) {
+        for (entry = AST_DLLIST_FIRST(&miss->cache.lru); entry; entry = next) {
+            next = AST_DLLIST_NEXT(entry, list);
+            if (match_fields(vars, entry->fields)) {
+                cache_unlink(&miss->cache, entry);
+                count++;
+            }
+        }
+    }
+    ast_mutex_unlock(&cache_lock);
+    if (count)
+        ast_log(LOG_DEBUG, "%d entries refreshed, database=%s, table=%s, _id=%s\n",
+                count, database, table, id);
+    return count;
+}
+
+static int cache_init(void)
+{
+    int res = 0;
+
+    ast_mutex_lock(&cache_lock);
+    if (!results.entries)
+        res = cache_new(&results);
+    ast_mutex_unlock(&cache_lock);
+    return res;
+}
+
+static void cache_destroy(void)
+{
+    struct miss_cache *miss;
+
+    cache_purge(NULL, NULL);
+    ast_mutex_lock(&cache_lock);
+    while ((miss = AST_LIST_REMOVE_HEAD(&misses, list))) {
+        ao2_cleanup(miss->cache.entries);
+        ast_free(miss);
+    }
+    ao2_cleanup(results.entries);
+    results.entries = NULL;
+    ast_mutex_unlock(&cache_lock);
+}
+
+/*!
+ * \brief options of a table, specified in a category [config/<table>]
+ */
+struct table_config {
+    unsigned snapshot;          /*!< 0 != keep the whole collection in memory */
+    char *database;             /*!< database of the snapshot */
+    unsigned max_time_ms;       /*!< maxTimeMS of find, 0 = no limit */
+    unsigned batch_size;        /*!< batchSize of find, 0 = default of the server */
+    bson_t *projection;         /*!< projection of find, NULL = all fields */
+    unsigned max_rows;          /*!< max number of rows of realtime_multi(), 0 = unlimited */
+    unsigned prefetch;          /*!< 0 != fetch later batches while converting former ones */
+    mongoc_read_prefs_t *read_prefs;    /*!< read preference of find, NULL = primary */
+    bson_t *reversed;           /*!< fields having a reversed shadow field, NULL = none */
+    unsigned write_behind;      /*!< 0 != queue store, update and update2 to be written in background */
+    mongoc_write_concern_t *write_concern;  /*!< write concern of writes, NULL = default of the uri */
+    unsigned upsert;            /*!< 0 != update and update2 insert a document unless any matches */
+    unsigned typed;             /*!< 0 != store integers and dates of the model as int32, int64 and date */
+    char name[0];               /*!< name of table, "" for tables without any category */
+};
+
+static void table_config_destructor(void *obj)
+{
+    struct table_config *tc = obj;
+    ast_free(tc->database);
+    if (tc->projection)
+        bson_destroy(tc->projection);
+    if (tc->read_prefs)
+        mongoc_read_prefs_destroy(tc->read_prefs);
+    if (tc->write_concern)
+        mongoc_write_concern_destroy(tc->write_concern);
+    if (tc->reversed)
+        bson_destroy(tc->reversed);
+}
+
+static int table_config_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct table_config *)obj)->name;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int table_config_cmp(void *obj, void *arg, int flags)
+{
+    const struct table_config *tc = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct table_config *)arg)->name;
+            break;
+        default:
+            return 0;
+    }
+    return strcmp(tc->name, key) ? 0 : CMP_MATCH;
+}
+
+/*!
+ * \brief get the options of a table
+ * \retval a reference to the options,
+ * \retval NULL if the table has no category.
+ */
+static struct table_config *table_config_get(const char *table)
+{
+    struct ao2_container *tables = ao2_global_obj_ref(table_configs);
+    struct table_config *tc = NULL;
+
+    if (tables) {
+        tc = ao2_find(tables, table, OBJ_SEARCH_KEY);
+        ao2_ref(tables, -1);
+    }
+    return tc;
+}
+
+/*!
+ * \brief check if a field has a reversed shadow field by options of a table
+ * \param tc    is the options, or NULL if none.
+ */
+static bool table_config_reversed(const struct table_config *tc, const char *field)
+{
+    return tc && tc->reversed && bson_has_field(tc->reversed, field);
+}
+
+/*!
+ * \brief table_config_reversed() of a field given by the first len bytes of a name
+ */
+static bool table_config_reversed_len(const struct table_config *tc, const char *field, size_t len)
+{
+    bson_iter_t iter;
+
+    if (!tc || !tc->reversed || !bson_iter_init(&iter, tc->reversed))
+        return false;
+    while (bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+
+        if (!strncmp(key, field, len) && key[len] == '\0')
+            return true;
+    }
+    return false;
+}
+
+/*!
+ * \brief check if a table stores integers and dates natively by its options
+ * \param tc    is the options, or NULL if none.
+ */
+static bool table_config_typed(const struct table_config *tc)
+{
+    return tc && tc->typed;
+}
+
+/*!
+ * \brief check if find() of a table projects fields, as append_find_opts() does
+ */
+static bool table_projected(const char *table)
+{
+    struct table_config *tc = table_config_get(table);
+    bool projected = (tc && tc->projection) || (require_projection && schema_get(table));
+
+    ao2_cleanup(tc);
+    return projected;
+}
+
+/*!
+ * \brief type of values to query a field by typed_storage of a table
+ * \retval the type stored unless a string,
+ * \retval BSON_TYPE_EOD if queried by strings.
+ */
+static bson_type_t typed_btype(const char *table, const char *field)
+{
+    struct table_config *tc = table_config_get(table);
+    const struct schema *schema = schema_get(table);
+    const struct schema_field *f = schema ? schema_field(schema, field) : NULL;
+    bson_type_t btype = BSON_TYPE_EOD;
+
+    if (!tc)
+        tc = table_config_get("");
+    if (f && table_config_typed(tc) && f->typed != BSON_TYPE_UTF8)
+        btype = f->typed;
+    ao2_cleanup(tc);
+    return btype;
+}
+
+/*!
+ * \brief check if a field of a table has a reversed shadow field
+ */
+static bool reversed_field(const char *table, const char *field)
+{
+    struct table_config *tc = table_config_get(table);
+    bool reversed = table_config_reversed(tc, field);
+
+    ao2_cleanup(tc);
+    return reversed;
+}
+
+/*!
+ * \brief make a projection from a comma separated list of fields
+ * \retval a projection,
+ * \retval NULL if something wrong.
+ */
+static bson_t *make_projection(const char *list)
+{
+    bson_t *projection = bson_new();
+    char *fields = ast_strdupa(list);
+    char *field;
+
+    while (projection && (field = strsep(&fields, ","))) {
+        field = ast_strip(field);
+        if (ast_strlen_zero(field))
+            continue;
+        if (!BSON_APPEND_INT32(projection, key_asterisk2mongo(field), 1)) {
+            bson_destroy(projection);
+            projection = NULL;
+        }
+    }
+    return projection;
+}
+
+/*!
+ * \brief append options of a table to options of find
+ * \param opts      is options of find
+ * \param table
+ * \param fields    is a list of fields queried, which are always projected.
+ * \param required  is a field which must be projected as well, or NULL
+ * \retval true if success
+ *
+ * The projection is the list of the table if specified,
+ * or fields of the model required if require_projection is enabled.
+ */
+static bool append_find_opts(bson_t *opts, const char *table, const struct ast_variable *fields, const char *required)
+{
+    struct table_config *tc = table_config_get(table);
+    bool err = false;
+
+    if (!bson_has_field(opts, "projection")) {
+        bson_t projection = BSON_INITIALIZER;
+        bool projected = false;
+
+        if (tc && tc->projection)
+            projected = bson_concat(&projection, tc->projection);
+        else if (require_projection)
+            projected = schema_projection(table, &projection);
+        for (; projected && !err && fields; fields = fields->next) {
+            char *name = ast_strdupa(fields->name);
+            char *op = strchr(name, ' ');
+
+            if (op)
+                *op = '\0';
+            err = !append_projected(&projection, key_asterisk2mongo(name));
+        }
+        if (projected && !err && required)
+            err = !append_projected(&projection, required);
+        if (projected && !err)
+            err = !BSON_APPEND_DOCUMENT(opts, "projection", &projection);
+        bson_destroy(&projection);
+    }
+    if (tc && !err && tc->batch_size)
+        err = !BSON_APPEND_INT32(opts, "batchSize", tc->batch_size);
+    if (tc && !err && tc->max_time_ms)
+        err = !BSON_APPEND_INT64(opts, "maxTimeMS", tc->max_time_ms);
+    ao2_cleanup(tc);
+    return !err;
+}
+
+/*!
+ * \brief get batchSize of a table
+ * \retval batchSize, 0 = default of the server
+ */
+static unsigned batch_size_of(const char *table)
+{
+    struct table_config *tc = table_config_get(table);
+    unsigned batch_size = tc ? tc->batch_size : 0;
+
+    ao2_cleanup(tc);
+    return batch_size;
+}
+
+/*!
+ * \brief max number of rows returned by realtime_multi() of a table, 0 = unlimited
+ */
+static unsigned max_rows_of(const char *table)
+{
+    struct table_config *tc = table_config_get(table);
+    unsigned limit = tc ? tc->max_rows : max_rows;
+
+    ao2_cleanup(tc);
+    return limit;
+}
+
+/*!
+ * \brief make a read preference from options of a category
+ * \param cfg       is the configuration loaded
+ * \param category
+ * \retval a read preference,
+ * \retval NULL if not specified or invalid.
+ */
+static mongoc_read_prefs_t *make_read_prefs(struct ast_config *cfg, const char *category)
+{
+    static const struct {
+        const char *name;
+        mongoc_read_mode_t mode;
+    } modes[] = {
+        { "primary", MONGOC_READ_PRIMARY },
+        { "primaryPreferred", MONGOC_READ_PRIMARY_PREFERRED },
+        { "secondary", MONGOC_READ_SECONDARY },
+        { "secondaryPreferred", MONGOC_READ_SECONDARY_PREFERRED },
+        { "nearest", MONGOC_READ_NEAREST },
+    };
+    mongoc_read_prefs_t *read_prefs;
+    const char *mode = ast_variable_retrieve(cfg, category, "read_preference");
+    const char *staleness = ast_variable_retrieve(cfg, category, "max_staleness_seconds");
+    unsigned seconds = 0;
+    int i;
+
+    if (!mode)
+        return NULL;
+    for (i = 0; i < ARRAY_LEN(modes); i++) {
+        if (!strcasecmp(mode, modes[i].name))
+            break;
+    }
+    if (i == ARRAY_LEN(modes)) {
+        ast_log(LOG_WARNING, "read_preference must be primary|primaryPreferred|secondary|secondaryPreferred|nearest, not '%s'\n", mode);
+        return NULL;
+    }
+    if (staleness && (sscanf(staleness, "%u", &seconds) != 1)) {
+        ast_log(LOG_WARNING, "max_staleness_seconds must be seconds, not '%s'\n", staleness);
+        seconds = 0;
+    }
+    read_prefs = mongoc_read_prefs_new(modes[i].mode);
+    if (!read_prefs) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    if (seconds)
+        mongoc_read_prefs_set_max_staleness_seconds(read_prefs, seconds);
+    if (!mongoc_read_prefs_is_valid(read_prefs)) {
+        ast_log(LOG_WARNING, "invalid read_preference=%s with max_staleness_seconds=%u in [%s]\n", mode, seconds, category);
+        mongoc_read_prefs_destroy(read_prefs);
+        return NULL;
+    }
+    return read_prefs;
+}
+
+/*!
+ * \brief make a write concern from options of a category
+ * \param cfg       is the configuration loaded
+ * \param category
+ * \retval a write concern,
+ * \retval NULL if not specified or invalid.
+ */
+static mongoc_write_concern_t *make_write_concern(struct ast_config *cfg, const char *category)
+{
+    const char *w = ast_variable_retrieve(cfg, category, "write_concern");
+    const char *timeout = ast_variable_retrieve(cfg, category, "write_concern_timeout_ms");
+    mongoc_write_concern_t *write_concern;
+    unsigned nodes = 0;
+    unsigned ms = 0;
+
+    if (!w)
+        return NULL;
+    if (strcasecmp(w, "majority") && (sscanf(w, "%u", &nodes) != 1)) {
+        ast_log(LOG_WARNING, "write_concern must be a number of nodes or majority, not '%s'\n", w);
+        return NULL;
+    }
+    if (timeout && (sscanf(timeout, "%u", &ms) != 1)) {
+        ast_log(LOG_WARNING, "write_concern_timeout_ms must be milliseconds, not '%s'\n", timeout);
+        ms = 0;
+    }
+    write_concern = mongoc_write_concern_new();
+    if (!write_concern) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    if (!strcasecmp(w, "majority"))
+        mongoc_write_concern_set_wmajority(write_concern, ms);
+    else {
+        mongoc_write_concern_set_w(write_concern, nodes);
+        if (ms)
+            mongoc_write_concern_set_wtimeout(write_concern, ms);
+    }
+    if (!mongoc_write_concern_is_valid(write_concern)) {
+        ast_log(LOG_WARNING, "invalid write_concern=%s with write_concern_timeout_ms=%u in [%s]\n", w, ms, category);
+        mongoc_write_concern_destroy(write_concern);
+        return NULL;
+    }
+    return write_concern;
+}
+
+/*!
+ * \brief find documents with the read preference of a table
+ *
+ * Only reads use this, writes always go to the primary.
+ */
+static mongoc_cursor_t *collection_find(mongoc_collection_t *collection, const char *table,
+                                        const bson_t *query, const bson_t *opts)
+{
+    struct table_config *tc = table_config_get(table);
+    mongoc_cursor_t *cursor;
+
+    if (!tc)
+        tc = table_config_get("");
+    // the cursor copies the read preference
+    cursor = mongoc_collection_find_with_opts(collection, query, opts, tc ? tc->read_prefs : NULL);
+    ao2_cleanup(tc);
+    return cursor;
+}
+
+/*!
+ * \brief writes to a collection sent in a round-trip as an ordered bulk operation
+ *
+ * It's written with the write concern of the table.
+ */
+struct write_batch {
+    mongoc_bulk_operation_t *bulk;
+    const char *table;
+    unsigned count;             /*!< number of writes appended */
+    int failed;                 /*!< index of the first write failed, -1 if none or unknown */
+};
+
+/*!
+ * \brief start a batch of writes to a collection
+ * \retval true if started.
+ */
+static bool write_batch_init(struct write_batch *batch, mongoc_collection_t *collection, const char *table)
+{
+    struct table_config *tc = table_config_get(table);
+    bson_t opts = BSON_INITIALIZER;
+
+    if (!tc)
+        tc = table_config_get("");
+    batch->table = table;
+    batch->count = 0;
+    batch->failed = -1;
+    batch->bulk = NULL;
+    if (!tc || !tc->write_concern || mongoc_write_concern_append(tc->write_concern, &opts))
+        batch->bulk = mongoc_collection_create_bulk_operation_with_opts(collection, &opts);
+    if (!batch->bulk)
+        ast_log(LOG_ERROR, "cannot make a bulk operation, table=%s\n", table);
+    ao2_cleanup(tc);
+    bson_destroy(&opts);
+    return batch->bulk != NULL;
+}
+
+static bool write_batch_insert(struct write_batch *batch, const bson_t *document)
+{
+    bson_error_t error;
+
+    TRACE_BSON(batch->table, "document=%s\n", document);
+    if (!mongoc_bulk_operation_insert_with_opts(batch->bulk, document, NULL, &error)) {
+        ast_log(LOG_ERROR, "cannot insert, table=%s, error=%s\n", batch->table, error.message);
+        LOG_BSON_AS_JSON(LOG_ERROR, "document=%s\n", document);
+        return false;
+    }
+    batch->count++;
+    return true;
+}
+
+/*!
+ * \brief append an update of the documents matching a selector
+ * \param upsert    is true to insert a document made of selector and update unless any matches.
+ */
+static bool write_batch_update(struct write_batch *batch, const bson_t *selector, const bson_t *update, bool upsert)
+{
+    bson_t opts = BSON_INITIALIZER;
+    bson_error_t error;
+    bool appended;
+
+    TRACE_BSON(batch->table, "selector=%s\n", selector);
+    TRACE_BSON(batch->table, "update=%s\n", update);
+    if (upsert && !BSON_APPEND_BOOL(&opts, "upsert", true)) {
+        bson_destroy(&opts);
+        return false;
+    }
+    appended = mongoc_bulk_operation_update_many_with_opts(batch->bulk, selector, update, &opts, &error);
+    if (!appended) {
+        ast_log(LOG_ERROR, "cannot update, table=%s, error=%s\n", batch->table, error.message);
+        LOG_BSON_AS_JSON(LOG_ERROR, "selector=%s\n", selector);
+    }
+    else
+        batch->count++;
+    bson_destroy(&opts);
+    return appended;
+}
+
+static bool write_batch_remove(struct write_batch *batch, const bson_t *selector)
+{
+    bson_error_t error;
+
+    TRACE_BSON(batch->table, "selector=%s\n", selector);
+    if (!mongoc_bulk_operation_remove_one_with_opts(batch->bulk, selector, NULL, &error)) {
+        ast_log(LOG_ERROR, "cannot remove, table=%s, error=%s\n", batch->table, error.message);
+        return false;
+    }
+    batch->count++;
+    return true;
+}
+
+/*!
+ * \brief send the writes appended and end the batch
+ *
+ * Writes of an unacknowledged write concern are counted as written.
+ * On failure, the index of the first write failed is kept in batch->failed
+ * if the server reported it; as the bulk is ordered, the writes before it
+ * are applied and the ones after it are not executed.
+ *
+ * \retval number of documents inserted, modified, upserted and removed,
+ * \retval -1 on failure or nothing appended.
+ */
+static int write_batch_execute(struct write_batch *batch)
+{
+    static const char *counts[] = { "nInserted", "nModified", "nUpserted", "nRemoved" };
+    bson_t reply;
+    bson_error_t error;
+    bson_iter_t iter;
+    bson_iter_t child;
+    bool acknowledged = false;
+    int ret = -1;
+    int i;
+
+    if (batch->count) {
+        if (mongoc_bulk_operation_execute(batch->bulk, &reply, &error)) {
+            TRACE_BSON(batch->table, "reply=%s\n", &reply);
+            ret = 0;
+            for (i = 0; i < ARRAY_LEN(counts); i++) {
+                if (bson_iter_init_find(&iter, &reply, counts[i]) && BSON_ITER_HOLDS_INT32(&iter)) {
+                    ret += bson_iter_int32(&iter);
+                    acknowledged = true;
+                }
+            }
+            if (!acknowledged)
+                ret = batch->count;
+        }
+        else {
+            ast_log(LOG_ERROR, "write failed, table=%s, error=%s\n", batch->table, error.message);
+            LOG_BSON_AS_JSON(LOG_ERROR, "reply=%s\n", &reply);
+            if (bson_iter_init(&iter, &reply)
+            &&  bson_iter_find_descendant(&iter, "writeErrors.0.index", &child)
+            &&  BSON_ITER_HOLDS_INT32(&child))
+                batch->failed = bson_iter_int32(&child);
+        }
+        bson_destroy(&reply);
+    }
+    mongoc_bulk_operation_destroy(batch->bulk);
+    batch->bulk = NULL;
+    return ret;
+}
+
+/*!
+ * \brief check if update and update2 of a table insert a document unless any matches
+ */
+static bool upsert_of(const char *table)
+{
+    struct table_config *tc = table_config_get(table);
+    bool upsert = tc && tc->upsert;
+
+    ao2_cleanup(tc);
+    return upsert;
+}
+
+/*!
+ * \brief load the options of tables from categories [config/<table>]
+ * \param cfg           is the configuration loaded
+ * \param database      is name of the default database
+ * \retval a container of table_config,
+ * \retval NULL if something wrong.
+ */
+static struct ao2_container *table_config_load(struct ast_config *cfg, const char *database)
+{
+    struct ao2_container *tables;
+    struct table_config *tc;
+    const char *category = NULL;
+
+    tables = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, TABLE_BUCKETS,
+                                      table_config_hash, NULL, table_config_cmp);
+    if (!tables) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    // defaults of [config] for tables without any category
+    tc = ao2_alloc_options(sizeof(*tc) + 1, table_config_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!tc) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        ao2_ref(tables, -1);
+        return NULL;
+    }
+    tc->max_rows = max_rows;
+    tc->read_prefs = make_read_prefs(cfg, CATEGORY);
+    tc->write_concern = make_write_concern(cfg, CATEGORY);
+    tc->typed = ast_true(ast_variable_retrieve(cfg, CATEGORY, "typed_storage"));
+    ao2_link_flags(tables, tc, OBJ_NOLOCK);
+    ao2_ref(tc, -1);
+
+    while ((category = ast_category_browse(cfg, category))) {
+        const char *name;
+        const char *tmp;
+
+        if (strncmp(category, TABLE_CATEGORY_PREFIX, strlen(TABLE_CATEGORY_PREFIX)))
+            continue;
+        name = category + strlen(TABLE_CATEGORY_PREFIX);
+        if (ast_strlen_zero(name)) {
+            ast_log(LOG_WARNING, "no table specified in [%s]\n", category);
+            continue;
+        }
+        tc = ao2_alloc_options(sizeof(*tc) + strlen(name) + 1, table_config_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+        if (!tc) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        strcpy(tc->name, name);
+
+        if ((tmp = ast_variable_retrieve(cfg, category, "snapshot")))
+            tc->snapshot = ast_true(tmp);
+        tmp = ast_variable_retrieve(cfg, category, "database");
+        tc->database = ast_strdup(S_OR(tmp, S_OR(database, "")));
+        if ((tmp = ast_variable_retrieve(cfg, category, "max_time_ms"))
+        && (sscanf(tmp, "%u", &tc->max_time_ms) != 1)) {
+           ast_log(LOG_WARNING, "max_time_ms must be milliseconds, not '%s'\n", tmp);
+           tc->max_time_ms = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, category, "batch_size"))
+        && (sscanf(tmp, "%u", &tc->batch_size) != 1)) {
+           ast_log(LOG_WARNING, "batch_size must be a number of documents, not '%s'\n", tmp);
+           tc->batch_size = 0;
+        }
+        tc->max_rows = max_rows;
+        if ((tmp = ast_variable_retrieve(cfg, category, "max_rows"))
+        && (sscanf(tmp, "%u", &tc->max_rows) != 1)) {
+           ast_log(LOG_WARNING, "max_rows must be a number of rows, not '%s'\n", tmp);
+           tc->max_rows = max_rows;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, category, "prefetch")))
+            tc->prefetch = ast_true(tmp);
+        tc->read_prefs = make_read_prefs(cfg, category);
+        if (!tc->read_prefs && !ast_variable_retrieve(cfg, category, "read_preference"))
+            tc->read_prefs = make_read_prefs(cfg, CATEGORY);
+        if ((tmp = ast_variable_retrieve(cfg, category, "projection"))
+        && !(tc->projection = make_projection(tmp)))
+           ast_log(LOG_WARNING, "projection must be a list of fields, not '%s'\n", tmp);
+        if ((tmp = ast_variable_retrieve(cfg, category, "reversed_fields"))
+        && !(tc->reversed = make_projection(tmp)))
+           ast_log(LOG_WARNING, "reversed_fields must be a list of fields, not '%s'\n", tmp);
+        if ((tmp = ast_variable_retrieve(cfg, category, "write_behind")))
+            tc->write_behind = ast_true(tmp);
+        tc->write_concern = make_write_concern(cfg, category);
+        if (!tc->write_concern && !ast_variable_retrieve(cfg, category, "write_concern"))
+            tc->write_concern = make_write_concern(cfg, CATEGORY);
+        if ((tmp = ast_variable_retrieve(cfg, category, "upsert")))
+            tc->upsert = ast_true(tmp);
+        tmp = ast_variable_retrieve(cfg, category, "typed_storage");
+        tc->typed = ast_true(S_OR(tmp, ast_variable_retrieve(cfg, CATEGORY, "typed_storage")));
+
+        ao2_link_flags(tables, tc, OBJ_NOLOCK);
+        ao2_ref(tc, -1);
+    }
+    return tables;
+}
+
+/*!
+ * \brief a document kept in a snapshot
+ */
+struct snapshot_doc {
+    struct ast_variable *vars;  /*!< key-value list of the document, owned */
+    char id[0];                 /*!< _id of the document */
+};
+
+AST_VECTOR(snapshot_docs, struct snapshot_doc *);
+
+/*!
+ * \brief documents having a value of an indexed field
+ *
+ * It doesn't hold any reference of the documents, which are held by the snapshot.
+ */
+struct index_bucket {
+    AST_VECTOR(, struct snapshot_doc *) docs;
+    char value[0];
+};
+
+/*!
+ * \brief an index of a field looked up by equality
+ */
+struct snapshot_index {
+    AST_LIST_ENTRY(snapshot_index) list;
+    struct ao2_container *buckets;
+    char field[0];
+};
+
+/*!
+ * \brief a whole collection kept in memory
+ *
+ * The documents and the indexes are protected by the rwlock of the object.
+ */
+struct snapshot {
+    struct ao2_container *docs;
+    AST_LIST_HEAD_NOLOCK(, snapshot_index) indexes;
+    const char *table;          /*!< points into database[] */
+    char database[0];
+};
+
+static void snapshot_doc_destructor(void *obj)
+{
+    struct snapshot_doc *doc = obj;
+    if (doc->vars)
+        ast_variables_destroy(doc->vars);
+}
+
+static int snapshot_doc_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct snapshot_doc *)obj)->id;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_case_hash(key);
+}
+
+static int snapshot_doc_cmp(void *obj, void *arg, int flags)
+{
+    const struct snapshot_doc *doc = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct snapshot_doc *)arg)->id;
+            break;
+        default:
+            return 0;
+    }
+    return strcasecmp(doc->id, key) ? 0 : CMP_MATCH;
+}
+
+static void index_bucket_destructor(void *obj)
+{
+    struct index_bucket *bucket = obj;
+    AST_VECTOR_FREE(&bucket->docs);
+}
+
+static int index_bucket_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct index_bucket *)obj)->value;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int index_bucket_cmp(void *obj, void *arg, int flags)
+{
+    const struct index_bucket *bucket = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct index_bucket *)arg)->value;
+            break;
+        default:
+            return 0;
+    }
+    return strcmp(bucket->value, key) ? 0 : CMP_MATCH;
+}
+
+static void snapshot_destructor(void *obj)
+{
+    struct snapshot *snap = obj;
+    struct snapshot_index *index;
+
+    while ((index = AST_LIST_REMOVE_HEAD(&snap->indexes, list))) {
+        ao2_cleanup(index->buckets);
+        ast_free(index);
+    }
+    ao2_cleanup(snap->docs);
+}
+
+static int snapshot_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct snapshot *)obj)->table;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int snapshot_cmp(void *obj, void *arg, int flags)
+{
+    const struct snapshot *snap = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct snapshot *)arg)->table;
+            break;
+        default:
+            return 0;
+    }
+    return strcmp(snap->table, key) ? 0 : CMP_MATCH;
+}
+
+static const char *find_value(const struct ast_variable *vars, const char *name)
+{
+    for (; vars; vars = vars->next) {
+        if (!strcmp(vars->name, name))
+            return vars->value;
+    }
+    return NULL;
+}
+
+/*!
+ * \brief make a document of snapshot
+ * \param vars  is a key-value list having _id, which is owned by the document made.
+ */
+static struct snapshot_doc *snapshot_doc_new(struct ast_variable *vars)
+{
+    struct snapshot_doc *doc;
+    const char *id = find_value(vars, "_id");
+
+    if (!id) {
+        ast_log(LOG_WARNING, "no _id found\n");
+        ast_variables_destroy(vars);
+        return NULL;
+    }
+    doc = ao2_alloc_options(sizeof(*doc) + strlen(id) + 1, snapshot_doc_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!doc) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        ast_variables_destroy(vars);
+        return NULL;
+    }
+    strcpy(doc->id, id);
+    doc->vars = vars;
+    return doc;
+}
+
+static void index_add(struct snapshot_index *index, struct snapshot_doc *doc)
+{
+    struct index_bucket *bucket;
+    const char *value = find_value(doc->vars, index->field);
+
+    if (!value)
+        return;
+    bucket = ao2_find(index->buckets, value, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+    if (!bucket) {
+        bucket = ao2_alloc_options(sizeof(*bucket) + strlen(value) + 1, index_bucket_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+        if (!bucket || AST_VECTOR_INIT(&bucket->docs, 1)) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            ao2_cleanup(bucket);
+            return;
+        }
+        strcpy(bucket->value, value);
+        ao2_link_flags(index->buckets, bucket, OBJ_NOLOCK);
+    }
+    if (AST_VECTOR_APPEND(&bucket->docs, doc))
+        ast_log(LOG_ERROR, "not enough memory\n");
+    ao2_ref(bucket, -1);
+}
+
+static void index_remove(struct snapshot_index *index, struct snapshot_doc *doc)
+{
+    struct index_bucket *bucket;
+    const char *value = find_value(doc->vars, index->field);
+    size_t i;
+
+    if (!value || !(bucket = ao2_find(index->buckets, value, OBJ_SEARCH_KEY | OBJ_NOLOCK)))
+        return;
+    for (i = 0; i < AST_VECTOR_SIZE(&bucket->docs); i++) {
+        if (AST_VECTOR_GET(&bucket->docs, i) == doc) {
+            AST_VECTOR_REMOVE_UNORDERED(&bucket->docs, i);
+            break;
+        }
+    }
+    if (!AST_VECTOR_SIZE(&bucket->docs))
+        ao2_unlink_flags(index->buckets, bucket, OBJ_NOLOCK);
+    ao2_ref(bucket, -1);
+}
+
+/*!
+ * \brief remove a document from a snapshot, it must be write locked.
+ */
+static void snapshot_unlink(struct snapshot *snap, struct snapshot_doc *doc)
+{
+    struct snapshot_index *index;
+
+    AST_LIST_TRAVERSE(&snap->indexes, index, list)
+        index_remove(index, doc);
+    ao2_unlink_flags(snap->docs, doc, OBJ_NOLOCK);
+}
+
+/*!
+ * \brief add or replace a document of a snapshot, it must be write locked.
+ */
+static void snapshot_link(struct snapshot *snap, struct snapshot_doc *doc)
+{
+    struct snapshot_index *index;
+    struct snapshot_doc *old;
+
+    old = ao2_find(snap->docs, doc->id, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+    if (old) {
+        snapshot_unlink(snap, old);
+        ao2_ref(old, -1);
+    }
+    if (!ao2_link_flags(snap->docs, doc, OBJ_NOLOCK)) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return;
+    }
+    AST_LIST_TRAVERSE(&snap->indexes, index, list)
+        index_add(index, doc);
+}
+
+/*!
+ * \brief find an index of a field, it must be locked.
+ */
+static struct snapshot_index *snapshot_index_find(struct snapshot *snap, const char *field)
+{
+    struct snapshot_index *index;
+
+    AST_LIST_TRAVERSE(&snap->indexes, index, list) {
+        if (!strcmp(index->field, field))
+            break;
+    }
+    return index;
+}
+
+/*!
+ * \brief make an index of a field, it must be write locked.
+ */
+static struct snapshot_index *snapshot_index_new(struct snapshot *snap, const char *field)
+{
+    struct snapshot_index *index;
+    struct ao2_iterator i;
+    struct snapshot_doc *doc;
+
+    index = ast_calloc(1, sizeof(*index) + strlen(field) + 1);
+    if (!index)
+        return NULL;
+    strcpy(index->field, field);
+    index->buckets = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, SNAPSHOT_BUCKETS,
+                                              index_bucket_hash, NULL, index_bucket_cmp);
+    if (!index->buckets) {
+        ast_free(index);
+        return NULL;
+    }
+    i = ao2_iterator_init(snap->docs, AO2_ITERATOR_DONTLOCK);
+    for (; (doc = ao2_iterator_next(&i)); ao2_ref(doc, -1))
+        index_add(index, doc);
+    ao2_iterator_destroy(&i);
+    AST_LIST_INSERT_TAIL(&snap->indexes, index, list);
+    ast_log(LOG_DEBUG, "index of %s made on table=%s\n", field, snap->table);
+    return index;
+}
+
+/*!
+ * \brief find the first field to query by equality
+ * \param[in]   fields
+ * \param[out]  name    is a buffer to be stored name of the field
+ * \param[in]   size    is size of the buffer
+ * \retval the value to query,
+ * \retval NULL if no field to query by equality.
+ */
+static const char *equality_field(const struct ast_variable *fields, char name[], size_t size)
+{
+    for (; fields; fields = fields->next) {
+        const char *tokens[MAXTOKENS];
+
+        if (strlen(fields->name) >= (size - 1))
+            continue;
+        strcpy(name, fields->name);
+        if (str_split(name, " ", tokens) != 1)
+            continue;
+        memmove(name, tokens[0], strlen(tokens[0]) + 1);
+#ifdef HANDLE_ID_AS_OID
+        if ((strcmp(name, "id") == 0)
+        &&  bson_oid_is_valid(fields->value, strlen(fields->value)))
+            ast_copy_string(name, "_id", size);
+#endif
+        return fields->value;
+    }
+    return NULL;
+}
+
+/*!
+ * \brief find documents matching the fields in a snapshot
+ * \param[in]   snap
+ * \param[in]   fields  is a list containing one or more field/operator/value set.
+ * \param[in]   limit   is max number of documents to find, 0 is unlimited.
+ * \param[out]  found   is stored references of documents found.
+ */
+static void snapshot_find(struct snapshot *snap, const struct ast_variable *fields, size_t limit,
+                          struct snapshot_docs *found)
+{
+    struct snapshot_index *index = NULL;
+    struct snapshot_doc *doc;
+    char name[1024];
+    const char *value = equality_field(fields, name, sizeof(name));
+
+    ao2_rdlock(snap);
+    if (value && strcmp(name, "_id") && !(index = snapshot_index_find(snap, name))) {
+        ao2_unlock(snap);
+        ao2_wrlock(snap);
+        if (!(index = snapshot_index_find(snap, name)))
+            index = snapshot_index_new(snap, name);
+        ao2_unlock(snap);
+        ao2_rdlock(snap);
+        index = snapshot_index_find(snap, name);
+    }
+
+    if (value && !strcmp(name, "_id")) {
+        doc = ao2_find(snap->docs, value, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+        if (doc && match_fields(doc->vars, fields) && !AST_VECTOR_APPEND(found, doc))
+            doc = NULL;
+        ao2_cleanup(doc);
+    }
+    else if (index) {
+        struct index_bucket *bucket = ao2_find(index->buckets, value, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+        size_t i;
+
+        for (i = 0; bucket && i < AST_VECTOR_SIZE(&bucket->docs); i++) {
+            doc = AST_VECTOR_GET(&bucket->docs, i);
+            if (!match_fields(doc->vars, fields))
+                continue;
+            if (AST_VECTOR_APPEND(found, ao2_bump(doc)))
+                ao2_ref(doc, -1);
+            if (limit && AST_VECTOR_SIZE(found) >= limit)
+                break;
+        }
+        ao2_cleanup(bucket);
+    }
+    else {
+        struct ao2_iterator i = ao2_iterator_init(snap->docs, AO2_ITERATOR_DONTLOCK);
+
+        while ((doc = ao2_iterator_next(&i))) {
+            if (!match_fields(doc->vars, fields) || AST_VECTOR_APPEND(found, doc))
+                ao2_ref(doc, -1);
+            if (limit && AST_VECTOR_SIZE(found) >= limit)
+                break;
+        }
+        ao2_iterator_destroy(&i);
+    }
+    ao2_unlock(snap);
+}
+
+/*!
+ * \brief compare values as sort of find does, numerically if both are integer.
+ */
+static int compare_values(const char *lhs, const char *rhs)
+{
+    long long l;
+    long long r;
+
+    if (!lhs || !rhs)
+        return !rhs - !lhs;
+    if (*lhs && *rhs && is_integer(lhs, &l) && is_integer(rhs, &r))
+        return (l > r) - (l < r);
+    return strcmp(lhs, rhs);
+}
+
+/*!
+ * \brief sort documents found in ascending order of a field
+ */
+static void snapshot_docs_sort(struct snapshot_docs *docs, const char *field)
+{
+    size_t i;
+    size_t j;
+
+    for (i = 1; i < AST_VECTOR_SIZE(docs); i++) {
+        struct snapshot_doc *doc = AST_VECTOR_GET(docs, i);
+        const char *value = find_value(doc->vars, field);
+
+        for (j = i; j > 0 && compare_values(find_value(AST_VECTOR_GET(docs, j - 1)->vars, field), value) > 0; j--)
+            *AST_VECTOR_GET_ADDR(docs, j) = AST_VECTOR_GET(docs, j - 1);
+        *AST_VECTOR_GET_ADDR(docs, j) = doc;
+    }
+}
+
+static void snapshot_docs_free(struct snapshot_docs *docs)
+{
+    AST_VECTOR_CALLBACK_VOID(docs, ao2_ref, -1);
+    AST_VECTOR_FREE(docs);
+}
+
+/*!
+ * \brief get a snapshot of a collection
+ * \retval a reference to the snapshot,
+ * \retval NULL if the collection has no snapshot.
+ */
+static struct snapshot *snapshot_get(const char *database, const char *table)
+{
+    struct ao2_container *snaps = ao2_global_obj_ref(snapshots);
+    struct snapshot *snap = NULL;
+
+    if (snaps) {
+        snap = ao2_find(snaps, table, OBJ_SEARCH_KEY);
+        if (snap && strcmp(snap->database, database)) {
+            ao2_ref(snap, -1);
+            snap = NULL;
+        }
+        ao2_ref(snaps, -1);
+    }
+    return snap;
+}
+
+/*!
+ * \brief load a whole collection into a snapshot
+ * \retval a snapshot,
+ * \retval NULL if something wrong.
+ */
+static struct snapshot *snapshot_load(mongoc_client_t *dbclient, const char *database, const char *table)
+{
+    struct snapshot *snap;
+    struct table_config *tc = NULL;
+    mongoc_collection_t *collection = NULL;
+    mongoc_cursor_t *cursor = NULL;
+    const bson_t *doc;
+    bson_t *query = NULL;
+    size_t database_len = strlen(database) + 1;
+    bool loaded = false;
+
+    snap = ao2_alloc_options(sizeof(*snap) + database_len + strlen(table) + 1, snapshot_destructor, AO2_ALLOC_OPT_LOCK_RWLOCK);
+    if (!snap) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    memcpy(snap->database, database, database_len);
+    snap->table = snap->database + database_len;
+    strcpy((char *)snap->table, table);
+    AST_LIST_HEAD_INIT_NOLOCK(&snap->indexes);
+
+    do {
+        bson_error_t error;
+
+        snap->docs = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, SNAPSHOT_BUCKETS,
+                                              snapshot_doc_hash, NULL, snapshot_doc_cmp);
+        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        if (!snap->docs || !query) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        collection = mongoc_client_get_collection(dbclient, database, table);
+        cursor = collection_find(collection, table, query, NULL);
+        if (!cursor) {
+            ast_log(LOG_ERROR, "query failed, database=%s, table=%s\n", database, table);
+            break;
+        }
+        tc = table_config_get(table);
+        while (mongoc_cursor_next(cursor, &doc)) {
+            struct snapshot_doc *sdoc = snapshot_doc_new(doc2variables(doc, table, tc));
+            if (sdoc) {
+                snapshot_link(snap, sdoc);
+                ao2_ref(sdoc, -1);
+            }
+        }
+        if (mongoc_cursor_error(cursor, &error)) {
+            ast_log(LOG_ERROR, "cannot load snapshot of database=%s, table=%s, %s\n", database, table, error.message);
+            break;
+        }
+        ast_log(LOG_NOTICE, "snapshot of database=%s, table=%s loaded, %d documents\n",
+                database, table, ao2_container_count(snap->docs));
+        loaded = true;
+    } while(0);
+
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    if (query)
+        bson_destroy(query);
+    ao2_cleanup(tc);
+    if (!loaded) {
+        ao2_ref(snap, -1);
+        snap = NULL;
+    }
+    return snap;
+}
+
+/*!
+ * \brief reload a snapshot, e.g. when changes of the collection might be missed.
+ */
+static void snapshot_reload(const char *database, const char *table)
+{
+    struct ao2_container *snaps = ao2_global_obj_ref(snapshots);
+    struct snapshot *snap = NULL;
+    mongoc_client_t *dbclient;
+
+    if (!snaps)
+        return;
+    if (dbpool && (dbclient = mongoc_client_pool_pop(dbpool))) {
+        snap = snapshot_load(dbclient, database, table);
+        mongoc_client_pool_push(dbpool, dbclient);
+    }
+    if (snap) {
+        ao2_lock(snaps);
+        ao2_find(snaps, table, OBJ_SEARCH_KEY | OBJ_NOLOCK | OBJ_UNLINK | OBJ_NODATA);
+        ao2_link_flags(snaps, snap, OBJ_NOLOCK);
+        ao2_unlock(snaps);
+        ao2_ref(snap, -1);
+    }
+    else {
+        // never answer from a stale snapshot
+        ast_log(LOG_WARNING, "snapshot of database=%s, table=%s dropped\n", database, table);
+        ao2_find(snaps, table, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA);
+    }
+    ao2_ref(snaps, -1);
+}
+
+/*!
+ * \brief load snapshots of the tables configured
+ * \retval a container of snapshots,
+ * \retval NULL if something wrong.
+ */
+static struct ao2_container *snapshot_load_all(struct ao2_container *tables)
+{
+    struct ao2_container *snaps;
+    struct ao2_iterator i;
+    struct table_config *tc;
+    mongoc_client_t *dbclient;
+
+    snaps = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, TABLE_BUCKETS,
+                                     snapshot_hash, NULL, snapshot_cmp);
+    if (!snaps) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if (!dbclient) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        ao2_ref(snaps, -1);
+        return NULL;
+    }
+    i = ao2_iterator_init(tables, 0);
+    for (; (tc = ao2_iterator_next(&i)); ao2_ref(tc, -1)) {
+        struct snapshot *snap;
+
+        if (!tc->snapshot)
+            continue;
+        if (ast_strlen_zero(tc->database)) {
+            ast_log(LOG_WARNING, "no database specified for snapshot of %s\n", tc->name);
+            continue;
+        }
+        snap = snapshot_load(dbclient, tc->database, tc->name);
+        if (snap) {
+            ao2_link_flags(snaps, snap, OBJ_NOLOCK);
+            ao2_ref(snap, -1);
+        }
+    }
+    ao2_iterator_destroy(&i);
+    mongoc_client_pool_push(dbpool, dbclient);
+    return snaps;
+}
+
+/*!
+ * \brief write a document stored through to a snapshot
+ */
+static void snapshot_store(const char *database, const char *table, const bson_t *document)
+{
+    struct snapshot *snap = snapshot_get(database, table);
+    struct table_config *tc;
+    struct snapshot_doc *doc;
+
+    if (!snap)
+        return;
+    tc = table_config_get(table);
+    doc = snapshot_doc_new(doc2variables(document, table, tc));
+    ao2_cleanup(tc);
+    if (doc) {
+        ao2_wrlock(snap);
+        snapshot_link(snap, doc);
+        ao2_unlock(snap);
+        ao2_ref(doc, -1);
+    }
+    ao2_ref(snap, -1);
+}
+
+/*!
+ * \brief check if a key-value list has all the values of another.
+ */
+static bool match_values(const struct ast_variable *vars, const struct ast_variable *lookup)
+{
+    for (; lookup; lookup = lookup->next) {
+        const char *value = find_value(vars, lookup->name);
+        if (!value || strcmp(value, lookup->value))
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief make a key-value list of a document with values set.
+ * \param vars  is a key-value list of the document
+ * \param set   is a key-value list of values to be set
+ */
+static struct ast_variable *merge_values(const struct ast_variable *vars, const struct ast_variable *set)
+{
+    struct ast_variable *merged = NULL;
+    struct ast_variable *prev = NULL;
+    const struct ast_variable *var;
+
+    for (var = vars; var; var = var->next) {
+        const char *value = find_value(set, var->name);
+        struct ast_variable *v = ast_variable_new(var->name, value ? value : var->value, "");
+        if (!v)
+            continue;
+        if (prev)
+            prev->next = v;
+        else
+            merged = v;
+        prev = v;
+    }
+    for (var = set; var; var = var->next) {
+        struct ast_variable *v;
+        if (find_value(vars, var->name) || !(v = ast_variable_new(var->name, var->value, "")))
+            continue;
+        if (prev)
+            prev->next = v;
+        else
+            merged = v;
+        prev = v;
+    }
+    return merged;
+}
+
+/*!
+ * \brief write an update through to a snapshot
+ * \param database
+ * \param table
+ * \param query     is a document to select documents
+ * \param data      is a document of values to be set
+ *
+ * Both are converted as documents found are, so that the values compare as strings.
+ */
+static void snapshot_update(const char *database, const char *table, const bson_t *query, const bson_t *data)
+{
+    struct snapshot *snap = snapshot_get(database, table);
+    struct snapshot_docs matched;
+    struct ast_variable *lookup;
+    struct ast_variable *set;
+    struct table_config *tc;
+    struct ao2_iterator i;
+    struct snapshot_doc *doc;
+    size_t n;
+
+    if (!snap)
+        return;
+    if (AST_VECTOR_INIT(&matched, 1)) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        ao2_ref(snap, -1);
+        return;
+    }
+    tc = table_config_get(table);
+    lookup = doc2variables(query, table, tc);
+    set = doc2variables(data, table, tc);
+    ao2_cleanup(tc);
+
+    ao2_wrlock(snap);
+    // documents are replaced after iteration, not to visit them again
+    i = ao2_iterator_init(snap->docs, AO2_ITERATOR_DONTLOCK);
+    while ((doc = ao2_iterator_next(&i))) {
+        if (!match_values(doc->vars, lookup) || AST_VECTOR_APPEND(&matched, doc))
+            ao2_ref(doc, -1);
+    }
+    ao2_iterator_destroy(&i);
+    for (n = 0; n < AST_VECTOR_SIZE(&matched); n++) {
+        struct snapshot_doc *updated = snapshot_doc_new(merge_values(AST_VECTOR_GET(&matched, n)->vars, set));
+        if (updated) {
+            snapshot_link(snap, updated);
+            ao2_ref(updated, -1);
+        }
+    }
+    ao2_unlock(snap);
+
+    snapshot_docs_free(&matched);
+    if (lookup)
+        ast_variables_destroy(lookup);
+    if (set)
+        ast_variables_destroy(set);
+    ao2_ref(snap, -1);
+}
+
+/*!
+ * \brief write a deletion through to a snapshot
+ *
+ * If more than one document match, the snapshot is reloaded
+ * since it's unknown which one has been deleted.
+ */
+static void snapshot_destroy(const char *database, const char *table, const char *keyfield, const char *lookup)
+{
+    struct snapshot *snap = snapshot_get(database, table);
+    struct ao2_iterator i;
+    struct snapshot_doc *doc;
+    struct snapshot_doc *found = NULL;
+    int count = 0;
+
+    if (!snap)
+        return;
+    ao2_wrlock(snap);
+    i = ao2_iterator_init(snap->docs, AO2_ITERATOR_DONTLOCK);
+    for (; (doc = ao2_iterator_next(&i)); ao2_ref(doc, -1)) {
+        const char *value = find_value(doc->vars, key_asterisk2mongo(keyfield));
+        if (!value || strcmp(value, lookup))
+            continue;
+        if (!count++)
+            found = ao2_bump(doc);
+    }
+    ao2_iterator_destroy(&i);
+    if (count == 1)
+        snapshot_unlink(snap, found);
+    ao2_unlock(snap);
+    ao2_cleanup(found);
+
+    if (count > 1)
+        snapshot_reload(database, table);
+    ao2_ref(snap, -1);
+}
+
+/*!
+ * \brief apply a change event to a snapshot
+ * \param vars  is the document changed, or NULL if it was deleted.
+ */
+static void snapshot_refresh(const char *database, const char *table, const char *id, const struct ast_variable *vars)
+{
+    struct snapshot *snap = snapshot_get(database, table);
+    struct snapshot_doc *doc;
+
+    if (!snap)
+        return;
+    ao2_wrlock(snap);
+    if (vars) {
+        doc = snapshot_doc_new(ast_variables_dup((struct ast_variable *)vars));
+        if (doc)
+            snapshot_link(snap, doc);
+    }
+    else if ((doc = ao2_find(snap->docs, id, OBJ_SEARCH_KEY | OBJ_NOLOCK)))
+        snapshot_unlink(snap, doc);
+    ao2_unlock(snap);
+    ao2_cleanup(doc);
+    ao2_ref(snap, -1);
+}
+
+/*!
+ * \brief check if a snapshot can evaluate all of the fields as make_query() does.
+ */
+static bool snapshot_supported(const struct ast_variable *fields)
+{
+    for (; fields; fields = fields->next) {
+        const char *tokens[MAXTOKENS];
+        char buf[1024];
+        int count;
+
+        if (strlen(fields->name) >= (sizeof(buf) - 1))
+            return false;
+        strcpy(buf, fields->name);
+        count = str_split(buf, " ", tokens);
+        if (count == 1)
+            continue;
+        if (count != 2)
+            return false;
+        if (strcasecmp(tokens[1], "LIKE") && strcasecmp(tokens[1], "!=")
+        &&  strcasecmp(tokens[1], ">") && strcasecmp(tokens[1], "<="))
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief answer realtime() from a snapshot
+ * \param[out] var  is stored a key-value list found, or NULL if not found.
+ * \retval true if the table has a snapshot to answer.
+ */
+static bool snapshot_realtime(const char *database, const char *table, const struct ast_variable *fields,
+                              struct ast_variable **var)
+{
+    struct snapshot *snap;
+    struct snapshot_docs found;
+
+    if (!snapshot_supported(fields) || !(snap = snapshot_get(database, table)))
+        return false;
+    *var = NULL;
+    if (!AST_VECTOR_INIT(&found, 1)) {
+        snapshot_find(snap, fields, 1, &found);
+        if (AST_VECTOR_SIZE(&found))
+            *var = ast_variables_dup(AST_VECTOR_GET(&found, 0)->vars);
+        snapshot_docs_free(&found);
+    }
+    ao2_ref(snap, -1);
+    return true;
+}
+
+/*!
+ * \brief answer realtime_multi() from a snapshot
+ * \param[in]  limit    is max number of rows, 0 = unlimited
+ * \param[out] cfg      is stored categories found in order of initfield.
+ * \retval true if the table has a snapshot to answer.
+ */
+static bool snapshot_realtime_multi(const char *database, const char *table, const struct ast_variable *fields,
+                                    const char *initfield, unsigned limit, struct ast_config **cfg)
+{
+    struct snapshot *snap;
+    struct snapshot_docs found;
+    size_t i;
+
+    if (!snapshot_supported(fields) || !(snap = snapshot_get(database, table)))
+        return false;
+    *cfg = ast_config_new();
+    if (!*cfg || AST_VECTOR_INIT(&found, 8)) {
+        ast_log(LOG_WARNING, "out of memory!\n");
+        ao2_ref(snap, -1);
+        return true;
+    }
+    snapshot_find(snap, fields, 0, &found);
+    snapshot_docs_sort(&found, key_asterisk2mongo(initfield));
+
+    if (limit && AST_VECTOR_SIZE(&found) > limit)
+        ast_log(LOG_WARNING, "more than %u rows found, database=%s, table=%s\n", limit, database, table);
+    for (i = 0; i < AST_VECTOR_SIZE(&found) && (!limit || i < limit); i++) {
+        const struct ast_variable *var;
+        struct ast_category *cat = ast_category_new("", "", 99999);
+
+        if (!cat) {
+            ast_log(LOG_WARNING, "out of memory!\n");
+            break;
+        }
+        for (var = AST_VECTOR_GET(&found, i)->vars; var; var = var->next) {
+            if (!strcmp(initfield, var->name))
+                ast_category_rename(cat, var->value);
+            ast_variable_append(cat, ast_variable_new(var->name, var->value, ""));
+        }
+        ast_category_append(*cfg, cat);
+    }
+    snapshot_docs_free(&found);
+    ao2_ref(snap, -1);
+    return true;
+}
+
+/*!
+ * \brief kinds of queries coalesced
+ */
+enum flight_kind {
+    FLIGHT_REALTIME,
+    FLIGHT_REALTIME_MULTI,
+};
+
+/*!
+ * \brief a query in flight, which identical queries wait for instead of sending their own.
+ *
+ * It's protected by flight_lock.
+ */
+struct flight {
+    enum flight_kind kind;
+    ast_cond_t cond;
+    unsigned waiters;
+    bool landed;
+    struct ast_variable *var;   /*!< result of realtime() for the waiters, owned */
+    struct ast_config *cfg;     /*!< result of realtime_multi() for the waiters, owned */
+    char key[0];                /*!< made by cache_key() */
+};
+
+static struct ao2_container *flights = NULL;
+
+static void flight_destructor(void *obj)
+{
+    struct flight *flight = obj;
+
+    if (flight->var)
+        ast_variables_destroy(flight->var);
+    if (flight->cfg)
+        ast_config_destroy(flight->cfg);
+    ast_cond_destroy(&flight->cond);
+}
+
+static int flight_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct flight *)obj)->key;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int flight_cmp(void *obj, void *arg, int flags)
+{
+    const struct flight *flight = obj;
+    const struct flight *other = arg;
+
+    // only objects are searched, the kind must match as well
+    if ((flags & OBJ_SEARCH_MASK) != OBJ_SEARCH_OBJECT)
+        return 0;
+    return (flight->kind == other->kind && !strcmp(flight->key, other->key)) ? CMP_MATCH : 0;
+}
+
+/*!
+ * \brief join a query in flight, or start one.
+ * \param[in]   kind
+ * \param[in]   key     is made by cache_key()
+ * \param[out]  leader  is set true if the caller has to query and call flight_land().
+ * \retval a reference to the flight,
+ * \retval NULL if the caller should query alone.
+ */
+static struct flight *flight_join(enum flight_kind kind, const char *key, bool *leader)
+{
+    struct flight *flight;
+    struct flight *found;
+    size_t key_len = strlen(key) + 1;
+
+    *leader = false;
+    flight = ao2_alloc_options(sizeof(*flight) + key_len, flight_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!flight)
+        return NULL;
+    flight->kind = kind;
+    memcpy(flight->key, key, key_len);
+    ast_cond_init(&flight->cond, NULL);
+
+    ast_mutex_lock(&flight_lock);
+    if (!flights) {
+        ast_mutex_unlock(&flight_lock);
+        ao2_ref(flight, -1);
+        return NULL;
+    }
+    found = ao2_find(flights, flight, OBJ_SEARCH_OBJECT | OBJ_NOLOCK);
+    if (found) {
+        found->waiters++;
+        ast_mutex_unlock(&flight_lock);
+        ao2_ref(flight, -1);
+        return found;
+    }
+    if (ao2_link_flags(flights, flight, OBJ_NOLOCK))
+        *leader = true;
+    ast_mutex_unlock(&flight_lock);
+    if (!*leader) {
+        ao2_ref(flight, -1);
+        return NULL;
+    }
+    return flight;
+}
+
+/*!
+ * \brief land a query in flight, handing the result to the waiters.
+ * \param flight    is a reference returned to the leader, which is released.
+ * \param var       is the result of realtime(), still owned by the leader
+ * \param cfg       is the result of realtime_multi(), still owned by the leader
+ */
+static void flight_land(struct flight *flight, struct ast_variable *var, struct ast_config *cfg)
+{
+    ast_mutex_lock(&flight_lock);
+    if (flights)
+        ao2_unlink_flags(flights, flight, OBJ_NOLOCK);
+    if (flight->waiters) {
+        // no more waiter joins since unlinked
+        flight->var = var ? ast_variables_dup(var) : NULL;
+        flight->cfg = cfg ? ast_config_copy(cfg) : NULL;
+    }
+    flight->landed = true;
+    ast_cond_broadcast(&flight->cond);
+    ast_mutex_unlock(&flight_lock);
+    ao2_ref(flight, -1);
+}
+
+/*!
+ * \brief wait for a query in flight to land
+ * \param[in]   flight  is a reference returned to a waiter, which is released.
+ * \param[out]  var     is stored a copy of the result of realtime(), if not NULL
+ * \param[out]  cfg     is stored a copy of the result of realtime_multi(), if not NULL
+ */
+static void flight_wait(struct flight *flight, struct ast_variable **var, struct ast_config **cfg)
+{
+    ast_mutex_lock(&flight_lock);
+    while (!flight->landed)
+        ast_cond_wait(&flight->cond, &flight_lock);
+    ast_mutex_unlock(&flight_lock);
+
+    // the result is never changed after landing
+    if (var)
+        *var = flight->var ? ast_variables_dup(flight->var) : NULL;
+    if (cfg)
+        *cfg = flight->cfg ? ast_config_copy(flight->cfg) : NULL;
+    ao2_ref(flight, -1);
+}
+
+static int flight_init(void)
+{
+    int res = 0;
+
+    ast_mutex_lock(&flight_lock);
+    if (!flights) {
+        flights = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, CACHE_BUCKETS,
+                                           flight_hash, NULL, flight_cmp);
+        if (!flights) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            res = -1;
+        }
+    }
+    ast_mutex_unlock(&flight_lock);
+    return res;
+}
+
+static void flight_destroy(void)
+{
+    ast_mutex_lock(&flight_lock);
+    ao2_cleanup(flights);
+    flights = NULL;
+    ast_mutex_unlock(&flight_lock);
+}
+
+/*!
+ * \brief a collection to be watched by a change stream
+ */
+struct watch_target {
+    AST_LIST_ENTRY(watch_target) list;
+    const char *table;          /*!< points into database[] */
+    char database[0];
+};
+
+/*!
+ * \brief a change stream opened by the watcher thread
+ */
+struct watch_stream {
+    const struct watch_target *target;
+    mongoc_change_stream_t *stream;
+    struct timeval retry;       /*!< when to reopen the stream after an error */
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(watch_targets, watch_target);
+static unsigned watch_target_count = 0;
+static pthread_t watch_thread_id = AST_PTHREADT_NULL;
+static ast_cond_t watch_cond;
+static bool watch_stopping = false;
+
+/*!
+ * \brief check if changes are to be watched, by cache_watch and anything kept to be refreshed
+ */
+static bool watch_enabled(void)
+{
+    return cache_watch && (cache_ttl || negative_cache_ttl || snapshot_count || load_cache);
+}
+
+/*!
+ * \brief register a collection to be watched
+ *
+ * The registered collections are kept until the module is unloaded.
+ */
+static void watch_register(const char *database, const char *table)
+{
+    struct watch_target *target;
+    size_t database_len = strlen(database) + 1;
+    size_t table_len = strlen(table) + 1;
+
+    if (!watch_enabled())
+        return;
+
+    ast_mutex_lock(&watch_lock);
+    AST_LIST_TRAVERSE(&watch_targets, target, list) {
+        if (!strcmp(target->database, database) && !strcmp(target->table, table))
+            break;
+    }
+    if (!target && (target = ast_calloc(1, sizeof(*target) + database_len + table_len))) {
+        memcpy(target->database, database, database_len);
+        target->table = target->database + database_len;
+        memcpy((char *)target->table, table, table_len);
+        AST_LIST_INSERT_TAIL(&watch_targets, target, list);
+        watch_target_count++;
+        ast_cond_signal(&watch_cond);
+        ast_log(LOG_DEBUG, "watching database=%s, table=%s\n", database, table);
+    }
+    ast_mutex_unlock(&watch_lock);
+}
+
+/*!
+ * \brief apply a change event to the cached results and the snapshot
+ * \retval true if the stream is still available.
+ */
+static bool watch_apply(const struct watch_target *target, const bson_t *event)
+{
+    bson_iter_t iter;
+    bson_iter_t id;
+    const char *op = NULL;
+    char oid[25];
+    const char *key = NULL;
+    uint32_t length;
+
+    TRACE_BSON(target->table, "change event %s\n", event);
+    // any change of a file of static configuration is fetched again
+    load_cache_purge(target->database, target->table);
+
+    if (bson_iter_init_find(&iter, event, "operationType") && BSON_ITER_HOLDS_UTF8(&iter))
+        op = bson_iter_utf8(&iter, &length);
+    if (bson_iter_init(&iter, event) && bson_iter_find_descendant(&iter, "documentKey._id", &id)) {
+        if (BSON_ITER_HOLDS_OID(&id)) {
+            bson_oid_to_string(bson_iter_oid(&id), oid);
+            key = oid;
+        }
+        else if (BSON_ITER_HOLDS_UTF8(&id))
+            key = bson_iter_utf8(&id, &length);
+    }
+
+    if (op && key && (!strcmp(op, "insert") || !strcmp(op, "update") || !strcmp(op, "replace"))) {
+        struct ast_variable *vars = NULL;
+        bool own = true;
+
+        if (bson_iter_init_find(&iter, event, "fullDocument") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+            const uint8_t *data;
+            bson_t full;
+
+            bson_iter_document(&iter, &length, &data);
+            if (bson_init_static(&full, data, length)) {
+                struct table_config *tc = table_config_get(target->table);
+
+                vars = doc2variables(&full, target->table, tc);
+                ao2_cleanup(tc);
+                // a snapshot has only documents of this server
+                if (serverid) {
+                    bson_iter_t sid;
+                    own = bson_iter_init_find(&sid, &full, SERVERID) && BSON_ITER_HOLDS_OID(&sid)
+                        && bson_oid_equal(bson_iter_oid(&sid), serverid);
+                }
+            }
+        }
+        if (vars) {
+            cache_refresh(target->database, target->table, key, vars);
+            snapshot_refresh(target->database, target->table, key, own ? vars : NULL);
+            ast_variables_destroy(vars);
+        }
+        else {
+            // the document has gone already
+            cache_purge(target->database, target->table);
+            snapshot_reload(target->database, target->table);
+        }
+        return true;
+    }
+    if (op && key && !strcmp(op, "delete")) {
+        cache_refresh(target->database, target->table, key, NULL);
+        snapshot_refresh(target->database, target->table, key, NULL);
+        return true;
+    }
+
+    // drop, rename, invalidate or anything unknown
+    ast_log(LOG_DEBUG, "%s on database=%s, table=%s\n", S_OR(op, "unknown event"), target->database, target->table);
+    cache_purge(target->database, target->table);
+    snapshot_reload(target->database, target->table);
+    return !op || (strcmp(op, "invalidate") && strcmp(op, "drop") && strcmp(op, "rename") && strcmp(op, "dropDatabase"));
+}
+
+/*!
+ * \brief poll a change stream
+ * \retval true if the stream is still available.
+ */
+static bool watch_poll(mongoc_client_t *dbclient, struct watch_stream *ws)
+{
+    const bson_t *event;
+    const bson_t *reply;
+    bson_error_t error;
+    bool available = true;
+
+    if (!ws->stream) {
+        mongoc_collection_t *collection;
+        bson_t *opts = BCON_NEW("fullDocument", BCON_UTF8("updateLookup"),
+                                "maxAwaitTimeMS", BCON_INT64(WATCH_AWAIT_MS));
+
+        if (ast_tvcmp(ws->retry, ast_tvnow()) > 0) {
+            bson_destroy(opts);
+            return false;
+        }
+        collection = mongoc_client_get_collection(dbclient, ws->target->database, ws->target->table);
+        ws->stream = mongoc_collection_watch(collection, NULL, opts);
+        mongoc_collection_destroy(collection);
+        bson_destroy(opts);
+        // events before the stream opened are unknown
+        cache_purge(ws->target->database, ws->target->table);
+        if (!ast_tvzero(ws->retry))
+            snapshot_reload(ws->target->database, ws->target->table);
+    }
+
+    while (mongoc_change_stream_next(ws->stream, &event)) {
+        if (!watch_apply(ws->target, event)) {
+            available = false;
+            break;
+        }
+        if (watch_stopping)
+            return true;
+    }
+    if (available && mongoc_change_stream_error_document(ws->stream, &error, &reply)) {
+        ast_log(LOG_WARNING, "change stream error on database=%s, table=%s, %s\n",
+                ws->target->database, ws->target->table, error.message);
+        available = false;
+    }
+    if (available) {
+        // no more event for now
+        return true;
+    }
+    mongoc_change_stream_destroy(ws->stream);
+    ws->stream = NULL;
+    ws->retry = ast_tvadd(ast_tvnow(), ast_tv(WATCH_RETRY_SEC, 0));
+    cache_purge(ws->target->database, ws->target->table);
+    return false;
+}
+
+static void *watch_thread(void *data)
+{
+    AST_VECTOR(, struct watch_stream) streams;
+    mongoc_client_t *dbclient;
+    bool polled = false;
+    size_t i;
+
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if (!dbclient) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return NULL;
+    }
+    if (AST_VECTOR_INIT(&streams, 8)) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        mongoc_client_pool_push(dbpool, dbclient);
+        return NULL;
+    }
+    ast_log(LOG_DEBUG, "watcher started.\n");
+
+    for (;;) {
+        const struct watch_target *target;
+
+        ast_mutex_lock(&watch_lock);
+        if (!polled && !watch_stopping && AST_VECTOR_SIZE(&streams) == watch_target_count) {
+            struct timeval wait = ast_tvadd(ast_tvnow(), ast_tv(1, 0));
+            struct timespec ts = { .tv_sec = wait.tv_sec, .tv_nsec = wait.tv_usec * 1000 };
+            ast_cond_timedwait(&watch_cond, &watch_lock, &ts);
+        }
+        if (watch_stopping) {
+            ast_mutex_unlock(&watch_lock);
+            break;
+        }
+        i = 0;
+        AST_LIST_TRAVERSE(&watch_targets, target, list) {
+            if (i++ >= AST_VECTOR_SIZE(&streams)) {
+                struct watch_stream ws = { .target = target, .stream = NULL, .retry = { 0, 0 } };
+                if (AST_VECTOR_APPEND(&streams, ws))
+                    ast_log(LOG_ERROR, "not enough memory\n");
+            }
+        }
+        ast_mutex_unlock(&watch_lock);
+
+        polled = false;
+        for (i = 0; i < AST_VECTOR_SIZE(&streams) && !watch_stopping; i++)
+            polled |= watch_poll(dbclient, AST_VECTOR_GET_ADDR(&streams, i));
+    }
+
+    for (i = 0; i < AST_VECTOR_SIZE(&streams); i++) {
+        struct watch_stream *ws = AST_VECTOR_GET_ADDR(&streams, i);
+        if (ws->stream)
+            mongoc_change_stream_destroy(ws->stream);
+    }
+    AST_VECTOR_FREE(&streams);
+    mongoc_client_pool_push(dbpool, dbclient);
+    ast_log(LOG_DEBUG, "watcher stopped.\n");
+    return NULL;
+}
+
+static int watch_start(void)
+{
+    if (!watch_enabled() || !dbpool || watch_thread_id != AST_PTHREADT_NULL)
+        return 0;
+    watch_stopping = false;
+    if (ast_pthread_create_background(&watch_thread_id, NULL, watch_thread, NULL)) {
+        ast_log(LOG_ERROR, "cannot start the watcher thread\n");
+        watch_thread_id = AST_PTHREADT_NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void watch_stop(void)
+{
+    if (watch_thread_id == AST_PTHREADT_NULL)
+        return;
+    ast_mutex_lock(&watch_lock);
+    watch_stopping = true;
+    ast_cond_signal(&watch_cond);
+    ast_mutex_unlock(&watch_lock);
+    pthread_join(watch_thread_id, NULL);
+    watch_thread_id = AST_PTHREADT_NULL;
+}
+
+static void watch_destroy(void)
+{
+    struct watch_target *target;
+
+    watch_stop();
+    ast_mutex_lock(&watch_lock);
+    while ((target = AST_LIST_REMOVE_HEAD(&watch_targets, list)))
+        ast_free(target);
+    watch_target_count = 0;
+    ast_mutex_unlock(&watch_lock);
+}
+
+/*!
+ * \brief states of an index observed from a shape of queries
+ */
+enum index_state {
+    INDEX_PENDING,              /*!< to be created by the indexer thread */
+    INDEX_CREATED,
+    INDEX_DECLINED,             /*!< not to be created, see reason */
+    INDEX_FAILED,               /*!< failed to be created, see reason */
+};
+
+static const char *index_state_names[] = {
+    [INDEX_PENDING] = "pending",
+    [INDEX_CREATED] = "created",
+    [INDEX_DECLINED] = "declined",
+    [INDEX_FAILED] = "failed",
+};
+
+/*!
+ * \brief an index for a shape of queries to a collection
+ *
+ * All the members are protected by index_lock.
+ */
+struct index_shape {
+    enum index_state state;
+    bson_t *keys;               /*!< keys of the index, serverid first */
+    char *reason;               /*!< why declined or failed, or NULL */
+    const char *database;       /*!< points into name[] */
+    const char *table;          /*!< points into name[] */
+    const char *fields;         /*!< comma separated fields of the query, points into name[] */
+    char name[0];               /*!< database and shape of the query with kinds of LIKE, separated by \x1e */
+};
+
+static struct ao2_container *index_shapes = NULL;
+static pthread_t index_thread_id = AST_PTHREADT_NULL;
+static ast_cond_t index_cond;
+static bool index_stopping = false;
+
+static void index_shape_destructor(void *obj)
+{
+    struct index_shape *idx = obj;
+    if (idx->keys)
+        bson_destroy(idx->keys);
+    ast_free(idx->reason);
+}
+
+static int index_shape_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct index_shape *)obj)->name;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int index_shape_cmp(void *obj, void *arg, int flags)
+{
+    const struct index_shape *idx = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct index_shape *)arg)->name;
+            break;
+        default:
+            return 0;
+    }
+    return strcmp(idx->name, key) ? 0 : CMP_MATCH;
+}
+
+/*!
+ * \brief make keys of an index for a query template,
+ *        equality fields first, then the sort field of realtime_multi, then a range field.
+ * \param tmpl
+ * \param fields    is values of the query, patterns of LIKE are needed.
+ * \param keys      is a document to be appended the keys, serverid first
+ * \retval NULL if success,
+ * \retval a reason why no index can be made.
+ */
+static const char *index_keys(const struct query_template *tmpl, const struct ast_variable *fields, bson_t *keys)
+{
+    const struct ast_variable *field;
+    const char *range = NULL;
+    bool reversed = false;      // range is the reversed shadow of the first field
+    char name[1024];
+    size_t i;
+
+    if (serverid && !BSON_APPEND_INT32(keys, SERVERID, 1))
+        return "not enough memory";
+    for (i = 0, field = fields; field && i < tmpl->count; field = field->next, i++) {
+        const struct query_term *term = &tmpl->terms[i];
+        size_t len = strlen(field->value);
+
+        switch (term->op) {
+            case QUERY_EQ:
+                if (!bson_has_field(keys, term->name) && !BSON_APPEND_INT32(keys, term->name, 1))
+                    return "not enough memory";
+                break;
+            case QUERY_LIKE:
+                if (range || !len || !strcmp(field->value, "%"))
+                    break;
+                if (*field->value != '%')
+                    range = term->name;
+                else if (term->reversed && field->value[len - 1] != '%') {
+                    snprintf(name, sizeof(name), "%s%s", term->name, REVERSED_SUFFIX);
+                    range = name;
+                    reversed = i == 0;
+                }
+                break;
+            case QUERY_GT:
+            case QUERY_LTE:
+                if (!range)
+                    range = term->name;
+                break;
+            case QUERY_SKIP:
+            case QUERY_NE:
+                break;
+        }
+    }
+    // realtime_multi sorts the results by the first field, which precedes a range
+    // unless the first field is queried by its reversed shadow
+    if (tmpl->count && !reversed && (tmpl->terms[0].op == QUERY_LIKE || tmpl->terms[0].op == QUERY_GT
+                        || tmpl->terms[0].op == QUERY_LTE))
+        range = tmpl->terms[0].name;
+    if (range && !bson_has_field(keys, range) && !BSON_APPEND_INT32(keys, range, 1))
+        return "not enough memory";
+
+    if (bson_count_keys(keys) == (serverid ? 1 : 0))
+        return "no field can use an index";
+    if (bson_count_keys(keys) > INDEX_KEYS_MAX)
+        return "too many fields for an index";
+    return NULL;
+}
+
+/*!
+ * \brief check if keys are a prefix of keys of another index
+ */
+static bool index_keys_prefix(const bson_t *keys, const bson_t *other)
+{
+    bson_iter_t i;
+    bson_iter_t j;
+
+    if (!bson_iter_init(&i, keys) || !bson_iter_init(&j, other))
+        return false;
+    while (bson_iter_next(&i)) {
+        if (!bson_iter_next(&j) || strcmp(bson_iter_key(&i), bson_iter_key(&j)))
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief check if an index is needless or too much for a table
+ * \retval NULL if the index is to be created,
+ * \retval a reason why declined.
+ *
+ * index_lock must be held.
+ */
+static const char *index_decline(const struct index_shape *idx)
+{
+    struct ao2_iterator i;
+    struct index_shape *other;
+    unsigned count = 0;
+    const char *reason = NULL;
+
+    i = ao2_iterator_init(index_shapes, 0);
+    for (; !reason && (other = ao2_iterator_next(&i)); ao2_ref(other, -1)) {
+        if (other->state == INDEX_DECLINED
+        || strcmp(other->database, idx->database) || strcmp(other->table, idx->table))
+            continue;
+        if (index_keys_prefix(idx->keys, other->keys))
+            reason = "covered by another index";
+        else if (++count >= INDEX_PER_TABLE)
+            reason = "too many indexes for the table";
+    }
+    ao2_iterator_destroy(&i);
+    return reason;
+}
+
+/*!
+ * \brief kind of a pattern of LIKE, which needs an index of its own
+ */
+static const char *index_like_kind(const char *value)
+{
+    size_t len = strlen(value);
+
+    if (!len || !strcmp(value, "%"))
+        return "any";
+    if (*value != '%')
+        return "prefix";
+    return value[len - 1] == '%' ? "infix" : "suffix";
+}
+
+/*!
+ * \brief observe a shape of queries, and make an index for it in background if needed
+ * \param database
+ * \param table
+ * \param fields    is a list containing one or more field/operator/value set.
+ */
+static void index_observe(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_str *buf;
+    struct query_template *tmpl;
+    struct index_shape *idx;
+    const struct ast_variable *field;
+    const char *reason;
+    char *name;
+    char *p;
+
+    if (!auto_index || !index_shapes || !fields || !(buf = ast_str_thread_get(&index_shape_buf, 128)))
+        return;
+    // the shape of the query with the kind of each pattern of LIKE
+    ast_str_set(&buf, 0, "%s\x1e%s", database, table);
+    for (field = fields; field; field = field->next) {
+        const char *op = strrchr(field->name, ' ');
+
+        ast_str_append(&buf, 0, "\x1e%s", field->name);
+        if (op && !strcasecmp(op + 1, "LIKE"))
+            ast_str_append(&buf, 0, " %s", index_like_kind(field->value));
+    }
+    name = ast_strdupa(ast_str_buffer(buf));
+
+    ast_mutex_lock(&index_lock);
+    idx = ao2_find(index_shapes, name, OBJ_SEARCH_KEY);
+    if (idx || ao2_container_count(index_shapes) >= INDEX_SHAPE_MAX) {
+        ast_mutex_unlock(&index_lock);
+        ao2_cleanup(idx);
+        return;
+    }
+    ast_mutex_unlock(&index_lock);
+
+    // the name, then the database, the table and the fields follow in name[]
+    idx = ao2_alloc_options(sizeof(*idx) + (strlen(name) + 2) * 2, index_shape_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!idx || !(idx->keys = bson_new())) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        ao2_cleanup(idx);
+        return;
+    }
+    p = stpcpy(idx->name, name) + 1;
+    idx->database = p;
+    p = stpcpy(p, database) + 1;
+    idx->table = p;
+    p = stpcpy(p, table) + 1;
+    idx->fields = p;
+    strcpy(p, name + strlen(database) + strlen(table) + 2);
+    for (; (p = strchr(p, '\x1e')); )
+        *p = ',';
+
+    tmpl = query_template_get(fields, table);
+    reason = tmpl ? index_keys(tmpl, fields, idx->keys) : "not supported query";
+    ao2_cleanup(tmpl);
+
+    ast_mutex_lock(&index_lock);
+    if (!ao2_find(index_shapes, name, OBJ_SEARCH_KEY | OBJ_NODATA)) {
+        if (!reason)
+            reason = index_decline(idx);
+        idx->state = reason ? INDEX_DECLINED : INDEX_PENDING;
+        idx->reason = reason ? ast_strdup(reason) : NULL;
+        ao2_link(index_shapes, idx);
+        if (reason)
+            ast_log(LOG_NOTICE, "declined to index database=%s, table=%s for fields %s, %s\n",
+                    database, table, idx->fields, reason);
+        else
+            ast_cond_signal(&index_cond);
+    }
+    ast_mutex_unlock(&index_lock);
+    ao2_ref(idx, -1);
+}
+
+/*!
+ * \brief observe a query by a key field of update and destroy
+ */
+static void index_observe_key(const char *database, const char *table, const char *keyfield, const char *lookup)
+{
+    struct ast_variable *field;
+
+    if (!auto_index)
+        return;
+    field = ast_variable_new(keyfield, lookup, "");
+    if (field) {
+        index_observe(database, table, field);
+        ast_variables_destroy(field);
+    }
+}
+
+static int index_pending(void *obj, void *arg, int flags)
+{
+    const struct index_shape *idx = obj;
+    return idx->state == INDEX_PENDING ? CMP_MATCH | CMP_STOP : 0;
+}
+
+/*!
+ * \brief create an index
+ */
+static void index_create(mongoc_client_t *dbclient, struct index_shape *idx)
+{
+    mongoc_collection_t *collection = NULL;
+    bson_t *cmd = NULL;
+    bson_t reply;
+    bson_error_t error;
+    char *index_name = mongoc_collection_keys_to_index_string(idx->keys);
+    bool created = false;
+
+    do {
+        if (!index_name) {
+            snprintf(error.message, sizeof(error.message), "not enough memory");
+            break;
+        }
+        cmd = BCON_NEW(
+            "createIndexes", BCON_UTF8(idx->table),
+            "indexes", "[", "{",
+                "key", BCON_DOCUMENT(idx->keys),
+                "name", BCON_UTF8(index_name),
+            "}", "]"
+        );
+        collection = mongoc_client_get_collection(dbclient, idx->database, idx->table);
+        created = mongoc_collection_write_command_with_opts(collection, cmd, NULL, &reply, &error);
+        bson_destroy(&reply);
+    } while (0);
+
+    ast_mutex_lock(&index_lock);
+    idx->state = created ? INDEX_CREATED : INDEX_FAILED;
+    if (!created)
+        idx->reason = ast_strdup(error.message);
+    ast_mutex_unlock(&index_lock);
+    if (created)
+        ast_log(LOG_NOTICE, "index %s created, database=%s, table=%s\n", index_name, idx->database, idx->table);
+    else
+        ast_log(LOG_WARNING, "cannot create index %s, database=%s, table=%s, error=%s\n",
+                S_OR(index_name, ""), idx->database, idx->table, error.message);
+
+    if (collection)
+        mongoc_collection_destroy(collection);
+    if (cmd)
+        bson_destroy(cmd);
+    bson_free(index_name);
+}
+
+static void *index_thread(void *data)
+{
+    mongoc_client_t *dbclient;
+
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if (!dbclient) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return NULL;
+    }
+    ast_log(LOG_DEBUG, "indexer started.\n");
+
+    for (;;) {
+        struct index_shape *idx = NULL;
+
+        ast_mutex_lock(&index_lock);
+        while (!index_stopping && !(idx = ao2_callback(index_shapes, 0, index_pending, NULL)))
+            ast_cond_wait(&index_cond, &index_lock);
+        ast_mutex_unlock(&index_lock);
+        if (index_stopping) {
+            ao2_cleanup(idx);
+            break;
+        }
+        index_create(dbclient, idx);
+        ao2_ref(idx, -1);
+    }
+
+    mongoc_client_pool_push(dbpool, dbclient);
+    ast_log(LOG_DEBUG, "indexer stopped.\n");
+    return NULL;
+}
+
+static int index_start(void)
+{
+    if (!auto_index || !dbpool || index_thread_id != AST_PTHREADT_NULL)
+        return 0;
+    index_stopping = false;
+    if (ast_pthread_create_background(&index_thread_id, NULL, index_thread, NULL)) {
+        ast_log(LOG_ERROR, "cannot start the indexer thread\n");
+        index_thread_id = AST_PTHREADT_NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void index_stop(void)
+{
+    if (index_thread_id == AST_PTHREADT_NULL)
+        return;
+    ast_mutex_lock(&index_lock);
+    index_stopping = true;
+    ast_cond_signal(&index_cond);
+    ast_mutex_unlock(&index_lock);
+    pthread_join(index_thread_id, NULL);
+    index_thread_id = AST_PTHREADT_NULL;
+}
+
+static int index_init(void)
+{
+    if (index_shapes)
+        return 0;
+    index_shapes = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, CACHE_BUCKETS,
+                                            index_shape_hash, NULL, index_shape_cmp);
+    if (!index_shapes) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return -1;
+    }
+    ast_cond_init(&index_cond, NULL);
+    return 0;
+}
+
+static void index_destroy(void)
+{
+    if (!index_shapes)
+        return;
+    index_stop();
+    ast_cond_destroy(&index_cond);
+    ao2_ref(index_shapes, -1);
+    index_shapes = NULL;
+}
+
+static char *handle_cli_show_indexes(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    struct ao2_iterator i;
+    struct index_shape *idx;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "mongodb show indexes";
+            e->usage =
+                "Usage: mongodb show indexes\n"
+                "       Show indexes made by auto_index for shapes of realtime queries,\n"
+                "       and the shapes declined to be indexed with the reasons.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+    if (!auto_index)
+        ast_cli(a->fd, "auto_index is disabled.\n");
+
+    ast_mutex_lock(&index_lock);
+    i = ao2_iterator_init(index_shapes, 0);
+    for (; (idx = ao2_iterator_next(&i)); ao2_ref(idx, -1)) {
+        char *keys = bson_as_json(idx->keys, NULL);
+
+        ast_cli(a->fd, "%-8s %s.%s %s\n", index_state_names[idx->state],
+                idx->database, idx->table, S_OR(keys, ""));
+        ast_cli(a->fd, "         fields: %s\n", idx->fields);
+        if (idx->reason)
+            ast_cli(a->fd, "         reason: %s\n", idx->reason);
+        bson_free(keys);
+    }
+    ao2_iterator_destroy(&i);
+    ast_cli(a->fd, "%d shapes\n", ao2_container_count(index_shapes));
+    ast_mutex_unlock(&index_lock);
+    return CLI_SUCCESS;
+}
+
+/*!
+ * \brief a histogram of latencies in microseconds
+ *
+ * Each power of two is split into HISTOGRAM_SUB_BUCKETS buckets, so that any quantile
+ * is within 1/HISTOGRAM_SUB_BUCKETS of the true value. It's updated with atomic
+ * operations only, so it can be shared by threads without any lock.
+ */
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static unsigned histogram_bucket(uint64_t us)
+{
+    unsigned exp;
+
+    if (us < HISTOGRAM_SUB_BUCKETS)
+        return us;
+    exp = 63 - __builtin_clzll(us);     // HISTOGRAM_SUB_BUCKETS <= 2^exp <= us
+    if (exp >= HISTOGRAM_EXP_MAX)
+        return HISTOGRAM_BUCKETS - 1;
+    return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + ((us >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/*!
+ * \brief the middle of the values in a bucket
+ */
+static uint64_t histogram_value(unsigned bucket)
+{
+    unsigned shift;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    return (((uint64_t)HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift)
+        + ((1ULL << shift) >> 1);
+}
+
+static void histogram_add(struct histogram *h, int64_t us)
+{
+    uint64_t value = us > 0 ? us : 0;
+
+    __atomic_fetch_add(&h->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t histogram_count(const struct histogram *h)
+{
+    return __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+}
+
+static uint64_t histogram_mean(const struct histogram *h)
+{
+    uint64_t count = histogram_count(h);
+    return count ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count : 0;
+}
+
+/*!
+ * \brief get a quantile
+ * \param h
+ * \param q     is in [0, 1], e.g. 0.99
+ */
+static uint64_t histogram_quantile(const struct histogram *h, double q)
+{
+    uint64_t count = histogram_count(h);
+    uint64_t rank = (uint64_t)(q * count + 0.5);
+    uint64_t seen = 0;
+    unsigned i;
+
+    if (!count)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= rank)
+            return histogram_value(i);
+    }
+    return histogram_value(HISTOGRAM_BUCKETS - 1);
+}
+
+static void histogram_reset(struct histogram *h)
+{
+    unsigned i;
+
+    __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        __atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief statistics of a shape of queries
+ */
+struct query_stats {
+    struct histogram latency;   /*!< from find to the last document fetched */
+    uint64_t docs;              /*!< documents returned, atomic */
+    bson_t *sample;             /*!< a filter of the shape to explain, protected by the object lock */
+    char *plan;                 /*!< summary of the winning plan, protected by the object lock */
+    bool collscan;              /*!< the winning plan has a collection scan */
+    struct timeval explained;   /*!< when plan is made */
+    const char *database;       /*!< points into name[] */
+    const char *table;          /*!< points into name[] */
+    const char *fields;         /*!< comma separated fields of the query, points into name[] */
+    const char *sort;           /*!< the field to sort results, "" if not sorted, points into name[] */
+    char name[0];               /*!< database, shape of the query and sort separated by \x1e */
+};
+
+static struct ao2_container *query_stats = NULL;
+
+static void query_stats_destructor(void *obj)
+{
+    struct query_stats *stats = obj;
+    if (stats->sample)
+        bson_destroy(stats->sample);
+    ast_free(stats->plan);
+}
+
+static int query_stats_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct query_stats *)obj)->name;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int query_stats_cmp(void *obj, void *arg, int flags)
+{
+    const struct query_stats *stats = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct query_stats *)arg)->name;
+            break;
+        default:
+            return 0;
+    }
+    return strcmp(stats->name, key) ? 0 : CMP_MATCH;
+}
+
+/*!
+ * \brief make statistics of a shape of queries
+ * \retval a new object, not linked yet,
+ * \retval NULL if something wrong.
+ */
+static struct query_stats *query_stats_new(const char *name, const char *database, const char *table,
+                                           const char *shape, const char *sort, const bson_t *query)
+{
+    struct query_stats *stats;
+    char *p;
+
+    // the name, then the database, the table, the fields and the sort follow in name[]
+    stats = ao2_alloc(sizeof(*stats) + (strlen(name) + 2) * 2, query_stats_destructor);
+    if (!stats || !(stats->sample = bson_copy(query))) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        ao2_cleanup(stats);
+        return NULL;
+    }
+    p = stpcpy(stats->name, name) + 1;
+    stats->database = p;
+    p = stpcpy(p, database) + 1;
+    stats->table = p;
+    p = stpcpy(p, table) + 1;
+    stats->fields = p;
+    p = stpcpy(p, shape + strlen(table) + (*(shape + strlen(table)) ? 1 : 0)) + 1;
+    stats->sort = p;
+    strcpy(p, sort);
+    for (p = (char *)stats->fields; (p = strchr(p, '\x1e')); )
+        *p = ',';
+    return stats;
+}
+
+/*!
+ * \brief add a query to the statistics of the shape
+ * \param database
+ * \param table
+ * \param fields    is a list containing one or more field/operator/value set.
+ * \param sort      is the field to sort results, or NULL
+ * \param query     is the filter made from the fields
+ * \param us        is latency of the query in microseconds
+ * \param docs      is number of documents returned
+ */
+static void query_stats_add(const char *database, const char *table, const struct ast_variable *fields,
+                            const char *sort, const bson_t *query, int64_t us, unsigned docs)
+{
+    struct query_stats *stats;
+    const char *shape;
+    char *name;
+
+    if (!query_stats || !(shape = query_shape(table, fields)))
+        return;
+    sort = S_OR(sort, "");
+    name = ast_alloca(strlen(database) + strlen(shape) + strlen(sort) + 3);
+    sprintf(name, "%s\x1e%s\x1e%s", database, shape, sort);
+
+    stats = ao2_find(query_stats, name, OBJ_SEARCH_KEY);
+    if (!stats && ao2_container_count(query_stats) < QUERY_STATS_MAX) {
+        ao2_lock(query_stats);
+        stats = ao2_find(query_stats, name, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+        if (!stats && (stats = query_stats_new(name, database, table, shape, sort, query)))
+            ao2_link_flags(query_stats, stats, OBJ_NOLOCK);
+        ao2_unlock(query_stats);
+    }
+    if (!stats)
+        return;
+    histogram_add(&stats->latency, us);
+    __atomic_fetch_add(&stats->docs, docs, __ATOMIC_RELAXED);
+    ao2_ref(stats, -1);
+}
+
+/*!
+ * \brief find a stage of a plan recursively
+ * \retval true if found.
+ */
+static bool plan_has_stage(const bson_t *plan, const char *stage)
+{
+    bson_iter_t iter;
+
+    if (!bson_iter_init(&iter, plan))
+        return false;
+    while (bson_iter_next(&iter)) {
+        if (BSON_ITER_HOLDS_UTF8(&iter) && !strcmp(bson_iter_key(&iter), "stage")
+        && !strcmp(bson_iter_utf8(&iter, NULL), stage))
+            return true;
+        if (BSON_ITER_HOLDS_DOCUMENT(&iter) || BSON_ITER_HOLDS_ARRAY(&iter)) {
+            const uint8_t *data;
+            uint32_t len;
+            bson_t child;
+
+            bson_iter_document(&iter, &len, &data);
+            if (BSON_ITER_HOLDS_ARRAY(&iter))
+                bson_iter_array(&iter, &len, &data);
+            if (bson_init_static(&child, data, len) && plan_has_stage(&child, stage))
+                return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * \brief explain the sample query of a shape, and keep a summary of the winning plan
+ */
+static void query_stats_explain(mongoc_client_t *dbclient, struct query_stats *stats)
+{
+    mongoc_collection_t *collection;
+    bson_t *cmd = NULL;
+    bson_t find;
+    bson_t reply;
+    bson_error_t error;
+    bson_iter_t iter;
+    bson_iter_t plan_iter;
+    char *plan = NULL;
+    bool collscan = false;
+
+    cmd = bson_new();
+    ao2_lock(stats);
+    if (cmd
+    && BSON_APPEND_DOCUMENT_BEGIN(cmd, "explain", &find)
+    && BSON_APPEND_UTF8(&find, "find", stats->table)
+    && BSON_APPEND_DOCUMENT(&find, "filter", stats->sample)) {
+        if (*stats->sort) {
+            bson_t sort;
+            BSON_APPEND_DOCUMENT_BEGIN(&find, "sort", &sort);
+            BSON_APPEND_INT32(&sort, stats->sort, 1);
+            bson_append_document_end(&find, &sort);
+        }
+        else
+            BSON_APPEND_INT64(&find, "limit", 1);
+        bson_append_document_end(cmd, &find);
+        BSON_APPEND_UTF8(cmd, "verbosity", "queryPlanner");
+    }
+    ao2_unlock(stats);
+    if (!cmd)
+        return;
+
+    collection = mongoc_client_get_collection(dbclient, stats->database, stats->table);
+    if (!mongoc_collection_command_simple(collection, cmd, NULL, &reply, &error)) {
+        ast_log(LOG_WARNING, "explain failed, database=%s, table=%s, error=%s\n",
+                stats->database, stats->table, error.message);
+        plan = ast_strdup("unknown");
+    }
+    else if (bson_iter_init(&iter, &reply)
+    && bson_iter_find_descendant(&iter, "queryPlanner.winningPlan", &plan_iter)
+    && BSON_ITER_HOLDS_DOCUMENT(&plan_iter)) {
+        const uint8_t *data;
+        uint32_t len;
+        bson_t winning;
+
+        bson_iter_document(&plan_iter, &len, &data);
+        if (bson_init_static(&winning, data, len)) {
+            collscan = plan_has_stage(&winning, "COLLSCAN");
+            if (collscan)
+                plan = ast_strdup("COLLSCAN");
+            else if (bson_iter_init(&iter, &winning)
+            && bson_iter_find_descendant(&iter, "inputStage.indexName", &plan_iter)
+            && BSON_ITER_HOLDS_UTF8(&plan_iter))
+                plan = ast_strdup(bson_iter_utf8(&plan_iter, NULL));
+            else if (bson_iter_init_find(&iter, &winning, "stage") && BSON_ITER_HOLDS_UTF8(&iter))
+                plan = ast_strdup(bson_iter_utf8(&iter, NULL));
+        }
+    }
+    bson_destroy(&reply);
+    mongoc_collection_destroy(collection);
+    bson_destroy(cmd);
+
+    ao2_lock(stats);
+    ast_free(stats->plan);
+    stats->plan = plan ? plan : ast_strdup("unknown");
+    stats->collscan = collscan;
+    stats->explained = ast_tvnow();
+    ao2_unlock(stats);
+}
+
+static int query_stats_compare(const void *lhs, const void *rhs)
+{
+    const struct query_stats *l = *(const struct query_stats **)lhs;
+    const struct query_stats *r = *(const struct query_stats **)rhs;
+    uint64_t l_sum = __atomic_load_n(&l->latency.sum, __ATOMIC_RELAXED);
+    uint64_t r_sum = __atomic_load_n(&r->latency.sum, __ATOMIC_RELAXED);
+
+    return l_sum < r_sum ? 1 : l_sum > r_sum ? -1 : 0;
+}
+
+static int query_stats_init(void)
+{
+    if (query_stats)
+        return 0;
+    query_stats = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, CACHE_BUCKETS,
+                                           query_stats_hash, NULL, query_stats_cmp);
+    if (!query_stats) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void query_stats_destroy(void)
+{
+    ao2_cleanup(query_stats);
+    query_stats = NULL;
+}
+
+static char *handle_cli_show_queries(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    struct query_stats **sorted;
+    struct query_stats *stats;
+    struct ao2_iterator i;
+    mongoc_client_t *dbclient = NULL;
+    size_t count = 0;
+    size_t n;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "mongodb show queries";
+            e->usage =
+                "Usage: mongodb show queries\n"
+                "       Show statistics of shapes of realtime queries, ordered by total time.\n"
+                "       The top shapes are explained, and COLLSCAN is flagged with '!'\n"
+                "       for shapes doing a collection scan.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+
+    n = ao2_container_count(query_stats);
+    sorted = ast_calloc(n ? n : 1, sizeof(*sorted));
+    if (!sorted)
+        return CLI_FAILURE;
+    i = ao2_iterator_init(query_stats, 0);
+    while (count < n && (stats = ao2_iterator_next(&i)))
+        sorted[count++] = stats;
+    ao2_iterator_destroy(&i);
+    qsort(sorted, count, sizeof(*sorted), query_stats_compare);
+
+    ast_cli(a->fd, "  %10s %10s %10s %10s %-24s %s\n", "Calls", "Mean(us)", "P99(us)", "Docs/call", "Plan", "Query");
+    for (n = 0; n < count; n++) {
+        uint64_t calls;
+        char plan[25];
+
+        stats = sorted[n];
+        if (n < EXPLAIN_TOP && dbpool) {
+            struct timeval explained;
+
+            ao2_lock(stats);
+            explained = stats->explained;
+            ao2_unlock(stats);
+            if (ast_tvzero(explained) || ast_tvdiff_ms(ast_tvnow(), explained) > EXPLAIN_TTL_SEC * 1000) {
+                if (!dbclient)
+                    dbclient = mongoc_client_pool_pop(dbpool);
+                if (dbclient)
+                    query_stats_explain(dbclient, stats);
+            }
+        }
+        calls = histogram_count(&stats->latency);
+        ao2_lock(stats);
+        snprintf(plan, sizeof(plan), "%s", S_OR(stats->plan, "-"));
+        ast_cli(a->fd, "%c %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %-24s %s.%s %s%s%s\n",
+                stats->collscan ? '!' : ' ',
+                calls,
+                histogram_mean(&stats->latency),
+                histogram_quantile(&stats->latency, 0.99),
+                calls ? __atomic_load_n(&stats->docs, __ATOMIC_RELAXED) / calls : 0,
+                plan,
+                stats->database, stats->table, stats->fields,
+                *stats->sort ? " sort " : "", stats->sort);
+        ao2_unlock(stats);
+        ao2_ref(stats, -1);
+    }
+    ast_cli(a->fd, "%zu shapes\n", count);
+    if (dbclient)
+        mongoc_client_pool_push(dbpool, dbclient);
+    ast_free(sorted);
+    return CLI_SUCCESS;
+}
+
+/*!
+ * \brief callbacks of the engine measured
+ */
+enum op_kind {
+    OP_LOAD,
+    OP_REALTIME,
+    OP_REALTIME_MULTI,
+    OP_STORE,
+    OP_UPDATE,
+    OP_UPDATE2,
+    OP_DESTROY,
+    OP_COUNT,
+};
+
+static const char *op_names[] = {
+    [OP_LOAD] = "load",
+    [OP_REALTIME] = "realtime",
+    [OP_REALTIME_MULTI] = "realtime_multi",
+    [OP_STORE] = "store",
+    [OP_UPDATE] = "update",
+    [OP_UPDATE2] = "update2",
+    [OP_DESTROY] = "destroy",
+};
+
+/*!
+ * \brief phases of a callback
+ */
+enum op_phase {
+    PHASE_POOL,                 /*!< waiting for a client of the pool */
+    PHASE_SERVER,               /*!< waiting for the server */
+    PHASE_CONVERT,              /*!< converting between ast_variable and bson */
+    PHASE_COUNT,
+};
+
+static const char *phase_names[] = {
+    [PHASE_POOL] = "pool",
+    [PHASE_SERVER] = "server",
+    [PHASE_CONVERT] = "conversion",
+};
+
+/*!
+ * \brief latencies of callbacks for a table
+ */
+struct op_stats {
+    struct histogram latency[OP_COUNT][PHASE_COUNT];
+    const char *table;          /*!< points into name[] */
+    char name[0];               /*!< database and table separated by \x1e */
+};
+
+/*!
+ * \brief times spent in phases of a callback
+ */
+struct op_timer {
+    struct timeval last;
+    int64_t us[PHASE_COUNT];
+    const bson_t *filter;       /*!< filter of the operation to be logged if slow, or NULL */
+    const bson_t *data;         /*!< document or update of the operation to be logged if slow, or NULL */
+    unsigned docs;              /*!< documents returned or written */
+};
+
+static struct ao2_container *op_stats = NULL;
+
+static int op_stats_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct op_stats *)obj)->name;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int op_stats_cmp(void *obj, void *arg, int flags)
+{
+    const struct op_stats *stats = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct op_stats *)arg)->name;
+            break;
+        default:
+            return 0;
+    }
+    return strcmp(stats->name, key) ? 0 : CMP_MATCH;
+}
+
+static void op_timer_start(struct op_timer *timer)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->last = ast_tvnow();
+}
+
+/*!
+ * \brief add the time since the last lap to a phase
+ */
+static void op_timer_lap(struct op_timer *timer, enum op_phase phase)
+{
+    struct timeval now = ast_tvnow();
+
+    timer->us[phase] += ast_tvdiff_us(now, timer->last);
+    timer->last = now;
+}
+
+/*!
+ * \brief add the times of a callback to the histograms of the table,
+ *        and log the callback if slower than slow_query_ms.
+ */
+static void op_timer_end(struct op_timer *timer, const char *database, const char *table, enum op_kind op)
+{
+    struct op_stats *stats;
+    char *name;
+    int phase;
+    int64_t total = timer->us[PHASE_POOL] + timer->us[PHASE_SERVER] + timer->us[PHASE_CONVERT];
+
+    if (slow_query_ms && total >= (int64_t)slow_query_ms * 1000) {
+        char timing[128];
+
+        snprintf(timing, sizeof(timing), "pool=%lldus, server=%lldus, conversion=%lldus",
+                 (long long)timer->us[PHASE_POOL], (long long)timer->us[PHASE_SERVER],
+                 (long long)timer->us[PHASE_CONVERT]);
+        ast_mongo_slow_query(NAME, op_names[op], database, table, timer->filter, timer->data,
+                             timer->docs, total, timing);
+    }
+    if (!op_stats)
+        return;
+    name = ast_alloca(strlen(database) + strlen(table) + 2);
+    sprintf(name, "%s\x1e%s", database, table);
+
+    stats = ao2_find(op_stats, name, OBJ_SEARCH_KEY);
+    if (!stats && ao2_container_count(op_stats) < OP_STATS_MAX) {
+        ao2_wrlock(op_stats);
+        stats = ao2_find(op_stats, name, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+        if (!stats && (stats = ao2_alloc_options(sizeof(*stats) + strlen(name) + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+            strcpy(stats->name, name);
+            stats->table = stats->name + strlen(database) + 1;
+            ao2_link_flags(op_stats, stats, OBJ_NOLOCK);
+        }
+        ao2_unlock(op_stats);
+    }
+    if (!stats)
+        return;
+    for (phase = 0; phase < PHASE_COUNT; phase++)
+        histogram_add(&stats->latency[op][phase], timer->us[phase]);
+    ao2_ref(stats, -1);
+}
+
+static int op_stats_reset(void *obj, void *arg, int flags)
+{
+    struct op_stats *stats = obj;
+    int op;
+    int phase;
+
+    for (op = 0; op < OP_COUNT; op++) {
+        for (phase = 0; phase < PHASE_COUNT; phase++)
+            histogram_reset(&stats->latency[op][phase]);
+    }
+    return 0;
+}
+
+static int op_stats_init(void)
+{
+    if (op_stats)
+        return 0;
+    op_stats = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, TABLE_BUCKETS,
+                                        op_stats_hash, NULL, op_stats_cmp);
+    if (!op_stats) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void op_stats_destroy(void)
+{
+    ao2_cleanup(op_stats);
+    op_stats = NULL;
+}
+
+static char *handle_cli_show_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    struct ao2_iterator i;
+    struct op_stats *stats;
+    int op;
+    int phase;
+
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "mongodb show latency";
+            e->usage =
+                "Usage: mongodb show latency\n"
+                "       Show latencies of callbacks of the realtime configuration engine\n"
+                "       per table, split into waiting for a client of the pool,\n"
+                "       waiting for the server and converting data, in microseconds.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+
+    ast_cli(a->fd, "%-32s %-14s %-10s %10s %10s %10s %10s %10s\n",
+            "Collection", "Operation", "Phase", "Count", "Mean", "P50", "P99", "P99.9");
+    i = ao2_iterator_init(op_stats, 0);
+    for (; (stats = ao2_iterator_next(&i)); ao2_ref(stats, -1)) {
+        for (op = 0; op < OP_COUNT; op++) {
+            for (phase = 0; phase < PHASE_COUNT; phase++) {
+                const struct histogram *h = &stats->latency[op][phase];
+
+                if (!histogram_count(h))
+                    continue;
+                ast_cli(a->fd, "%.*s.%-*s %-14s %-10s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                        (int)(stats->table - stats->name - 1), stats->name,
+                        (int)(32 - (stats->table - stats->name)), stats->table,
+                        op_names[op], phase_names[phase], histogram_count(h), histogram_mean(h),
+                        histogram_quantile(h, 0.5), histogram_quantile(h, 0.99), histogram_quantile(h, 0.999));
+            }
+        }
+    }
+    ao2_iterator_destroy(&i);
+    return CLI_SUCCESS;
+}
+
+static char *handle_cli_reset_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd) {
+        case CLI_INIT:
+            e->command = "mongodb reset latency";
+            e->usage =
+                "Usage: mongodb reset latency\n"
+                "       Reset latencies shown by 'mongodb show latency'.\n";
+            return NULL;
+        case CLI_GENERATE:
+            return NULL;
+    }
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+    ao2_callback(op_stats, OBJ_NODATA | OBJ_MULTIPLE, op_stats_reset, NULL);
+    ast_cli(a->fd, "latencies reset.\n");
+    return CLI_SUCCESS;
+}
+
+static int manager_latency(struct mansession *s, const struct message *m)
+{
+    const char *id = astman_get_header(m, "ActionID");
+    const char *reset = astman_get_header(m, "Reset");
+    char idtext[256] = "";
+    struct ao2_iterator i;
+    struct op_stats *stats;
+    int count = 0;
+    int op;
+    int phase;
+
+    if (!ast_strlen_zero(id))
+        snprintf(idtext, sizeof(idtext), "ActionID: %s\r\n", id);
+    astman_send_listack(s, m, "Latencies will follow", "start");
+
+    i = ao2_iterator_init(op_stats, 0);
+    for (; (stats = ao2_iterator_next(&i)); ao2_ref(stats, -1)) {
+        for (op = 0; op < OP_COUNT; op++) {
+            for (phase = 0; phase < PHASE_COUNT; phase++) {
+                const struct histogram *h = &stats->latency[op][phase];
+
+                if (!histogram_count(h))
+                    continue;
+                astman_append(s,
+                    "Event: MongoDBLatency\r\n"
+                    "%s"
+                    "Database: %.*s\r\n"
+                    "Table: %s\r\n"
+                    "Operation: %s\r\n"
+                    "Phase: %s\r\n"
+                    "Count: %" PRIu64 "\r\n"
+                    "Mean: %" PRIu64 "\r\n"
+                    "P50: %" PRIu64 "\r\n"
+                    "P99: %" PRIu64 "\r\n"
+                    "P999: %" PRIu64 "\r\n"
+                    "\r\n",
+                    idtext,
+                    (int)(stats->table - stats->name - 1), stats->name, stats->table,
+                    op_names[op], phase_names[phase], histogram_count(h), histogram_mean(h),
+                    histogram_quantile(h, 0.5), histogram_quantile(h, 0.99), histogram_quantile(h, 0.999));
+                count++;
+            }
+        }
+        if (ast_true(reset))
+            op_stats_reset(stats, NULL, 0);
+    }
+    ao2_iterator_destroy(&i);
+
+    astman_send_list_complete_start(s, m, "MongoDBLatencyComplete", count);
+    astman_send_list_complete_end(s);
+    return 0;
+}
+
+static struct ast_cli_entry cli_realtime_mongodb[] = {
+    AST_CLI_DEFINE(handle_cli_show_indexes, "Show indexes made for shapes of realtime queries"),
+    AST_CLI_DEFINE(handle_cli_show_queries, "Show statistics of shapes of realtime queries"),
+    AST_CLI_DEFINE(handle_cli_show_latency, "Show latencies of the realtime configuration engine"),
+    AST_CLI_DEFINE(handle_cli_reset_latency, "Reset latencies of the realtime configuration engine"),
+    AST_CLI_DEFINE(handle_cli_set_trace, "Enable or disable the trace of a table"),
+    AST_CLI_DEFINE(handle_cli_show_trace, "Show the recent traces of tables"),
+};
+
+/*!
+ * \brief kinds of writes queued
+ */
+enum write_kind {
+    WRITE_INSERT,
+    WRITE_UPDATE,
+};
+
+/*!
+ * \brief a write queued for a table in write-behind mode
+ *
+ * All the members are protected by write_lock.
+ */
+struct write_op {
+    AST_LIST_ENTRY(write_op) list;
+    enum write_kind kind;
+    bool flushing;              /*!< being written by the writer, not to be coalesced any more */
+    bool utf8_lookup;           /*!< values of lookup are queried as strings, as update() does */
+    bson_oid_t oid;             /*!< _id of the document inserted */
+    struct ast_variable *lookup;/*!< fields to select documents updated, owned, NULL for an insert */
+    struct ast_variable *fields;/*!< values inserted or set, owned */
+    bson_t *query;              /*!< query of the update, made by the writer */
+    bson_t *data;               /*!< document inserted or values set, made by the writer */
+    int index;                  /*!< index in the bulk operation, -1 if not appended */
+};
+
+/*!
+ * \brief writes queued for a table, oldest first
+ *
+ * Queues are kept until the module is unloaded, and new ones are inserted
+ * at the head, so that the writer can walk the list from its head without the lock.
+ */
+struct write_queue {
+    AST_LIST_ENTRY(write_queue) list;
+    AST_LIST_HEAD_NOLOCK(, write_op) ops;
+    unsigned count;
+    const char *table;          /*!< points into database[] */
+    char database[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(write_queues, write_queue);
+static unsigned write_pending = 0;
+static pthread_t write_thread_id = AST_PTHREADT_NULL;
+static ast_cond_t write_cond;       /*!< signaled when writes are queued */
+static ast_cond_t write_drained;    /*!< broadcast when writes are flushed */
+static bool write_urgent = false;
+static bool write_stopping = false;
+
+static void write_op_free(struct write_op *op)
+{
+    ast_variables_destroy(op->lookup);
+    ast_variables_destroy(op->fields);
+    if (op->query)
+        bson_destroy(op->query);
+    if (op->data)
+        bson_destroy(op->data);
+    ast_free(op);
+}
+
+/*!
+ * \brief check if writes of a table are queued to be written behind
+ */
+static bool write_behind_of(const char *table)
+{
+    struct table_config *tc = table_config_get(table);
+    bool write_behind = tc && tc->write_behind;
+
+    ao2_cleanup(tc);
+    return write_behind;
+}
+
+/*!
+ * \brief find the queue of a table, called with write_lock held
+ * \param create    is true to make it unless found
+ */
+static struct write_queue *write_queue_find(const char *database, const char *table, bool create)
+{
+    struct write_queue *queue;
+    size_t database_len = strlen(database) + 1;
+
+    AST_LIST_TRAVERSE(&write_queues, queue, list) {
+        if (!strcmp(queue->database, database) && !strcmp(queue->table, table))
+            return queue;
+    }
+    if (!create || !(queue = ast_calloc(1, sizeof(*queue) + database_len + strlen(table) + 1)))
+        return NULL;
+    memcpy(queue->database, database, database_len);
+    queue->table = queue->database + database_len;
+    strcpy((char *)queue->table, table);
+    AST_LIST_INSERT_HEAD(&write_queues, queue, list);
+    return queue;
+}
+
+/*!
+ * \brief check if two key-value lists have the same names
+ */
+static bool same_names(const struct ast_variable *a, const struct ast_variable *b)
+{
+    const struct ast_variable *var;
+    int count = 0;
+
+    for (var = a; var; var = var->next, count++) {
+        if (!find_value(b, var->name))
+            return false;
+    }
+    for (var = b; var; var = var->next)
+        count--;
+    return count == 0;
+}
+
+/*!
+ * \brief queue a write of a table
+ *
+ * An update is coalesced into the latest update with the same lookup, so that
+ * the last value set wins, unless an insert or an update which may select
+ * the same documents by other fields is queued after it.
+ * It waits for the writer while write_behind_max writes are pending.
+ *
+ * \param lookup        is fields to select documents updated, or NULL to insert fields.
+ * \param utf8_lookup   is true to query the values of lookup as strings.
+ * \retval true if queued,
+ * \retval false if the writer is not running or something wrong.
+ */
+static bool write_enqueue(const char *database, const char *table,
+                          const struct ast_variable *lookup, bool utf8_lookup, const struct ast_variable *fields)
+{
+    struct write_queue *queue;
+    struct write_op *op;
+    struct write_op *found = NULL;
+    bool queued = false;
+
+    ast_mutex_lock(&write_lock);
+    do {
+        while (write_thread_id != AST_PTHREADT_NULL && !write_stopping && write_pending >= write_behind_max) {
+            write_urgent = true;
+            ast_cond_signal(&write_cond);
+            ast_cond_wait(&write_drained, &write_lock);
+        }
+        if (write_thread_id == AST_PTHREADT_NULL || write_stopping)
+            break;
+        queue = write_queue_find(database, table, true);
+        if (!queue) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        AST_LIST_TRAVERSE(&queue->ops, op, list) {
+            if (!lookup || op->kind == WRITE_INSERT || op->flushing)
+                found = NULL;
+            else if (op->utf8_lookup == utf8_lookup && match_values(op->lookup, lookup) && match_values(lookup, op->lookup))
+                found = op;
+            else if (!same_names(op->lookup, lookup))
+                found = NULL;
+        }
+        if (found) {
+            struct ast_variable *merged = merge_values(found->fields, fields);
+            if (!merged) {
+                ast_log(LOG_ERROR, "not enough memory\n");
+                break;
+            }
+            ast_variables_destroy(found->fields);
+            found->fields = merged;
+            queued = true;
+            break;
+        }
+
+        op = ast_calloc(1, sizeof(*op));
+        if (!op) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        op->kind = lookup ? WRITE_UPDATE : WRITE_INSERT;
+        op->utf8_lookup = utf8_lookup;
+        bson_oid_init(&op->oid, NULL);
+        op->lookup = ast_variables_dup((struct ast_variable *)lookup);
+        op->fields = ast_variables_dup((struct ast_variable *)fields);
+        if (!op->fields || (lookup && !op->lookup)) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            write_op_free(op);
+            break;
+        }
+        AST_LIST_INSERT_TAIL(&queue->ops, op, list);
+        queue->count++;
+        if (++write_pending >= write_behind_max)
+            write_urgent = true;
+        if (write_pending == 1 || write_urgent)
+            ast_cond_signal(&write_cond);
+        queued = true;
+    } while(0);
+    ast_mutex_unlock(&write_lock);
+    return queued;
+}
+
+/*!
+ * \brief wait for the queued writes of a table to be written
+ */
+static void write_sync(const char *database, const char *table)
+{
+    struct write_queue *queue;
+
+    ast_mutex_lock(&write_lock);
+    while (write_thread_id != AST_PTHREADT_NULL && !write_stopping
+    &&     (queue = write_queue_find(database, table, false)) && queue->count) {
+        write_urgent = true;
+        ast_cond_signal(&write_cond);
+        ast_cond_wait(&write_drained, &write_lock);
+    }
+    ast_mutex_unlock(&write_lock);
+}
+
+/*!
+ * \brief apply the queued updates to a key-value list of a document
+ * \param op    is the first write to be applied, called with write_lock held
+ */
+static void write_overlay_values(const struct write_op *op, struct ast_variable **vars)
+{
+    for (; op; op = AST_LIST_NEXT(op, list)) {
+        struct ast_variable *merged;
+
+        if (op->kind != WRITE_UPDATE || !match_values(*vars, op->lookup))
+            continue;
+        if ((merged = merge_values(*vars, op->fields))) {
+            ast_variables_destroy(*vars);
+            *vars = merged;
+        }
+    }
+}
+
+/*!
+ * \brief make a key-value list of a document queued to be inserted,
+ *        with the updates queued after it applied, called with write_lock held
+ */
+static struct ast_variable *write_inserted(const struct write_op *op)
+{
+    struct ast_variable *vars;
+    char oid[25];
+
+    bson_oid_to_string(&op->oid, oid);
+    vars = ast_variable_new("_id", oid, "");
+    if (!vars)
+        return NULL;
+    vars->next = ast_variables_dup(op->fields);
+    write_overlay_values(AST_LIST_NEXT(op, list), &vars);
+    return vars;
+}
+
+/*!
+ * \brief apply the queued writes of a table to a result of realtime()
+ *
+ * A document found is updated by the updates queued, or a document queued
+ * to be inserted is answered if nothing is found.
+ */
+static void write_overlay(const char *database, const char *table, const struct ast_variable *fields, struct ast_variable **var)
+{
+    struct write_queue *queue;
+    const struct write_op *op;
+
+    ast_mutex_lock(&write_lock);
+    if ((queue = write_queue_find(database, table, false))) {
+        if (*var)
+            write_overlay_values(AST_LIST_FIRST(&queue->ops), var);
+        else {
+            AST_LIST_TRAVERSE(&queue->ops, op, list) {
+                struct ast_variable *vars;
+
+                if (op->kind != WRITE_INSERT || !(vars = write_inserted(op)))
+                    continue;
+                if (match_fields(vars, fields)) {
+                    *var = vars;
+                    break;
+                }
+                ast_variables_destroy(vars);
+            }
+        }
+    }
+    ast_mutex_unlock(&write_lock);
+}
+
+/*!
+ * \brief check if a result of realtime_multi() has a document of an _id
+ */
+static bool write_found(struct ast_config *cfg, const char *oid)
+{
+    struct ast_category *cat = NULL;
+
+    while ((cat = ast_category_browse_filtered(cfg, NULL, cat, NULL))) {
+        const char *id = find_value(ast_category_first(cat), "_id");
+
+        if (id && !strcmp(id, oid))
+            return true;
+    }
+    return false;
+}
+
+/*!
+ * \brief apply the queued writes of a table to a result of realtime_multi()
+ *
+ * The documents queued to be inserted are inserted in order of initfield
+ * unless found already, since the writer may have written them while the
+ * result was being found, and then the rows over the limit are dropped.
+ */
+static void write_overlay_multi(const char *database, const char *table, const struct ast_variable *fields,
+                                const char *initfield, struct ast_config *cfg)
+{
+    struct write_queue *queue;
+    const struct write_op *op;
+    struct ast_category *cat = NULL;
+    unsigned limit = max_rows_of(table);
+
+    ast_mutex_lock(&write_lock);
+    if ((queue = write_queue_find(database, table, false))) {
+        while ((cat = ast_category_browse_filtered(cfg, NULL, cat, NULL))) {
+            AST_LIST_TRAVERSE(&queue->ops, op, list) {
+                const struct ast_variable *set;
+
+                if (op->kind != WRITE_UPDATE || !match_values(ast_category_first(cat), op->lookup))
+                    continue;
+                for (set = op->fields; set; set = set->next) {
+                    if (ast_variable_update(cat, set->name, set->value, NULL, 0))
+                        ast_variable_append(cat, ast_variable_new(set->name, set->value, ""));
+                    if (!strcmp(initfield, set->name))
+                        ast_category_rename(cat, set->value);
+                }
+            }
+        }
+        AST_LIST_TRAVERSE(&queue->ops, op, list) {
+            struct ast_variable *vars;
+            struct ast_category *next = NULL;
+            const char *name;
+
+            if (op->kind != WRITE_INSERT || !(vars = write_inserted(op)))
+                continue;
+            if (!match_fields(vars, fields) || write_found(cfg, vars->value)
+            ||  !(cat = ast_category_new("", "", 99999))) {
+                ast_variables_destroy(vars);
+                continue;
+            }
+            name = S_OR(find_value(vars, initfield), "");
+            ast_category_rename(cat, name);
+            ast_variable_append(cat, vars);
+            // sorted by initfield as realtime_multi_find() does
+            while ((next = ast_category_browse_filtered(cfg, NULL, next, NULL))
+            &&     strcmp(ast_category_get_name(next), name) <= 0)
+                ;
+            if (next)
+                ast_category_insert(cfg, cat, ast_category_get_name(next));
+            else
+                ast_category_append(cfg, cat);
+        }
+    }
+    ast_mutex_unlock(&write_lock);
+
+    if (limit) {
+        unsigned rows = 0;
+
+        cat = NULL;
+        while ((cat = ast_category_browse_filtered(cfg, NULL, cat, NULL)) && ++rows <= limit)
+            ;
+        if (cat)
+            ast_log(LOG_WARNING, "more than %u rows found, database=%s, table=%s\n", limit, database, table);
+        while (cat)
+            cat = ast_category_delete(cfg, cat);
+    }
+}
+
+/*!
+ * \brief make the documents of a write and append it to a bulk operation
+ */
+static bool write_op_append(const char *table, struct write_op *op, struct write_batch *batch, bool upsert)
+{
+    bson_t *update;
+    const struct ast_variable *var;
+    bool appended;
+
+    if (op->kind == WRITE_INSERT) {
+        op->data = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        if (!op->data
+        ||  !BSON_APPEND_OID(op->data, "_id", &op->oid)
+        ||  !fields2doc(table, op->fields, op->data))
+            return false;
+        return write_batch_insert(batch, op->data);
+    }
+
+    op->query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+    if (!op->query)
+        return false;
+    if (op->utf8_lookup) {
+        for (var = op->lookup; var; var = var->next) {
+            if (!BSON_APPEND_UTF8(op->query, key_asterisk2mongo(var->name), var->value))
+                return false;
+        }
+    }
+    else if (!fields2doc(table, op->lookup, op->query))
+        return false;
+    op->data = bson_new();
+    if (!op->data || !fields2doc(table, op->fields, op->data))
+        return false;
+    update = BCON_NEW("$set", BCON_DOCUMENT(op->data));
+    if (!update)
+        return false;
+    appended = write_batch_update(batch, op->query, update, upsert);
+    bson_destroy(update);
+    return appended;
+}
+
+/*!
+ * \brief write the queued writes of a table in an ordered bulk operation
+ *
+ * The writes stay in the queue for the overlay while they are written.
+ * If the server reports the first write failed, it is logged and dropped,
+ * and the writes after it, which an ordered bulk operation does not execute,
+ * are queued again. If the failure is not reported per write, e.g. a network
+ * error, all the writes are queued again. Only writes which cannot be made
+ * are dropped for good. On any failure the cache and snapshot of the table
+ * are refreshed, as the writes applied before it are unknown to them.
+ *
+ * \retval true if writes are queued again to be retried.
+ */
+static bool write_flush(mongoc_client_t *dbclient, struct write_queue *queue)
+{
+    AST_LIST_HEAD_NOLOCK(, write_op) done = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+    AST_LIST_HEAD_NOLOCK(, write_op) retry = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+    mongoc_collection_t *collection;
+    struct write_batch batch;
+    struct write_op *op;
+    unsigned count = 0;
+    unsigned requeued = 0;
+    bool upsert = upsert_of(queue->table);
+    bool started;
+    bool written;
+    bool failed;
+
+    ast_mutex_lock(&write_lock);
+    if (!queue->count) {
+        ast_mutex_unlock(&write_lock);
+        return false;
+    }
+    collection = mongoc_client_get_collection(dbclient, queue->database, queue->table);
+    started = write_batch_init(&batch, collection, queue->table);
+    AST_LIST_TRAVERSE(&queue->ops, op, list) {
+        // -1 only for a write which cannot be made, all are retried if not started
+        op->index = batch.count;
+        if (started && !write_op_append(queue->table, op, &batch, upsert)) {
+            ast_log(LOG_ERROR, "cannot make a write, database=%s, table=%s\n", queue->database, queue->table);
+            op->index = -1;
+        }
+        op->flushing = true;
+        count++;
+    }
+    ast_mutex_unlock(&write_lock);
+
+    written = started && write_batch_execute(&batch) >= 0;
+    failed = !started || (!written && batch.count);
+
+    ast_mutex_lock(&write_lock);
+    for (; count; count--) {
+        op = AST_LIST_REMOVE_HEAD(&queue->ops, list);
+        if (failed && op->index >= 0 && (batch.failed < 0 || op->index > batch.failed)) {
+            // not executed or unknown, to be made again for the next bulk operation
+            if (op->query)
+                bson_destroy(op->query);
+            if (op->data)
+                bson_destroy(op->data);
+            op->query = op->data = NULL;
+            op->flushing = false;
+            AST_LIST_INSERT_TAIL(&retry, op, list);
+            requeued++;
+            continue;
+        }
+        AST_LIST_INSERT_TAIL(&done, op, list);
+        queue->count--;
+        write_pending--;
+    }
+    // back at the head, ahead of the writes queued meanwhile
+    AST_LIST_APPEND_LIST(&retry, &queue->ops, list);
+    AST_LIST_APPEND_LIST(&queue->ops, &retry, list);
+    ast_cond_broadcast(&write_drained);
+    ast_mutex_unlock(&write_lock);
+
+    if (failed && batch.failed >= 0)
+        ast_log(LOG_ERROR, "write behind failed at write %d, database=%s, table=%s, %u writes queued again\n",
+                batch.failed, queue->database, queue->table, requeued);
+    else if (failed)
+        ast_log(LOG_ERROR, "write behind failed, database=%s, table=%s, %u writes queued again\n",
+                queue->database, queue->table, requeued);
+    while ((op = AST_LIST_REMOVE_HEAD(&done, list))) {
+        if (failed && batch.failed >= 0 && op->index == batch.failed && op->data)
+            LOG_BSON_AS_JSON(LOG_ERROR, "write dropped=%s\n", op->data);
+        if (written && snapshot_count && op->data) {
+            if (op->kind == WRITE_INSERT)
+                snapshot_store(queue->database, queue->table, op->data);
+            else if (op->query)
+                snapshot_update(queue->database, queue->table, op->query, op->data);
+        }
+        write_op_free(op);
+    }
+    cache_purge(queue->database, queue->table);
+    if (failed)
+        snapshot_reload(queue->database, queue->table);
+    mongoc_collection_destroy(collection);
+    return requeued > 0;
+}
+
+static void *write_thread(void *data)
+{
+    bool stopping = false;
+    bool retry = false;
+
+    ast_log(LOG_DEBUG, "writer started.\n");
+    while (!stopping) {
+        struct write_queue *queue;
+        mongoc_client_t *dbclient;
+
+        ast_mutex_lock(&write_lock);
+        while (!write_stopping && !write_pending)
+            ast_cond_wait(&write_cond, &write_lock);
+        if (!write_stopping && (retry || !write_urgent)) {
+            // a while for more writes to be coalesced, or a whole one before a retry
+            struct timeval wait = ast_tvadd(ast_tvnow(), ast_samp2tv(write_behind_ms, 1000));
+            struct timespec ts = { .tv_sec = wait.tv_sec, .tv_nsec = wait.tv_usec * 1000 };
+            do {
+                ast_cond_timedwait(&write_cond, &write_lock, &ts);
+            } while (retry && !write_stopping && ast_tvcmp(ast_tvnow(), wait) < 0);
+        }
+        write_urgent = false;
+        stopping = write_stopping;
+        queue = AST_LIST_FIRST(&write_queues);
+        ast_mutex_unlock(&write_lock);
+
+        dbclient = mongoc_client_pool_pop(dbpool);
+        if (!dbclient) {
+            ast_log(LOG_ERROR, "no client allocated\n");
+            retry = true;
+            continue;
+        }
+        for (retry = false; queue; queue = AST_LIST_NEXT(queue, list))
+            retry |= write_flush(dbclient, queue);
+        mongoc_client_pool_push(dbpool, dbclient);
+    }
+    ast_log(LOG_DEBUG, "writer stopped.\n");
+    return NULL;
+}
+
+static int table_config_write_behind(void *obj, void *arg, int flags)
+{
+    const struct table_config *tc = obj;
+    return tc->write_behind ? CMP_MATCH | CMP_STOP : 0;
+}
+
+/*!
+ * \brief start the writer if any table is written behind or any write is queued
+ *
+ * Once started, it runs until unload, so that the writes queued are written
+ * even if a reload turns write_behind off.
+ */
+static int write_start(void)
+{
+    struct ao2_container *tables;
+    struct table_config *tc = NULL;
+
+    if (!dbpool || write_thread_id != AST_PTHREADT_NULL)
+        return 0;
+    if ((tables = ao2_global_obj_ref(table_configs))) {
+        tc = ao2_callback(tables, 0, table_config_write_behind, NULL);
+        ao2_ref(tables, -1);
+    }
+    if (!tc && !write_pending)
+        return 0;
+    ao2_cleanup(tc);
+
+    write_stopping = false;
+    if (ast_pthread_create_background(&write_thread_id, NULL, write_thread, NULL)) {
+        ast_log(LOG_ERROR, "cannot start the writer thread\n");
+        write_thread_id = AST_PTHREADT_NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * \brief stop the writer after all the queued writes are written
+ */
+static void write_stop(void)
+{
+    if (write_thread_id == AST_PTHREADT_NULL)
+        return;
+    ast_mutex_lock(&write_lock);
+    write_stopping = true;
+    ast_cond_signal(&write_cond);
+    ast_cond_broadcast(&write_drained);
+    ast_mutex_unlock(&write_lock);
+    pthread_join(write_thread_id, NULL);
+    write_thread_id = AST_PTHREADT_NULL;
+}
+
+static void write_init(void)
+{
+    ast_cond_init(&write_cond, NULL);
+    ast_cond_init(&write_drained, NULL);
+}
+
+/*!
+ * \brief stop the writer, write the writes still queued once more, and drop the rest
+ */
+static void write_destroy(void)
+{
+    struct write_queue *queue;
+    struct write_op *op;
+    mongoc_client_t *dbclient;
+
+    write_stop();
+    // failed at the last flush of the writer, or queued while it was not running
+    if (write_pending && dbpool && (dbclient = mongoc_client_pool_pop(dbpool))) {
+        AST_LIST_TRAVERSE(&write_queues, queue, list)
+            write_flush(dbclient, queue);
+        mongoc_client_pool_push(dbpool, dbclient);
+    }
+    while ((queue = AST_LIST_REMOVE_HEAD(&write_queues, list))) {
+        if (queue->count)
+            ast_log(LOG_ERROR, "%u writes dropped at unload, database=%s, table=%s\n",
+                    queue->count, queue->database, queue->table);
+        while ((op = AST_LIST_REMOVE_HEAD(&queue->ops, list)))
+            write_op_free(op);
+        ast_free(queue);
+    }
+    write_pending = 0;
+    ast_cond_destroy(&write_cond);
+    ast_cond_destroy(&write_drained);
+}
+
+/*!
+ * \brief a slot of the ring of documents fetched in background
+ *
+ * The buffer is kept over documents and grows only for a larger one,
+ * so that no allocation is needed per document once it's big enough.
+ */
+struct prefetched {
+    uint8_t *data;
+    size_t size;                /*!< size of data allocated */
+    uint32_t len;               /*!< length of the document in data */
+};
+
+/*!
+ * \brief a cursor iterated by a background thread
+ *
+ * The thread fetches documents, including getMore of later batches,
+ * into a ring of slots allocated for the call, while the caller converts
+ * the documents fetched already.
+ * The cursor must not be touched by the caller until prefetch_stop().
+ */
+struct prefetch {
+    ast_mutex_t lock;
+    ast_cond_t cond;
+    pthread_t thread;
+    mongoc_cursor_t *cursor;
+    struct prefetched *slots;   /*!< ring of max slots */
+    unsigned head;              /*!< slot of the oldest document */
+    unsigned count;             /*!< number of documents in the ring, including one held by the caller */
+    unsigned max;               /*!< max number of documents in the ring */
+    bool held;                  /*!< the caller holds the document of head */
+    bool done;                  /*!< no more document */
+    bool stopping;              /*!< the caller doesn't need any more document */
+    bson_t doc;                 /*!< the document held by the caller, pointing into its slot */
+};
+
+static void *prefetch_thread(void *data)
+{
+    struct prefetch *pf = data;
+    const bson_t *doc;
+
+    while (!pf->stopping && mongoc_cursor_next(pf->cursor, &doc)) {
+        struct prefetched *slot;
+
+        ast_mutex_lock(&pf->lock);
+        while (pf->count >= pf->max && !pf->stopping)
+            ast_cond_wait(&pf->cond, &pf->lock);
+        // the caller never touches the tail
+        slot = &pf->slots[(pf->head + pf->count) % pf->max];
+        ast_mutex_unlock(&pf->lock);
+        if (pf->stopping)
+            break;
+
+        if (slot->size < doc->len) {
+            size_t size = MAX(doc->len, 512);
+            uint8_t *grown = ast_realloc(slot->data, size);
+            if (!grown) {
+                ast_log(LOG_ERROR, "not enough memory\n");
+                break;
+            }
+            slot->data = grown;
+            slot->size = size;
+        }
+        memcpy(slot->data, bson_get_data(doc), doc->len);
+        slot->len = doc->len;
+
+        ast_mutex_lock(&pf->lock);
+        pf->count++;
+        ast_cond_signal(&pf->cond);
+        ast_mutex_unlock(&pf->lock);
+    }
+    ast_mutex_lock(&pf->lock);
+    pf->done = true;
+    ast_cond_signal(&pf->cond);
+    ast_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/*!
+ * \brief start fetching documents in background
+ * \param pf        is initialized by this.
+ * \param cursor
+ * \param max       is max number of documents in the ring, e.g. a batch.
+ * \retval 0 if started.
+ */
+static int prefetch_start(struct prefetch *pf, mongoc_cursor_t *cursor, unsigned max)
+{
+    memset(pf, 0, sizeof(*pf));
+    pf->cursor = cursor;
+    pf->max = max ? max : PREFETCH_QUEUE;
+    pf->slots = ast_calloc(pf->max, sizeof(*pf->slots));
+    if (!pf->slots)
+        return -1;
+    ast_mutex_init(&pf->lock);
+    ast_cond_init(&pf->cond, NULL);
+    if (ast_pthread_create(&pf->thread, NULL, prefetch_thread, pf)) {
+        ast_log(LOG_WARNING, "cannot start a prefetch thread\n");
+        ast_cond_destroy(&pf->cond);
+        ast_mutex_destroy(&pf->lock);
+        ast_free(pf->slots);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * \brief get the next document fetched
+ * \retval a document valid until the next call or prefetch_stop(),
+ * \retval NULL if no more document.
+ */
+static const bson_t *prefetch_next(struct prefetch *pf)
+{
+    const struct prefetched *slot = NULL;
+
+    ast_mutex_lock(&pf->lock);
+    if (pf->held) {
+        pf->head = (pf->head + 1) % pf->max;
+        pf->count--;
+        pf->held = false;
+        ast_cond_signal(&pf->cond);
+    }
+    while (!pf->count && !pf->done)
+        ast_cond_wait(&pf->cond, &pf->lock);
+    if (pf->count) {
+        slot = &pf->slots[pf->head];
+        pf->held = true;
+    }
+    ast_mutex_unlock(&pf->lock);
+
+    if (!slot || !bson_init_static(&pf->doc, slot->data, slot->len))
+        return NULL;
+    return &pf->doc;
+}
+
+/*!
+ * \brief stop fetching documents, and give the cursor back to the caller.
+ */
+static void prefetch_stop(struct prefetch *pf)
+{
+    unsigned i;
+
+    ast_mutex_lock(&pf->lock);
+    pf->stopping = true;
+    ast_cond_signal(&pf->cond);
+    ast_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+
+    for (i = 0; i < pf->max; i++)
+        ast_free(pf->slots[i].data);
+    ast_free(pf->slots);
+    ast_cond_destroy(&pf->cond);
+    ast_mutex_destroy(&pf->lock);
+}
+
+/*!
+ *  Make a category from a document
+ *
+ *  \param[in]  doc
+ *  \param[in]  table       is name of collection of the document
+ *  \param[in]  tc          is options of the table, or NULL if none
+ *  \param[in]  initfield   is name of field to be name of the category
+ *  \retval  a category,
+ *  \retval  NULL if something wrong.
+*/
+static struct ast_category *doc2category(const bson_t *doc, const char *table,
+                                         const struct table_config *tc, const char *initfield)
+{
+    const struct schema *schema = schema_get(table);
+    struct ast_category *cat;
+    bson_iter_t iter;
+    const char* key;
+    const char* value;
+    char work[DOC_VALUE_WORK];
+
+    if (!bson_iter_init(&iter, doc)) {
+        ast_log(LOG_ERROR, "unexpected bson error!\n");
+        return NULL;
+    }
+    cat = ast_category_new("", "", 99999);
+    if (!cat) {
+        ast_log(LOG_WARNING, "out of memory!\n");
+        return NULL;
+    }
+    while (bson_iter_next(&iter)) {
+        if (!(value = doc2value(&iter, &key, work, schema, tc)))
+            continue;
+        if (!strcmp(initfield, key))
+            ast_category_rename(cat, value);
+        ast_variable_append(cat, ast_variable_new(key, value, ""));
+    }
+    return cat;
+}
+
+/*!
+ * \brief Execute an SQL query and return ast_variable list
+ * \param database  is name of database
+ * \param table     is name of collection to find specified records
+ * \param ap list containing one or more field/operator/value set.
+ *
+ * Select database and perform query on table, prepare the sql statement
+ * Sub-in the values to the prepared statement and execute it. Return results
+ * as a ast_variable list.
+ *
+ * \retval var on success
+ * \retval NULL on failure
+ *
+ * \see http://api.mongodb.org/c/current/finding-document.html
+*/
+static struct ast_variable *realtime_find(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_variable *var = NULL;
+    mongoc_client_t *dbclient;
+    mongoc_collection_t *collection = NULL;
+    mongoc_cursor_t *cursor = NULL;
+    const bson_t *doc = NULL;
+    bson_t *query = NULL;
+    bson_t *opts = NULL;
+    char *key = NULL;
+    char *cached_key = NULL;
+    unsigned generation = 0;
+    struct flight *flight = NULL;
+    bool leader;
+    struct op_timer timer;
+
+    if (!database || !table || !fields) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return NULL;
+    }
+    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+
+    if (snapshot_count && snapshot_realtime(database, table, fields, &var)) {
+        ast_log(LOG_DEBUG, "snapshot of database=%s, table=%s, %s.\n", database, table, var ? "found" : "not found");
+        return var;
+    }
+
+    key = (char *)cache_key(database, table, fields);
+    if (key)
+        key = ast_strdupa(key);
+    if (cache_ttl || negative_cache_ttl) {
+        if (key && cache_get(database, table, key, &var)) {
+            ast_log(LOG_DEBUG, "cache hit, database=%s, table=%s, %s.\n", database, table, var ? "found" : "not found");
+            return var;
+        }
+        cached_key = key;
+        generation = cache_generation(database, table);
+        watch_register(database, table);
+    }
+
+    // identical queries in flight are waited for instead of being sent again
+    if (key && (flight = flight_join(FLIGHT_REALTIME, key, &leader)) && !leader) {
+        flight_wait(flight, &var, NULL);
+        ast_log(LOG_DEBUG, "coalesced, database=%s, table=%s, %s.\n", database, table, var ? "found" : "not found");
+        return var;
+    }
+
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "no connection pool\n");
+        if (flight)
+            flight_land(flight, NULL, NULL);
+        return NULL;
+    }
+
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        if (flight)
+            flight_land(flight, NULL, NULL);
+        return NULL;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
+
+    do {
+        bson_error_t error;
+        struct timeval start;
+        bool found;
+
+        query = make_query(fields, table);
+        if(query == NULL) {
+            ast_log(LOG_ERROR, "cannot make a query to find\n");
+            break;
+        }
+        index_observe(database, table, fields);
+        opts = BCON_NEW("limit", BCON_INT64(1));
+        if (!opts || !append_find_opts(opts, table, fields, NULL)) {
+            ast_log(LOG_ERROR, "cannot make options to find\n");
+            break;
+        }
+        TRACE_BSON(table, "query=%s, database=%s, table=%s\n", query, database, table);
+
+        collection = mongoc_client_get_collection(dbclient, database, table);
+        op_timer_lap(&timer, PHASE_CONVERT);
+        start = ast_tvnow();
+        cursor = collection_find(collection, table, query, opts);
+        if (!cursor) {
+            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s, database=%s, table=%s\n", query, database, table);
+            break;
+        }
+        found = mongoc_cursor_next(cursor, &doc);
+        op_timer_lap(&timer, PHASE_SERVER);
+        timer.filter = query;
+        timer.docs = found ? 1 : 0;
+        query_stats_add(database, table, fields, NULL, query, ast_tvdiff_us(ast_tvnow(), start), found ? 1 : 0);
+        if (found) {
+            struct table_config *tc = table_config_get(table);
+
+            TRACE_BSON(table, "query found %s\n", doc);
+
+            var = doc2variables(doc, table, tc);
+            ao2_cleanup(tc);
+            op_timer_lap(&timer, PHASE_CONVERT);
+            if (var && cached_key)
+                cache_put(database, table, cached_key, fields, var, generation);
+        }
+        else if (mongoc_cursor_error(cursor, &error)) {
+            ast_log(LOG_ERROR, "query failed, database=%s, table=%s, %s\n", database, table, error.message);
+        }
+        else if (cached_key) {
+            // not found
+            cache_put(database, table, cached_key, fields, NULL, generation);
+        }
+    } while(0);
+    op_timer_end(&timer, database, table, OP_REALTIME);
+
+    if (doc)
+        bson_destroy((bson_t *)doc);
+    if (query)
+        bson_destroy((bson_t *)query);
+    if (opts)
+        bson_destroy(opts);
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    mongoc_client_pool_push(dbpool, dbclient);
+    if (flight)
+        flight_land(flight, var, NULL);
+    return var;
+}
+
+/*!
+ * \brief Execute an Select query and return ast_config list
+ * \param database  is name of database
+ * \param table     is name of collection to find specified records
+ * \param fields    is a list containing one or more field/operator/value set.
+ *
+ * Select database and preform query on table, prepare the sql statement
+ * Sub-in the values to the prepared statement and execute it.
+ * Execute this prepared query against MongoDB.
+ * Return results as an ast_config variable.
+ *
+ * \retval var on success
+ * \retval NULL on failure
+ *
+ * \see http://api.mongodb.org/c/current/finding-document.html
+*/
+static struct ast_config* realtime_multi_find(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_config *cfg = NULL;
+    struct ast_category *cat = NULL;
+    struct table_config *tc;
+    mongoc_collection_t *collection = NULL;
+    mongoc_cursor_t* cursor = NULL;
+    mongoc_client_t* dbclient = NULL;
+    const bson_t* doc = NULL;
+    const bson_t* query = NULL;
+    bson_t *opts = NULL;
+    const char *initfield;
+    char *op;
+    const char *key;
+    struct flight *flight = NULL;
+    bool leader;
+    struct op_timer timer;
+    unsigned limit = max_rows;
+    bool prefetch = false;
+
+    if (!database || !table || !fields) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return NULL;
+    }
+    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+
+    // kept until the end to convert the documents found
+    if ((tc = table_config_get(table))) {
+        limit = tc->max_rows;
+        prefetch = tc->prefetch;
+    }
+    initfield = ast_strdupa(fields->name);
+    if ((op = strchr(initfield, ' '))) {
+        *op = '\0';
+    }
+    if (snapshot_count && snapshot_realtime_multi(database, table, fields, initfield, limit, &cfg)) {
+        ao2_cleanup(tc);
+        return cfg;
+    }
+
+    key = cache_key(database, table, fields);
+    if (key && (flight = flight_join(FLIGHT_REALTIME_MULTI, key, &leader)) && !leader) {
+        flight_wait(flight, NULL, &cfg);
+        ast_log(LOG_DEBUG, "coalesced, database=%s, table=%s.\n", database, table);
+        ao2_cleanup(tc);
+        return cfg;
+    }
+
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "no connection pool\n");
+        if (flight)
+            flight_land(flight, NULL, NULL);
+        ao2_cleanup(tc);
+        return NULL;
+    }
+
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        if (flight)
+            flight_land(flight, NULL, NULL);
+        ao2_cleanup(tc);
+        return NULL;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
+    do {
+        bson_error_t error;
+        struct prefetch pf;
+        struct timeval start;
+        unsigned rows = 0;
+        bool truncated = false;
+
+        query = make_query(fields, table);
+        if(query == NULL) {
+            ast_log(LOG_ERROR, "cannot make a query to find\n");
+            break;
+        }
+        index_observe(database, table, fields);
+        opts = BCON_NEW("sort", "{", key_asterisk2mongo(initfield), BCON_INT32(1), "}");
+        // one more row to know if truncated
+        if (opts && limit && !BSON_APPEND_INT64(opts, "limit", (int64_t)limit + 1)) {
+            bson_destroy(opts);
+            opts = NULL;
+        }
+        if (!opts || !append_find_opts(opts, table, fields, key_asterisk2mongo(initfield))) {
+            ast_log(LOG_ERROR, "cannot make options to find\n");
+            break;
+        }
+
+        cfg = ast_config_new();
+        if (!cfg) {
+            ast_log(LOG_WARNING, "out of memory!\n");
+            break;
+        }
+
+        collection = mongoc_client_get_collection(dbclient, database, table);
+
+        TRACE_BSON(table, "query=%s, database=%s, table=%s\n", query, database, table);
+
+        op_timer_lap(&timer, PHASE_CONVERT);
+        start = ast_tvnow();
+        cursor = collection_find(collection, table, query, opts);
+        if (!cursor) {
+            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s, database=%s, table=%s\n", query, database, table);
+            break;
+        }
+
+        if (prefetch && !prefetch_start(&pf, cursor, batch_size_of(table))) {
+            const bson_t *fetched;
+
+            while ((fetched = prefetch_next(&pf))) {
+                op_timer_lap(&timer, PHASE_SERVER);
+                TRACE_BSON(table, "query found %s\n", fetched);
+                if (limit && rows >= limit) {
+                    truncated = true;
+                    break;
+                }
+                cat = doc2category(fetched, table, tc, initfield);
+                op_timer_lap(&timer, PHASE_CONVERT);
+                if (!cat)
+                    break;
+                ast_category_append(cfg, cat);
+                rows++;
+            }
+            prefetch_stop(&pf);
+        }
+        else {
+            while (mongoc_cursor_next(cursor, &doc)) {
+                op_timer_lap(&timer, PHASE_SERVER);
+                TRACE_BSON(table, "query found %s\n", doc);
+                if (limit && rows >= limit) {
+                    truncated = true;
+                    break;
+                }
+                cat = doc2category(doc, table, tc, initfield);
+                op_timer_lap(&timer, PHASE_CONVERT);
+                if (!cat)
+                    break;
+                ast_category_append(cfg, cat);
+                rows++;
+            }
+        }
+        query_stats_add(database, table, fields, key_asterisk2mongo(initfield), query,
+                        ast_tvdiff_us(ast_tvnow(), start), rows);
+        timer.docs = rows;
+        if (truncated)
+            ast_log(LOG_WARNING, "more than %u rows found, database=%s, table=%s\n", limit, database, table);
+        else if (mongoc_cursor_error(cursor, &error))
+            ast_log(LOG_ERROR, "query failed, database=%s, table=%s, %s\n", database, table, error.message);
+    } while(0);
+    timer.filter = query;
+    op_timer_end(&timer, database, table, OP_REALTIME_MULTI);
+    ast_log(LOG_DEBUG, "end of query.\n");
+
+    if (query)
+        bson_destroy((bson_t *)query);
+    if (opts)
+        bson_destroy(opts);
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    mongoc_client_pool_push(dbpool, dbclient);
+    if (flight)
+        flight_land(flight, NULL, cfg);
+    ao2_cleanup(tc);
+    return cfg;
+}
+
+/*!
+ * \brief Execute an Select query with the writes queued applied
+ * \see realtime_find()
+ */
+static struct ast_variable *realtime(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_variable *var = realtime_find(database, table, fields);
+
+    if (write_pending && database && table && fields)
+        write_overlay(database, table, fields, &var);
+    return var;
+}
+
+/*!
+ * \brief Execute an Select query with the writes queued applied
+ * \see realtime_multi_find()
+ */
+static struct ast_config *realtime_multi(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_config *cfg = realtime_multi_find(database, table, fields);
+
+    if (write_pending && cfg && table && fields) {
+        char *initfield = ast_strdupa(fields->name);
+        char *op = strchr(initfield, ' ');
+
+        if (op)
+            *op = '\0';
+        write_overlay_multi(database, table, fields, initfield, cfg);
+    }
+    return cfg;
+}
+
+/*!
+ * \brief Execute an UPDATE query
+ * \param database  is name of database
+ * \param table     is name of collection to update records
+ * \param keyfield  where clause field
+ * \param lookup    value of field for where clause
+ * \param fields    is a list containing one or more field/value set(s).
+ *
+ * Update a database table, prepare the sql statement using keyfield and lookup
+ * control the number of records to change. All values to be changed are stored in ap list.
+ * Sub-in the values to the prepared statement and execute it.
+ *
+ * \retval number of rows affected
+ * \retval -1 on failure
+*/
+static int update(const char *database, const char *table, const char *keyfield, const char *lookup, const struct ast_variable *fields)
+{
+    int ret = -1;
+    bson_t *query = NULL;
+    bson_t *data = NULL;
+    bson_t *update = NULL;
+    mongoc_client_t *dbclient = NULL;
+    mongoc_collection_t *collection = NULL;
+    struct write_batch batch;
+    struct op_timer timer;
+
+    if (!database || !table || !keyfield || !lookup || !fields) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return -1;
+    }
+    ast_log(LOG_DEBUG, "database=%s, table=%s, keyfield=%s, lookup=%s.\n", database, table, keyfield, lookup);
+
+    if (write_behind_of(table)) {
+        struct ast_variable *key = ast_variable_new(keyfield, lookup, "");
+        bool queued = key && write_enqueue(database, table, key, true, fields);
+
+        ast_variables_destroy(key);
+        if (queued) {
+            index_observe_key(database, table, keyfield, lookup);
+            return 1;
+        }
+    }
+    // not to overtake the writes queued, e.g. before write_behind is turned off
+    if (write_pending)
+        write_sync(database, table);
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "no connection pool\n");
+        return -1;
+    }
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return -1;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
+
+    do {
+        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        if (!query) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        if (!BSON_APPEND_UTF8(query, key_asterisk2mongo(keyfield), lookup)) {
+            ast_log(LOG_ERROR, "cannot make a query\n");
+            break;
+        }
+        index_observe_key(database, table, keyfield, lookup);
+
+        data = bson_new();
+        if (!data) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        update = bson_new();
+        if (!update) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        if (!fields2doc(table, fields, data)) {
+            ast_log(LOG_ERROR, "cannot make data to update\n");
+            break;
+        }
+        if (!BSON_APPEND_DOCUMENT(update, "$set", data)) {
+            ast_log(LOG_ERROR,
+                "cannot make data to update, database=%s, table=%s, keyfield=%s, lookup=%s\n",
+                database, table, keyfield, lookup);
+            break;
+        }
+
+        op_timer_lap(&timer, PHASE_CONVERT);
+        collection = mongoc_client_get_collection(dbclient, database, table);
+        if (!write_batch_init(&batch, collection, table))
+            break;
+        write_batch_update(&batch, query, update, upsert_of(table));
+        ret = write_batch_execute(&batch);
+        op_timer_lap(&timer, PHASE_SERVER);
+        if (ret > 0 && snapshot_count)
+            snapshot_update(database, table, query, data);
+    } while(0);
+    timer.filter = query;
+    timer.data = update;
+    timer.docs = ret > 0 ? ret : 0;
+    op_timer_end(&timer, database, table, OP_UPDATE);
+
+    if (data)
+        bson_destroy((bson_t *)data);
+    if (update)
+        bson_destroy((bson_t *)update);
+    if (query)
+        bson_destroy((bson_t *)query);
+    if (collection)
+        mongoc_collection_destroy(collection);
+
+    mongoc_client_pool_push(dbpool, dbclient);
+    if (ret > 0)
+        cache_purge(database, table);
+    return ret;
+}
+
+/*!
+ * \brief Callback for ast_realtime_require
+ * \retval 0 Required fields met specified standards
+ * \retval -1 One or more fields was missing or insufficient
+ */
+static int require(const char *database, const char *table, va_list ap)
+{
+    bson_t *model = bson_new();
+    char *elm;
+
+    if (!database || !table) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return -1;
+    }
+    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+
+    while ((elm = va_arg(ap, char *))) {
+        int type = va_arg(ap, require_type);
+        // int size =
+        va_arg(ap, int);
+        // ast_log(LOG_DEBUG, "elm=%s, type=%d, size=%d\n", elm, type, size);
+        BSON_APPEND_INT32(model, elm, type);
+    }
+    TRACE_BSON(table, "required model is \"%s\"\n", model);
+
+    schema_register(table, model);
+    bson_destroy(model);
+    watch_register(database, table);
+    return 0;
+}
+
+/*!
+ * \brief Execute an UPDATE query
+ * \param database  is name of database
+ * \param table     is name of collection to update records
+ * \param ap list containing one or more field/value set(s).
+ *
+ * Update a database table, preparing the sql statement from a list of
+ * key/value pairs specified in ap.  The lookup pairs are specified first
+ * and are separated from the update pairs by a sentinel value.
+ * Sub-in the values to the prepared statement and execute it.
+ *
+ * \retval number of rows affected
+ * \retval -1 on failure
+*/
+static int update2(const char *database, const char *table, const struct ast_variable *lookup_fields, const struct ast_variable *update_fields)
+{
+    int ret = -1;
+    bson_t *query = NULL;
+    bson_t *data = NULL;
+    bson_t *update = NULL;
+    mongoc_client_t *dbclient = NULL;
+    mongoc_collection_t *collection = NULL;
+    struct write_batch batch;
+    struct op_timer timer;
+
+    if (!database || !table || !lookup_fields || !update_fields) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return -1;
+    }
+    ast_log(LOG_DEBUG, "database=%s, table=%s\n", database, table);
+
+    if (write_behind_of(table) && write_enqueue(database, table, lookup_fields, false, update_fields)) {
+        index_observe(database, table, lookup_fields);
+        return 1;
+    }
+    if (write_pending)
+        write_sync(database, table);
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "no connection pool\n");
+        return -1;
+    }
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return -1;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
+
+    do {
+        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        if (!query) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        if (!fields2doc(table, lookup_fields, query)) {
+            ast_log(LOG_ERROR, "cannot make data to update\n");
+            break;
+        }
+        index_observe(database, table, lookup_fields);
+
+        TRACE_BSON(table, "query=%s\n", query);
+
+        data = bson_new();
+        if (!data) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        if (!fields2doc(table, update_fields, data)) {
+            ast_log(LOG_ERROR, "cannot make data to update\n");
+            break;
+        }
+        update = bson_new();
+        if (!update) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        if (!BSON_APPEND_DOCUMENT(update, "$set", data)) {
+            ast_log(LOG_ERROR, "cannot make data to update, database=%s, table=%s\n",
+                    database, table);
+            break;
+        }
+
+        op_timer_lap(&timer, PHASE_CONVERT);
+        collection = mongoc_client_get_collection(dbclient, database, table);
+        if (!write_batch_init(&batch, collection, table))
+            break;
+        write_batch_update(&batch, query, update, upsert_of(table));
+        ret = write_batch_execute(&batch);
+        op_timer_lap(&timer, PHASE_SERVER);
+        if (ret > 0 && snapshot_count)
+            snapshot_update(database, table, query, data);
+    } while(0);
+    timer.filter = query;
+    timer.data = update;
+    timer.docs = ret > 0 ? ret : 0;
+    op_timer_end(&timer, database, table, OP_UPDATE2);
+
+    if (data)
+        bson_destroy((bson_t *)data);
+    if (update)
+        bson_destroy((bson_t *)update);
+    if (query)
+        bson_destroy((bson_t *)query);
+    if (collection)
+        mongoc_collection_destroy(collection);
+
+    mongoc_client_pool_push(dbpool, dbclient);
+    if (ret > 0)
+        cache_purge(database, table);
+    return ret;
+}
+
+/*!
+ * \brief Execute an INSERT query
+ * \param database
+ * \param table
+ * \param ap list containing one or more field/value set(s)
+ *
+ * Insert a new record into database table, prepare the sql statement.
+ * All values to be changed are stored in ap list.
+ * Sub-in the values to the prepared statement and execute it.
+ *
+ * \retval number of rows affected
+ * \retval -1 on failure
+*/
+static int store(const char *database, const char *table, const struct ast_variable *fields)
+{
+    int ret = -1;
+    bson_t *document = NULL;
+    mongoc_client_t *dbclient = NULL;
+    mongoc_collection_t *collection = NULL;
+    struct write_batch batch;
+    struct op_timer timer;
+
+    if (!database || !table || !fields) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return -1;
+    }
+    ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+
+    if (write_behind_of(table) && write_enqueue(database, table, NULL, false, fields))
+        return 1;
+    if (write_pending)
+        write_sync(database, table);
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "no connection pool\n");
+        return -1;
+    }
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return -1;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
+
+    do {
+        bson_oid_t oid;
+
+        document = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        if (!document) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        // _id is given here to write it through to the snapshot
+        bson_oid_init(&oid, NULL);
+        if (!BSON_APPEND_OID(document, "_id", &oid)) {
+            ast_log(LOG_ERROR, "cannot make a document to update\n");
+            break;
+        }
+
+        collection = mongoc_client_get_collection(dbclient, database, table);
+
+        if (!fields2doc(table, fields, document)) {
+            ast_log(LOG_ERROR, "cannot make a document to update\n");
+            break;
+        }
+
+        op_timer_lap(&timer, PHASE_CONVERT);
+        if (!write_batch_init(&batch, collection, table))
+            break;
+        write_batch_insert(&batch, document);
+        if (write_batch_execute(&batch) < 0) {
+            ast_log(LOG_ERROR, "store failed, database=%s, table=%s\n", database, table);
+            break;
+        }
+        op_timer_lap(&timer, PHASE_SERVER);
+        if (snapshot_count)
+            snapshot_store(database, table, document);
+
+        ret = 1; // success
+    } while(0);
+    timer.data = document;
+    timer.docs = ret > 0 ? ret : 0;
+    op_timer_end(&timer, database, table, OP_STORE);
+
+    if (document)
+        bson_destroy((bson_t *)document);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    mongoc_client_pool_push(dbpool, dbclient);
+    if (ret > 0)
+        cache_purge(database, table);
+    return ret;
+}
+
+/*!
+ * \brief Execute an DELETE query
+ * \param database
+ * \param table
+ * \param keyfield where clause field
+ * \param lookup value of field for where clause
+ * \param ap list containing one or more field/value set(s)
+ *
+ * Delete a row from a database table, prepare the sql statement using keyfield and lookup
+ * control the number of records to change. Additional params to match rows are stored in ap list.
+ * Sub-in the values to the prepared statement and execute it.
+ *
+ * \retval number of rows affected
+ * \retval -1 on failure
+*/
+static int destroy(const char *database, const char *table, const char *keyfield, const char *lookup, const struct ast_variable *fields)
+{
+    int ret = -1;
+    bson_t *selector = NULL;
+    mongoc_client_t *dbclient = NULL;
+    mongoc_collection_t *collection = NULL;
+    struct write_batch batch;
+    struct op_timer timer;
+
+    if (!database || !table || !keyfield || !lookup) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return -1;
+    }
+    ast_log(LOG_DEBUG, "database=%s, table=%s, keyfield=%s, lookup=%s.\n", database, table, keyfield, lookup);
+    ast_log(LOG_DEBUG, "fields->name=%s, fields->value=%s.\n", fields?fields->name:"NULL", fields?fields->value:"NULL");
+
+    // not to be overtaken by the writes queued
+    if (write_pending)
+        write_sync(database, table);
+
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "no connection pool\n");
+        return -1;
+    }
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return -1;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
+
+    do {
+        selector = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        if (!selector) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        if (!BSON_APPEND_UTF8(selector, key_asterisk2mongo(keyfield), lookup)) {
+            ast_log(LOG_ERROR, "cannot make a query\n");
+            break;
+        }
+        index_observe_key(database, table, keyfield, lookup);
+
+        op_timer_lap(&timer, PHASE_CONVERT);
+        collection = mongoc_client_get_collection(dbclient, database, table);
+
+        if (!write_batch_init(&batch, collection, table))
+            break;
+        write_batch_remove(&batch, selector);
+        ret = write_batch_execute(&batch);
+        op_timer_lap(&timer, PHASE_SERVER);
+        if (ret < 0) {
+            ast_log(LOG_ERROR, "destroy failed, database=%s, table=%s\n", database, table);
+            break;
+        }
+        if (ret > 0 && snapshot_count)
+            snapshot_destroy(database, table, keyfield, lookup);
+    } while(0);
+    timer.filter = selector;
+    timer.docs = ret > 0 ? ret : 0;
+    op_timer_end(&timer, database, table, OP_DESTROY);
+
+    if (selector)
+        bson_destroy((bson_t *)selector);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    mongoc_client_pool_push(dbpool, dbclient);
+    if (ret > 0)
+        cache_purge(database, table);
+    return ret;
+}
+
+/*!
+ * \brief documents of a static configuration file fetched last,
+ *        replayed by load() while the file is unchanged.
+ *
+ * It's never changed once linked, so it can be replayed without any lock.
+ */
+struct load_entry {
+    bson_t *version;            /*!< made by load_version() before fetched */
+    uint8_t *data;              /*!< documents fetched in order, one after another */
+    size_t len;
+    size_t size;                /*!< allocated for data */
+    unsigned docs;
+    char key[0];                /*!< made by load_key() */
+};
+
+static void load_entry_destructor(void *obj)
+{
+    struct load_entry *entry = obj;
+
+    if (entry->version)
+        bson_destroy(entry->version);
+    ast_free(entry->data);
+}
+
+static int load_entry_hash(const void *obj, const int flags)
+{
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = obj;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct load_entry *)obj)->key;
+            break;
+        default:
+            ast_assert(0);
+            return 0;
+    }
+    return ast_str_hash(key);
+}
+
+static int load_entry_cmp(void *obj, void *arg, int flags)
+{
+    const struct load_entry *entry = obj;
+    const char *key;
+
+    switch (flags & OBJ_SEARCH_MASK) {
+        case OBJ_SEARCH_KEY:
+            key = arg;
+            break;
+        case OBJ_SEARCH_OBJECT:
+            key = ((const struct load_entry *)arg)->key;
+            break;
+        default:
+            return 0;
+    }
+    return strcmp(entry->key, key) ? 0 : CMP_MATCH;
+}
+
+/*!
+ * \brief make a key of a file of a collection
+ * \param buf   is at least as long as the names and 3 bytes more
+ */
+static const char *load_key(char *buf, const char *database, const char *table, const char *file)
+{
+    sprintf(buf, "%s\x1e%s\x1e%s", database, table, file);
+    return buf;
+}
+
+#define LOAD_KEY(database, table, file) \
+    load_key(ast_alloca(strlen(database) + strlen(table) + strlen(file) + 3), database, table, file)
+
+/*!
+ * \brief summarize documents of a file to revalidate the documents fetched before
+ *
+ * It's an aggregate of the number of the documents and the max of load_version_field,
+ * e.g. { _id: null, count: 1234, version: ISODate(...) }, or an empty document if none.
+ *
+ * \retval the summary,
+ * \retval NULL if something wrong.
+ */
+static bson_t *load_version(mongoc_collection_t *collection, const char *table, const bson_t *query)
+{
+    struct table_config *tc = table_config_get(table);
+    bson_t pipeline = BSON_INITIALIZER;
+    bson_t stages;
+    bson_t stage;
+    bson_t group;
+    bson_t op;
+    char field[sizeof(load_version_field) + 1];
+    mongoc_cursor_t *cursor = NULL;
+    const bson_t *doc;
+    bson_error_t error;
+    bson_t *version = NULL;
+
+    if (!tc)
+        tc = table_config_get("");
+    snprintf(field, sizeof(field), "$%s", load_version_field);
+    do {
+        if (!BSON_APPEND_ARRAY_BEGIN(&pipeline, "pipeline", &stages)
+        ||  !BSON_APPEND_DOCUMENT_BEGIN(&stages, "0", &stage)
+        ||  !BSON_APPEND_DOCUMENT(&stage, "$match", query)
+        ||  !bson_append_document_end(&stages, &stage)
+        ||  !BSON_APPEND_DOCUMENT_BEGIN(&stages, "1", &stage)
+        ||  !BSON_APPEND_DOCUMENT_BEGIN(&stage, "$group", &group)
+        ||  !BSON_APPEND_NULL(&group, "_id")
+        ||  !BSON_APPEND_DOCUMENT_BEGIN(&group, "count", &op)
+        ||  !BSON_APPEND_INT32(&op, "$sum", 1)
+        ||  !bson_append_document_end(&group, &op)
+        ||  (*load_version_field
+            && (!BSON_APPEND_DOCUMENT_BEGIN(&group, "version", &op)
+            ||  !BSON_APPEND_UTF8(&op, "$max", field)
+            ||  !bson_append_document_end(&group, &op)))
+        ||  !bson_append_document_end(&stage, &group)
+        ||  !bson_append_document_end(&stages, &stage)
+        ||  !bson_append_array_end(&pipeline, &stages))
+        {
+            ast_log(LOG_ERROR, "unexpected bson error\n");
+            break;
+        }
+        cursor = mongoc_collection_aggregate(collection, MONGOC_QUERY_NONE, &pipeline, NULL,
+                                             tc ? tc->read_prefs : NULL);
+        if (!cursor)
+            break;
+        if (mongoc_cursor_next(cursor, &doc))
+            version = bson_copy(doc);
+        else if (mongoc_cursor_error(cursor, &error))
+            ast_log(LOG_ERROR, "cannot summarize, table=%s, %s\n", table, error.message);
+        else
+            version = bson_new();
+    } while(0);
+
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    bson_destroy(&pipeline);
+    ao2_cleanup(tc);
+    return version;
+}
+
+/*!
+ * \brief make an entry to be appended documents fetched
+ * \param version   is taken by the entry
+ */
+static struct load_entry *load_entry_new(const char *key, bson_t *version)
+{
+    struct load_entry *entry;
+
+    entry = ao2_alloc_options(sizeof(*entry) + strlen(key) + 1, load_entry_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!entry) {
+        bson_destroy(version);
+        return NULL;
+    }
+    strcpy(entry->key, key);
+    entry->version = version;
+    return entry;
+}
+
+static bool load_entry_append(struct load_entry *entry, const bson_t *doc)
+{
+    if (entry->len + doc->len > entry->size) {
+        size_t size = MAX(entry->size * 2, entry->len + doc->len + 4096);
+        uint8_t *data = ast_realloc(entry->data, size);
+
+        if (!data)
+            return false;
+        entry->data = data;
+        entry->size = size;
+    }
+    memcpy(entry->data + entry->len, bson_get_data(doc), doc->len);
+    entry->len += doc->len;
+    entry->docs++;
+    return true;
+}
+
+/*!
+ * \brief keep an entry fetched, replacing the former one of the file.
+ * \param entries   is load_entries or load_staged
+ */
+static void load_entry_put(struct ao2_container *entries, struct load_entry *entry)
+{
+    if (!entries)
+        return;
+    ao2_lock(entries);
+    ao2_find(entries, entry->key, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NODATA | OBJ_NOLOCK);
+    ao2_link_flags(entries, entry, OBJ_NOLOCK);
+    ao2_unlock(entries);
+}
+
+static int load_entry_match(void *obj, void *arg, int flags)
+{
+    const struct load_entry *entry = obj;
+    const char *prefix = arg;
+
+    return strncmp(entry->key, prefix, strlen(prefix)) ? 0 : CMP_MATCH;
+}
+
+static int load_entries_purge(struct ao2_container *entries, const char *database, const char *table)
+{
+    int count;
+
+    if (!entries)
+        return 0;
+    count = ao2_container_count(entries);
+    if (!database || !table) {
+        ao2_callback(entries, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL);
+        return count;
+    }
+    ao2_callback(entries, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, load_entry_match,
+                 (void *)LOAD_KEY(database, table, ""));
+    return count - ao2_container_count(entries);
+}
+
+/*!
+ * \brief forget the files fetched or prefetched of a collection
+ * \param database  is name of database, or NULL for any.
+ * \param table     is name of collection, or NULL for any.
+ * \retval number of files forgotten
+ */
+static int load_cache_purge(const char *database, const char *table)
+{
+    return load_entries_purge(load_entries, database, table) + load_entries_purge(load_staged, database, table);
+}
+
+static int load_cache_init(void)
+{
+    if (load_entries)
+        return 0;
+    load_entries = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, TABLE_BUCKETS,
+                                            load_entry_hash, NULL, load_entry_cmp);
+    load_staged = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, TABLE_BUCKETS,
+                                           load_entry_hash, NULL, load_entry_cmp);
+    if (!load_entries || !load_staged) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void load_cache_destroy(void)
+{
+    ao2_cleanup(load_entries);
+    load_entries = NULL;
+    ao2_cleanup(load_staged);
+    load_staged = NULL;
+}
+
+/*!
+ * \brief make a filter of documents of a static configuration file
+ * \retval NULL if something wrong.
+ */
+static bson_t *load_query(const char *file)
+{
+    bson_t *query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+
+    if (!query)
+        return NULL;
+    if (!BSON_APPEND_UTF8(query, "filename", file)) {
+        ast_log(LOG_ERROR, "unexpected bson error with filename=%s\n", file);
+        bson_destroy(query);
+        return NULL;
+    }
+    if (!BSON_APPEND_DOUBLE(query, "commented", 0)) {
+        ast_log(LOG_ERROR, "unexpected bson error\n");
+        bson_destroy(query);
+        return NULL;
+    }
+    return query;
+}
+
+/*!
+ * \brief make options to find documents of a static configuration file in order
+ * \retval NULL if something wrong.
+ */
+static bson_t *load_opts(const char *table)
+{
+    bson_t *opts = BCON_NEW(    "sort", "{",
+                                    "cat_metric", BCON_DOUBLE(-1),
+                                    "var_metric", BCON_DOUBLE(1),
+                                    "category", BCON_DOUBLE(1),
+                                    "var_name", BCON_DOUBLE(1),
+                                "}",
+                                "projection", "{",
+                                    "cat_metric", BCON_DOUBLE(1),
+                                    "category", BCON_DOUBLE(1),
+                                    "var_name", BCON_DOUBLE(1),
+                                    "var_val", BCON_DOUBLE(1),
+                                "}");
+
+    if (!opts || !append_find_opts(opts, table, NULL, NULL)) {
+        ast_log(LOG_ERROR, "cannot make options to find\n");
+        if (opts)
+            bson_destroy(opts);
+        return NULL;
+    }
+    return opts;
+}
+
+/*!
+ * \brief state of appending documents of static configuration to a config
+ */
+struct load_state {
+    struct ast_config *cfg;
+    struct ast_category *cat;   /*!< appended last, NULL until any */
+    int cat_metric;             /*!< of cat */
+    const char *who_asked;
+};
+
+/*!
+ * \brief append a document of static configuration to a config
+ * \retval false to stop loading.
+ */
+static bool load_doc(struct load_state *state, const bson_t *doc)
+{
+    struct ast_flags loader_flags = { 0 };
+    struct ast_variable *new_v;
+    bson_iter_t iter;
+    const char *var_name;
+    const char *var_val;
+    const char *category;
+    int cat_metric;
+    uint32_t length;
+
+    if (!bson_iter_init(&iter, doc)) {
+        ast_log(LOG_ERROR, "unexpected bson error!\n");
+        return false;
+    }
+
+    if(!bson_iter_find(&iter, "cat_metric")) {
+        ast_log(LOG_ERROR, "no cat_metric found!\n");
+        return false;
+    }
+    cat_metric = (int)bson_iter_double(&iter);
+
+    if(!bson_iter_find(&iter, "category")) {
+        ast_log(LOG_ERROR, "no category found!\n");
+        return false;
+    }
+    category = bson_iter_utf8(&iter, &length);
+    if (!category) {
+        ast_log(LOG_ERROR, "cannot read category.\n");
+        return false;
+    }
+
+    if(!bson_iter_find(&iter, "var_name")) {
+        ast_log(LOG_ERROR, "no var_name found!\n");
+        return false;
+    }
+    var_name = bson_iter_utf8(&iter, &length);
+    if (!var_name) {
+        ast_log(LOG_ERROR, "cannot read var_name.\n");
+        return false;
+    }
+
+    if(!bson_iter_find(&iter, "var_val")) {
+        ast_log(LOG_ERROR, "no var_val found!\n");
+        return false;
+    }
+    var_val = bson_iter_utf8(&iter, &length);
+    if (!var_val) {
+        ast_log(LOG_ERROR, "cannot read var_val.\n");
+        return false;
+    }
+
+    if (!strcmp (var_val, "#include")) {
+        if (!ast_config_internal_load(var_val, state->cfg, loader_flags, "", state->who_asked)) {
+            ast_log(LOG_DEBUG, "ended with who_asked=%s\n", state->who_asked);
+            return false;
+        }
+        ast_log(LOG_DEBUG, "#include ignored, who_asked=%s\n", state->who_asked);
+        return true;
+    }
+
+    if (!state->cat || strcmp(ast_category_get_name(state->cat), category) || state->cat_metric != cat_metric) {
+        state->cat = ast_category_new(category, "", 99999);
+        if (!state->cat) {
+            ast_log(LOG_WARNING, "Out of memory!\n");
+            return false;
+        }
+        state->cat_metric = cat_metric;
+        ast_category_append(state->cfg, state->cat);
+    }
+
+    new_v = ast_variable_new(var_name, var_val, "");
+    ast_variable_append(state->cat, new_v);
+    return true;
+}
+
+/*!
+ * \brief append documents fetched before to a config
+ * \retval false if stopped.
+ */
+static bool load_replay(const struct load_entry *entry, struct load_state *state)
+{
+    bson_reader_t *reader = bson_reader_new_from_data(entry->data, entry->len);
+    const bson_t *doc;
+    bool eof = false;
+    bool ok = true;
+
+    if (!reader)
+        return false;
+    while (ok && (doc = bson_reader_read(reader, &eof)))
+        ok = load_doc(state, doc);
+    bson_reader_destroy(reader);
+    return ok && eof;
+}
+
+/*!
+ * \brief a static configuration file fetched by prefetch_files
+ */
+struct load_prefetch {
+    pthread_t thread;
+    const char *database;
+    const char *table;
+    const char *file;
+    struct load_entry *entry;   /*!< fetched, NULL if failed */
+};
+
+/*!
+ * \brief fetch a static configuration file on a client of its own
+ */
+static void *load_prefetch_thread(void *data)
+{
+    struct load_prefetch *prefetch = data;
+    mongoc_client_t *dbclient;
+    mongoc_collection_t *collection = NULL;
+    mongoc_cursor_t *cursor = NULL;
+    bson_t *query = NULL;
+    bson_t *opts = NULL;
+    bson_t *version;
+    const bson_t *doc;
+    bson_error_t error;
+    struct op_timer timer;
+
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if (!dbclient) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return NULL;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
+    do {
+        if (!(query = load_query(prefetch->file)) || !(opts = load_opts(prefetch->table)))
+            break;
+        collection = mongoc_client_get_collection(dbclient, prefetch->database, prefetch->table);
+        op_timer_lap(&timer, PHASE_CONVERT);
+        // summarized first, so that a change while fetching is fetched again by load_cache
+        if (!(version = load_version(collection, prefetch->table, query)))
+            break;
+        prefetch->entry = load_entry_new(LOAD_KEY(prefetch->database, prefetch->table, prefetch->file), version);
+        if (!prefetch->entry || !(cursor = collection_find(collection, prefetch->table, query, opts)))
+            break;
+        while (prefetch->entry && mongoc_cursor_next(cursor, &doc)) {
+            timer.docs++;
+            if (!load_entry_append(prefetch->entry, doc)) {
+                ast_log(LOG_ERROR, "not enough memory\n");
+                ao2_ref(prefetch->entry, -1);
+                prefetch->entry = NULL;
+            }
+        }
+        op_timer_lap(&timer, PHASE_SERVER);
+        if (mongoc_cursor_error(cursor, &error)) {
+            ast_log(LOG_ERROR, "prefetch failed, database=%s, table=%s, file=%s, %s\n",
+                    prefetch->database, prefetch->table, prefetch->file, error.message);
+            ao2_cleanup(prefetch->entry);
+            prefetch->entry = NULL;
+        }
+    } while(0);
+    timer.filter = query;
+    op_timer_end(&timer, prefetch->database, prefetch->table, OP_LOAD);
+
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    if (opts)
+        bson_destroy(opts);
+    if (query)
+        bson_destroy(query);
+    mongoc_client_pool_push(dbpool, dbclient);
+    return NULL;
+}
+
+/*!
+ * \brief fetch static configuration files concurrently, to be served by load() later.
+ *
+ * Each file is fetched by a thread on a client of the pool, and it returns
+ * when all of them are staged, before Asterisk loads the files one by one.
+ *
+ * \param database  is name of database
+ * \param table     is name of collection of the files
+ * \param files     is a comma separated list of files
+ */
+static void load_prefetch_files(const char *database, const char *table, const char *files)
+{
+    char *list = ast_strdupa(files);
+    struct load_prefetch *prefetches;
+    struct timeval start = ast_tvnow();
+    char *file;
+    int count = 1;
+    int staged = 0;
+    int n = 0;
+    int i;
+
+    for (file = list; *file; file++)
+        count += *file == ',';
+    if (!load_staged || !(prefetches = ast_calloc(count, sizeof(*prefetches))))
+        return;
+    while ((file = strsep(&list, ","))) {
+        struct load_prefetch *prefetch = &prefetches[n];
+
+        file = ast_strip(file);
+        if (ast_strlen_zero(file) || !strcmp(file, CONFIG_FILE))
+            continue;
+        prefetch->database = database;
+        prefetch->table = table;
+        prefetch->file = file;
+        if (ast_pthread_create(&prefetch->thread, NULL, load_prefetch_thread, prefetch)) {
+            ast_log(LOG_WARNING, "cannot start to prefetch %s\n", file);
+            continue;
+        }
+        n++;
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(prefetches[i].thread, NULL);
+        if (prefetches[i].entry) {
+            load_entry_put(load_staged, prefetches[i].entry);
+            ao2_ref(prefetches[i].entry, -1);
+            staged++;
+        }
+    }
+    ast_log(LOG_NOTICE, "%d of %d files prefetched in %lld ms, database=%s, table=%s\n",
+            staged, n, (long long)ast_tvdiff_ms(ast_tvnow(), start), database, table);
+    ast_free(prefetches);
+}
+
+static struct ast_config *load(
+    const char *database, const char *table, const char *file, struct ast_config *cfg, struct ast_flags flags, const char *sugg_incl, const char *who_asked)
+{
+    struct load_state state = { cfg, NULL, -1, who_asked };
+    struct load_entry *entry = NULL;
+    struct load_entry *staged = NULL;
+    struct load_entry *fetched = NULL;
+    mongoc_collection_t *collection = NULL;
+    mongoc_cursor_t* cursor = NULL;
+    mongoc_client_t* dbclient = NULL;
+    bson_t *query = NULL;
+    const bson_t *doc = NULL;
+    bson_t *opts = NULL;
+    struct op_timer timer;
+
+    if (!database || !table || !file || !cfg || !who_asked) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return NULL;
+    }
+    if (!strcmp (file, CONFIG_FILE))
+        return NULL;        /* cant configure myself with myself ! */
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "no connection pool\n");
+        return NULL;
+    }
+
+    op_timer_start(&timer);
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        return NULL;
+    }
+    op_timer_lap(&timer, PHASE_POOL);
 
     do {
         bson_error_t error;
+        bool stopped = false;
+        const char *key;
+        bson_t *version = NULL;
+
+        if (!(query = load_query(file)))
+            break;
+        collection = mongoc_client_get_collection(dbclient, database, table);
+
+        key = LOAD_KEY(database, table, file);
+        staged = load_staged ? ao2_find(load_staged, key, OBJ_SEARCH_KEY | OBJ_UNLINK) : NULL;
+        if (staged || load_cache) {
+            if (load_cache)
+                watch_register(database, table);
+            op_timer_lap(&timer, PHASE_CONVERT);
+            version = load_version(collection, table, query);
+            op_timer_lap(&timer, PHASE_SERVER);
+        }
+        if (staged && version && bson_equal(staged->version, version)) {
+            // fetched by prefetch_files at load of the module, used once if still unchanged
+            ast_log(LOG_DEBUG, "%u documents prefetched, database=%s, table=%s, file=%s\n",
+                    staged->docs, database, table, file);
+            bson_destroy(version);
+            timer.docs = staged->docs;
+            load_replay(staged, &state);
+            op_timer_lap(&timer, PHASE_CONVERT);
+            if (load_cache)
+                load_entry_put(load_entries, staged);
+            break;
+        }
+        if (staged)
+            ast_log(LOG_DEBUG, "changed since prefetched, database=%s, table=%s, file=%s\n", database, table, file);
+        if (load_cache) {
+            entry = version && load_entries ? ao2_find(load_entries, key, OBJ_SEARCH_KEY) : NULL;
+            if (entry && bson_equal(entry->version, version)) {
+                ast_log(LOG_DEBUG, "unchanged, %u documents replayed, database=%s, table=%s, file=%s\n",
+                        entry->docs, database, table, file);
+                TRACE_BSON(table, "unchanged %s\n", version);
+                bson_destroy(version);
+                timer.docs = entry->docs;
+                load_replay(entry, &state);
+                op_timer_lap(&timer, PHASE_CONVERT);
+                break;
+            }
+            if (version)
+                fetched = load_entry_new(key, version);
+        }
+        else if (version)
+            bson_destroy(version);
+
+        if (!(opts = load_opts(table)))
+            break;
+
+        TRACE_BSON(table, "query=%s\n", query);
+        // TRACE_BSON(table, "opts=%s\n", opts);
+
+        op_timer_lap(&timer, PHASE_CONVERT);
+        cursor = collection_find(collection, table, query, opts);
+        if (!cursor) {
+            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s\n", query);
+            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with opts=%s\n", opts);
+            break;
+        }
+
+        while (!stopped && mongoc_cursor_next(cursor, &doc)) {
+            op_timer_lap(&timer, PHASE_SERVER);
+            timer.docs++;
+            TRACE_BSON(table, "query found %s\n", doc);
+
+            if (fetched && !load_entry_append(fetched, doc)) {
+                ao2_ref(fetched, -1);
+                fetched = NULL;
+            }
+            stopped = !load_doc(&state, doc);
+            op_timer_lap(&timer, PHASE_CONVERT);
+        }
+        if (mongoc_cursor_error(cursor, &error)) {
+            ast_log(LOG_ERROR, "query failed, database=%s, table=%s, %s\n", database, table, error.message);
+            stopped = true;
+        }
+        if (fetched && !stopped)
+            load_entry_put(load_entries, fetched);
+    } while(0);
+    timer.filter = query;
+    op_timer_end(&timer, database, table, OP_LOAD);
+
+    ao2_cleanup(entry);
+    ao2_cleanup(staged);
+    ao2_cleanup(fetched);
+    if (query)
+        bson_destroy((bson_t *)query);
+    if (opts)
+        bson_destroy(opts);
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    mongoc_client_pool_push(dbpool, dbclient);
+    return cfg;
+}
+
+/*!
+ * \brief Callback for clearing any cached info
+ * \param database  is name of database
+ * \param table     is name of collection to purge the cached results
+ * \retval 0 If any cache was purged
+ * \retval -1 If no cache was found
+ */
+static int unload(const char *database, const char *table)
+{
+    ast_log(LOG_DEBUG, "database=%s, table=%s\n", database, table);
+    return cache_purge(database, table) > 0 ? 0 : -1;
+}
+
+
+static int config(int reload)
+{
+    int res = -1;
+    struct ast_config *cfg = NULL;
+    struct ao2_container *tables = NULL;
+    mongoc_uri_t *uri = NULL;
+    ast_log(LOG_DEBUG, "reload=%d\n", reload);
+
+    do {
+        const char *tmp;
+        struct ast_variable *var;
+        struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+
+        cfg = ast_config_load(CONFIG_FILE, config_flags);
+        if (!cfg || cfg == CONFIG_STATUS_FILEINVALID) {
+            ast_log(LOG_WARNING, "unable to load %s\n", CONFIG_FILE);
+            res = AST_MODULE_LOAD_DECLINE;
+            break;
+        } else if (cfg == CONFIG_STATUS_FILEUNCHANGED)
+            break;
+
+        var = ast_variable_browse(cfg, CATEGORY);
+        if (!var) {
+            ast_log(LOG_WARNING, "no category %s specified.\n", CATEGORY);
+            break;
+        }
 
-        document = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
-        if (!document) {
-            ast_log(LOG_ERROR, "not enough memory\n");
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "uri")) == NULL) {
+            ast_log(LOG_WARNING, "no uri specified.\n");
+            break;
+        }
+        uri = mongoc_uri_new(tmp);
+        if (uri == NULL) {
+            ast_log(LOG_ERROR, "parsing uri error, %s\n", tmp);
             break;
         }
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "apm"))
+        && (sscanf(tmp, "%u", &apm_enabled) != 1)) {
+           ast_log(LOG_WARNING, "apm must be a 0|1, not '%s'\n", tmp);
+           apm_enabled = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "cache_ttl"))
+        && (sscanf(tmp, "%u", &cache_ttl) != 1)) {
+           ast_log(LOG_WARNING, "cache_ttl must be seconds, not '%s'\n", tmp);
+           cache_ttl = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "negative_cache_ttl"))
+        && (sscanf(tmp, "%u", &negative_cache_ttl) != 1)) {
+           ast_log(LOG_WARNING, "negative_cache_ttl must be seconds, not '%s'\n", tmp);
+           negative_cache_ttl = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "negative_cache_size"))
+        && (sscanf(tmp, "%u", &negative_cache_size) != 1)) {
+           ast_log(LOG_WARNING, "negative_cache_size must be a number of entries, not '%s'\n", tmp);
+           negative_cache_size = 10000;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "cache_watch"))
+        && (sscanf(tmp, "%u", &cache_watch) != 1)) {
+           ast_log(LOG_WARNING, "cache_watch must be a 0|1, not '%s'\n", tmp);
+           cache_watch = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "max_rows"))
+        && (sscanf(tmp, "%u", &max_rows) != 1)) {
+           ast_log(LOG_WARNING, "max_rows must be a number of rows, not '%s'\n", tmp);
+           max_rows = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "require_projection"))
+        && (sscanf(tmp, "%u", &require_projection) != 1)) {
+           ast_log(LOG_WARNING, "require_projection must be a 0|1, not '%s'\n", tmp);
+           require_projection = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "slow_query_ms"))
+        && (sscanf(tmp, "%u", &slow_query_ms) != 1)) {
+           ast_log(LOG_WARNING, "slow_query_ms must be milliseconds, not '%s'\n", tmp);
+           slow_query_ms = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "auto_index"))
+        && (sscanf(tmp, "%u", &auto_index) != 1)) {
+           ast_log(LOG_WARNING, "auto_index must be a 0|1, not '%s'\n", tmp);
+           auto_index = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "write_behind_ms"))
+        && (sscanf(tmp, "%u", &write_behind_ms) != 1)) {
+           ast_log(LOG_WARNING, "write_behind_ms must be milliseconds, not '%s'\n", tmp);
+           write_behind_ms = 100;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "write_behind_max"))
+        && (sscanf(tmp, "%u", &write_behind_max) != 1 || !write_behind_max)) {
+           ast_log(LOG_WARNING, "write_behind_max must be a number of writes, not '%s'\n", tmp);
+           write_behind_max = 10000;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "load_cache"))
+        && (sscanf(tmp, "%u", &load_cache) != 1)) {
+           ast_log(LOG_WARNING, "load_cache must be a 0|1, not '%s'\n", tmp);
+           load_cache = 0;
+        }
+        tmp = ast_variable_retrieve(cfg, CATEGORY, "load_version_field");
+        ast_copy_string(load_version_field, tmp ? tmp : "lastModified", sizeof(load_version_field));
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "cache_size"))
+        && (sscanf(tmp, "%u", &cache_size) != 1)) {
+           ast_log(LOG_WARNING, "cache_size must be a number of entries, not '%s'\n", tmp);
+           cache_size = 1000;
+        }
+        tables = table_config_load(cfg, mongoc_uri_get_database(uri));
+        if (!tables)
+            break;
+        cache_purge(NULL, NULL);
+        watch_stop();
+        index_stop();
+        write_stop();
 
-        if (!fields2doc(table, fields, document)) {
-            ast_log(LOG_ERROR, "cannot make a document to update\n");
+        if (apm_context)
+            ast_mongo_apm_stop(apm_context);
+
+        if (dbpool)
+            mongoc_client_pool_destroy(dbpool);
+        dbpool = mongoc_client_pool_new(uri);
+        if (dbpool == NULL) {
+            ast_log(LOG_ERROR, "cannot make a connection pool for MongoDB\n");
             break;
         }
 
-        LOG_BSON_AS_JSON(LOG_DEBUG, "document=%s\n", document);
+        if (apm_enabled)
+            apm_context = ast_mongo_apm_start(dbpool);
 
-        if (!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, document, NULL, &error)) {
-            ast_log(LOG_ERROR, "store failed, error=%s\n", error.message);
-            LOG_BSON_AS_JSON(LOG_ERROR, "document=%s\n", document);
-            break;
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, SERVERID)) != NULL) {
+            if (!bson_oid_is_valid (tmp, strlen(tmp))) {
+                ast_log(LOG_ERROR, "invalid server id specified.\n");
+                break;
+            }
+            serverid = ast_malloc(sizeof(bson_oid_t));
+            if (serverid == NULL) {
+                ast_log(LOG_ERROR, "not enough memory\n");
+                break;
+            }
+            bson_oid_init_from_string(serverid, tmp);
         }
 
-        ret = 1; // success
-    } while(0);
+        ao2_global_obj_replace_unref(table_configs, tables);
+        query_template_purge();
+        trace_config(cfg);
+        {
+            struct ao2_container *snaps = snapshot_load_all(tables);
+            struct ao2_iterator i;
+            struct snapshot *snap;
 
-    if (document)
-        bson_destroy((bson_t *)document);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
-    return ret;
+            if (!snaps)
+                break;
+            ao2_global_obj_replace_unref(snapshots, snaps);
+            snapshot_count = ao2_container_count(snaps);
+            i = ao2_iterator_init(snaps, 0);
+            for (; (snap = ao2_iterator_next(&i)); ao2_ref(snap, -1))
+                watch_register(snap->database, snap->table);
+            ao2_iterator_destroy(&i);
+            ao2_ref(snaps, -1);
+        }
+
+        watch_start();
+        index_start();
+        write_start();
+
+        if (!reload && (tmp = ast_variable_retrieve(cfg, CATEGORY, "prefetch_files"))) {
+            const char *database = mongoc_uri_get_database(uri);
+            const char *table = ast_variable_retrieve(cfg, CATEGORY, "prefetch_table");
+
+            if (database)
+                load_prefetch_files(database, S_OR(table, "ast_config"), tmp);
+            else
+                ast_log(LOG_WARNING, "prefetch_files needs a database in uri\n");
+        }
+
+        res = 0; // success
+    } while (0);
+
+    if (tables)
+        ao2_ref(tables, -1);
+    if (uri)
+       mongoc_uri_destroy(uri);
+    if (cfg && cfg != CONFIG_STATUS_FILEUNCHANGED && cfg != CONFIG_STATUS_FILEINVALID) {
+        ast_config_destroy(cfg);
+    }
+
+    return res;
 }
 
+static struct ast_config_engine mongodb_engine = {
+    .name = (char *)NAME,
+    .load_func = load,
+    .realtime_func = realtime,
+    .realtime_multi_func = realtime_multi,
+    .store_func = store,
+    .destroy_func = destroy,
+    .update_func = update,
+    .update2_func = update2,
+    .require_func = require,
+    .unload_func = unload,
+};
+
+#ifdef TEST_FRAMEWORK
 /*!
- * \brief Execute an DELETE query
- * \param database
- * \param table
- * \param keyfield where clause field
- * \param lookup value of field for where clause
- * \param ap list containing one or more field/value set(s)
- *
- * Delete a row from a database table, prepare the sql statement using keyfield and lookup
- * control the number of records to change. Additional params to match rows are stored in ap list.
- * Sub-in the values to the prepared statement and execute it.
- *
- * \retval number of rows affected
- * \retval -1 on failure
-*/
-static int destroy(const char *database, const char *table, const char *keyfield, const char *lookup, const struct ast_variable *fields)
+ * \brief append fields made of pairs of a name and a value to a list
+ * \retval the list,
+ * \retval NULL if not enough memory, and the list is destroyed.
+ */
+static struct ast_variable *fields_from_pairs(struct ast_variable *fields, const char *pairs[][2], size_t count)
 {
-    int ret = -1;
-    bson_t *selector = NULL;
-    mongoc_client_t *dbclient = NULL;
-    mongoc_collection_t *collection = NULL;
+    struct ast_variable *last = fields;
+    size_t i;
 
-    if (!database || !table || !keyfield || !lookup) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return -1;
+    while (last && last->next)
+        last = last->next;
+    for (i = 0; i < count; i++) {
+        struct ast_variable *var = ast_variable_new(pairs[i][0], pairs[i][1], "");
+
+        if (!var) {
+            ast_variables_destroy(fields);
+            return NULL;
+        }
+        if (last)
+            last->next = var;
+        else
+            fields = var;
+        last = var;
     }
-    ast_log(LOG_DEBUG, "database=%s, table=%s, keyfield=%s, lookup=%s.\n", database, table, keyfield, lookup);
-    ast_log(LOG_DEBUG, "fields->name=%s, fields->value=%s.\n", fields?fields->name:"NULL", fields?fields->value:"NULL");
+    return fields;
+}
 
-    if(dbpool == NULL) {
-        ast_log(LOG_ERROR, "no connection pool\n");
-        return -1;
+/*!
+ * \brief make_condition() as it was, a bson_t for each LIKE condition
+ */
+static const bson_t* make_condition_legacy(const char* sql)
+{
+    bson_t* condition = NULL;
+    char patern[1020];
+    char tmp[1024];
+    char head = *sql;
+    char tail = *(sql + strlen(sql) - 1);
+
+    if (strcmp(sql, "%") == 0) {
+        const char* json = "{ \"$exists\": true, \"$not\": {\"$size\": 0}}";
+        bson_error_t error;
+        condition = bson_new_from_json((const uint8_t*)json, -1, &error);
+        if (!condition)
+            ast_log(LOG_ERROR, "cannot generated condition from \"%s\", %d.%d:%s\n", json, error.domain, error.code, error.message);
     }
-    dbclient = mongoc_client_pool_pop(dbpool);
-    if(dbclient == NULL) {
-        ast_log(LOG_ERROR, "no client allocated\n");
-        return -1;
+    else if (head == '%' && tail == '%') {
+        strcopy(sql+1, patern, sizeof(patern)-1);
+        snprintf(tmp, sizeof(tmp), "%s", patern);
+        condition = bson_new();
+        BSON_APPEND_UTF8(condition, "$regex", tmp);
+    }
+    else if (head == '%') {
+        strcopy(sql+1, patern, sizeof(patern)-1);
+        snprintf(tmp, sizeof(tmp), "%s$", patern);
+        condition = bson_new();
+        BSON_APPEND_UTF8(condition, "$regex", tmp);
+    }
+    else if (tail == '%') {
+        strcopy(sql, patern, sizeof(patern));
+        snprintf(tmp, sizeof(tmp), "^%s", patern);
+        condition = bson_new();
+        BSON_APPEND_UTF8(condition, "$regex", tmp);
+    }
+    else {
+        ast_log(LOG_WARNING, "not supported condition, \"%s\"\n", sql);
     }
 
+    if (!condition)
+        ast_log(LOG_WARNING, "no condition generated\n");
+
+    return (const bson_t*)condition;
+}
+
+/*!
+ * \brief make_query() as it was, splitting names and building a bson_t
+ *        for each condition on every lookup
+ */
+static bson_t *make_query_legacy(const struct ast_variable *fields, const char *orderby)
+{
+    bson_t *root = NULL;
+    bson_t *query = NULL;
+    bson_t *order = NULL;
+
     do {
-        bson_error_t error;
+        bool err;
+
+        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        order = orderby ? BCON_NEW(key_asterisk2mongo(orderby), BCON_DOUBLE(1)) : bson_new();
+
+        for(err = false; fields && !err; fields = fields->next) {
+            const bson_t *condition = NULL;
+            const char *tokens[MAXTOKENS];
+            char buf[1024];
+            int count;
+            long long ll_number;
+
+            if (strlen(fields->name) >= (sizeof(buf) - 1)) {
+                ast_log(LOG_WARNING, "too long key, \"%s\".\n", fields->name);
+                continue;
+            }
+            strcpy(buf, fields->name);
+            count = str_split(buf, " ", tokens);
+            err = true;
+
+            switch(count) {
+                case 1:
+#ifdef HANDLE_ID_AS_OID
+                    if ((strcmp(fields->name, "id") == 0)
+                    &&  bson_oid_is_valid(fields->value, strlen(fields->value))) {
+                        bson_oid_t oid;
+                        bson_oid_init_from_string(&oid, fields->value);
+                        err = !BSON_APPEND_OID(query, "_id", &oid);
+                    }
+                    else
+#endif
+                        err = !BSON_APPEND_UTF8(query, key_asterisk2mongo(fields->name), fields->value);
+                    break;
+                case 2:
+                    if (!strcasecmp(tokens[1], "LIKE")) {
+                        condition = make_condition_legacy(fields->value);
+                    }
+                    else if (!strcasecmp(tokens[1], "!=")) {
+                        // {
+                        //     tokens[0]: {
+                        //         "$exists" : true,
+                        //         "$ne" : value
+                        //     }
+                        // }
+                        condition = BCON_NEW(
+                            "$exists", BCON_BOOL(1),
+                            "$ne", BCON_UTF8(fields->value)
+                        );
+                    }
+                    else if (!strcasecmp(tokens[1], ">")) {
+                        // {
+                        //     tokens[0]: {
+                        //         "$gt" : value
+                        //     }
+                        // }
+                        if (is_integer(fields->value, &ll_number))
+                            condition = BCON_NEW("$gt", BCON_INT64(ll_number));
+                        else
+                            condition = BCON_NEW("$gt", BCON_UTF8(fields->value));
+                    }
+                    else if (!strcasecmp(tokens[1], "<=")) {
+                        // {
+                        //     tokens[0]: {
+                        //         "$lte" : value
+                        //     }
+                        // }
+                        if (is_integer(fields->value, &ll_number))
+                            condition = BCON_NEW("$lte", BCON_INT64(ll_number));
+                        else
+                            condition = BCON_NEW("$lte", BCON_UTF8(fields->value));
+                    }
+                    else {
+                        ast_log(LOG_WARNING, "unexpected operator \"%s\" of \"%s\" \"%s\".\n", tokens[1], fields->name, fields->value);
+                        break;
+                    }
+                    if (!condition) {
+                        ast_log(LOG_ERROR, "something wrong.\n");
+                        break;
+                    }
+
+                    err = !BSON_APPEND_DOCUMENT(query, key_asterisk2mongo(tokens[0]), condition);
 
-        selector = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
-        if (!selector) {
-            ast_log(LOG_ERROR, "not enough memory\n");
-            break;
+                    break;
+                default:
+                    ast_log(LOG_WARNING, "not handled, name=%s, value=%s.\n", fields->name, fields->value);
+            }
+            if (condition)
+                bson_destroy((bson_t*)condition);
+            else if (count > 1) {
+                ast_log(LOG_ERROR, "something wrong.\n");
+                break;
+            }
         }
-        if (!BSON_APPEND_UTF8(selector, key_asterisk2mongo(keyfield), lookup)) {
-            ast_log(LOG_ERROR, "cannot make a query\n");
+        if (err) {
+            ast_log(LOG_ERROR, "something wrong.\n");
             break;
         }
-
-        collection = mongoc_client_get_collection(dbclient, database, table);
-
-        if (!mongoc_collection_remove(collection, MONGOC_REMOVE_SINGLE_REMOVE, selector, NULL, &error)) {
-             ast_log(LOG_ERROR, "destroy failed, error=%s\n", error.message);
-             break;
+        root = BCON_NEW("$query", BCON_DOCUMENT(query),
+                        "$orderby", BCON_DOCUMENT(order));
+        if (!root) {    // current BCON_NEW might not return any error such as NULL...
+            ast_log(LOG_WARNING, "not enough memory\n");
+            break;
         }
-
-        ret = 1; // success
     } while(0);
-
-    if (selector)
-        bson_destroy((bson_t *)selector);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
-    return ret;
+    if (query)
+        bson_destroy(query);
+    if (order)
+        bson_destroy(order);
+    return root;
 }
 
-static struct ast_config *load(
-    const char *database, const char *table, const char *file, struct ast_config *cfg, struct ast_flags flags, const char *sugg_incl, const char *who_asked)
+AST_TEST_DEFINE(make_query_bench)
 {
-    struct ast_variable *new_v;
-    struct ast_category *cur_cat;
-    struct ast_flags loader_flags = { 0 };
-    mongoc_collection_t *collection = NULL;
-    mongoc_cursor_t* cursor = NULL;
-    mongoc_client_t* dbclient = NULL;
-    bson_t *query = NULL;
-    const bson_t *doc = NULL;
-    const bson_t *order = NULL;
-    const bson_t *root = NULL;
-    const bson_t *fields = NULL;
-    const char *last_category = "";
-    int last_cat_metric = -1;
+    static const int LOOPS = 100000;
+    static const char *sample[][2] = {
+        { "id", "6001" },
+        { "type !=", "friend" },
+        { "max_contacts >", "0" },
+        { "context LIKE", "from-%" },
+    };
+    struct ast_variable *fields;
+    struct query_template *cached;
+    struct timeval start;
+    int64_t legacy_us;
+    int64_t compiled_us;
+    int64_t cached_us;
+    bson_t *expected = NULL;
+    bool same = true;
+    int i;
 
-    if (!database || !table || !file || !cfg || !who_asked) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return NULL;
-    }
-    if (!strcmp (file, CONFIG_FILE))
-        return NULL;        /* cant configure myself with myself ! */
-    if(dbpool == NULL) {
-        ast_log(LOG_ERROR, "no connection pool\n");
-        return NULL;
+    switch (cmd) {
+        case TEST_INIT:
+            info->name = "make_query";
+            info->category = "/res/res_config_mongodb/";
+            info->summary = "query templates micro-benchmark";
+            info->description = "Compare make_query() as it was before query templates, "
+                "compiling a template for each lookup and using the template compiled already.";
+            return AST_TEST_NOT_RUN;
+        case TEST_EXECUTE:
+            break;
     }
 
-    dbclient = mongoc_client_pool_pop(dbpool);
-    if(dbclient == NULL) {
-        ast_log(LOG_ERROR, "no client allocated\n");
-        return NULL;
+    if (!(fields = fields_from_pairs(NULL, sample, ARRAY_LEN(sample))))
+        return AST_TEST_FAIL;
+    // a template of its own, not published to the templates in use
+    cached = query_template_new(query_shape("test_bench", fields), "test_bench", fields);
+    expected = cached ? query_template_apply(cached, fields) : NULL;
+    if (!expected) {
+        ao2_cleanup(cached);
+        ast_variables_destroy(fields);
+        return AST_TEST_FAIL;
     }
 
-    do {
-        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
-        if (!BSON_APPEND_UTF8(query, "filename", file)) {
-            ast_log(LOG_ERROR, "unexpected bson error with filename=%s\n", file);
-            break;
-        }
-        if (!BSON_APPEND_DOUBLE(query, "commented", 0)) {
-            ast_log(LOG_ERROR, "unexpected bson error\n");
-            break;
-        }
-        order = BCON_NEW(   "cat_metric", BCON_DOUBLE(-1),
-                            "var_metric", BCON_DOUBLE(1),
-                            "category", BCON_DOUBLE(1),
-                            "var_name", BCON_DOUBLE(1));
-        root = BCON_NEW(    "$query", BCON_DOCUMENT(query),
-                            "$orderby", BCON_DOCUMENT(order));
-        fields = BCON_NEW(  "cat_metric", BCON_DOUBLE(1),
-                            "category", BCON_DOUBLE(1),
-                            "var_name", BCON_DOUBLE(1),
-                            "var_val", BCON_DOUBLE(1));
-
-        LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s\n", root);
-        // LOG_BSON_AS_JSON(LOG_DEBUG, "fields=%s\n", fields);
-
-        collection = mongoc_client_get_collection(dbclient, database, table);
-        cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 0, 0, root, fields, NULL);
-        if (!cursor) {
-            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s\n", root);
-            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with fields=%s\n", fields);
-            break;
-        }
-
-        cur_cat = ast_config_get_current_category(cfg);
-
-        while (mongoc_cursor_next(cursor, &doc)) {
-            bson_iter_t iter;
-            const char *var_name;
-            const char *var_val;
-            const char *category;
-            int cat_metric;
-            uint32_t length;
+    start = ast_tvnow();
+    for (i = 0; i < LOOPS; i++) {
+        bson_t *query = make_query_legacy(fields, NULL);
 
-            LOG_BSON_AS_JSON(LOG_DEBUG, "query found %s\n", doc);
+        same &= query != NULL;
+        if (query)
+            bson_destroy(query);
+    }
+    legacy_us = ast_tvdiff_us(ast_tvnow(), start);
 
-            if (!bson_iter_init(&iter, doc)) {
-                ast_log(LOG_ERROR, "unexpected bson error!\n");
-                break;
-            }
+    start = ast_tvnow();
+    for (i = 0; i < LOOPS; i++) {
+        struct query_template *tmpl = query_template_new(query_shape("test_bench", fields), "test_bench", fields);
+        bson_t *query = tmpl ? query_template_apply(tmpl, fields) : NULL;
 
-            if(!bson_iter_find(&iter, "cat_metric")) {
-                ast_log(LOG_ERROR, "no cat_metric found!\n");
-                break;
-            }
-            cat_metric = (int)bson_iter_double(&iter);
+        same &= query && bson_equal(query, expected);
+        if (query)
+            bson_destroy(query);
+        ao2_cleanup(tmpl);
+    }
+    compiled_us = ast_tvdiff_us(ast_tvnow(), start);
 
-            if(!bson_iter_find(&iter, "category")) {
-                ast_log(LOG_ERROR, "no category found!\n");
-                break;
-            }
-            category = bson_iter_utf8(&iter, &length);
-            if (!category) {
-                ast_log(LOG_ERROR, "cannot read category.\n");
-                break;
-            }
+    start = ast_tvnow();
+    for (i = 0; i < LOOPS; i++) {
+        bson_t *query = query_template_apply(cached, fields);
 
-            if(!bson_iter_find(&iter, "var_name")) {
-                ast_log(LOG_ERROR, "no var_name found!\n");
-                break;
-            }
-            var_name = bson_iter_utf8(&iter, &length);
-            if (!var_name) {
-                ast_log(LOG_ERROR, "cannot read var_name.\n");
-                break;
-            }
+        same &= query && bson_equal(query, expected);
+        if (query)
+            bson_destroy(query);
+    }
+    cached_us = ast_tvdiff_us(ast_tvnow(), start);
+
+    ast_test_status_update(test, "before templates:    %lld ns/lookup\n",
+                           (long long)(legacy_us * 1000 / LOOPS));
+    ast_test_status_update(test, "compiled per lookup: %lld ns/lookup\n",
+                           (long long)(compiled_us * 1000 / LOOPS));
+    ast_test_status_update(test, "template cached:     %lld ns/lookup\n",
+                           (long long)(cached_us * 1000 / LOOPS));
+
+    ao2_cleanup(cached);
+    bson_destroy(expected);
+    ast_variables_destroy(fields);
+    ast_test_validate(test, same);
+    return AST_TEST_PASS;
+}
+/*!
+ * \brief doc2variables() as it was, formatting every value in a buffer of 128 bytes
+ */
+static struct ast_variable *doc2variables_snprintf(const bson_t *doc)
+{
+    struct ast_variable *var = NULL;
+    struct ast_variable *prev = NULL;
+    bson_iter_t iter;
+    char work[128];
 
-            if(!bson_iter_find(&iter, "var_val")) {
-                ast_log(LOG_ERROR, "no var_val found!\n");
-                break;
-            }
-            var_val = bson_iter_utf8(&iter, &length);
-            if (!var_val) {
-                ast_log(LOG_ERROR, "cannot read var_val.\n");
-                break;
-            }
+    if (!bson_iter_init(&iter, doc))
+        return NULL;
+    while (bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+        struct ast_variable *v;
+
+        if (BSON_ITER_HOLDS_OID(&iter))
+            bson_oid_to_string(bson_iter_oid(&iter), work);
+        else if (BSON_ITER_HOLDS_UTF8(&iter))
+            snprintf(work, sizeof(work), "%s", bson_iter_utf8(&iter, NULL));
+        else if (BSON_ITER_HOLDS_BOOL(&iter))
+            snprintf(work, sizeof(work), "%s", bson_iter_bool(&iter) ? "true" : "false");
+        else if (BSON_ITER_HOLDS_INT32(&iter))
+            snprintf(work, sizeof(work), "%ld", (long)bson_iter_int32(&iter));
+        else if (BSON_ITER_HOLDS_INT64(&iter))
+            snprintf(work, sizeof(work), "%Ld", (long long)bson_iter_int64(&iter));
+        else if (BSON_ITER_HOLDS_DOUBLE(&iter))
+            snprintf(work, sizeof(work), "%.10g", bson_iter_double(&iter));
+        else
+            continue;
+        if (!(v = ast_variable_new(key, work, "")))
+            continue;
+        if (prev)
+            prev->next = v;
+        else
+            var = v;
+        prev = v;
+    }
+    return var;
+}
 
-            if (!strcmp (var_val, "#include")) {
-                if (!ast_config_internal_load(var_val, cfg, loader_flags, "", who_asked)) {
-                    ast_log(LOG_DEBUG, "ended with who_asked=%s\n", who_asked);
-                    break;
-                }
-                ast_log(LOG_DEBUG, "#include ignored, who_asked=%s\n", who_asked);
-                continue;
-            }
+AST_TEST_DEFINE(doc2variables_bench)
+{
+    static const int LOOPS = 100000;
+    static const char *strings[][2] = {
+        { "id", "6001" }, { "transport", "transport-udp" }, { "aors", "6001" }, { "auth", "6001" },
+        { "context", "from-internal" }, { "disallow", "all" }, { "allow", "ulaw,alaw,g722,opus,gsm" },
+        { "direct_media", "no" }, { "dtmf_mode", "rfc4733" }, { "force_rport", "yes" },
+        { "rewrite_contact", "yes" }, { "rtp_symmetric", "yes" }, { "callerid", "\"Alice\" <6001>" },
+        { "mailboxes", "6001@default" }, { "named_call_group", "sales,support" },
+        { "named_pickup_group", "sales,support" }, { "outbound_auth", "" }, { "media_encryption", "no" },
+        { "device_state_busy_at", "2" }, { "from_domain", "pbx.example.com" }, { "language", "en" },
+        { "moh_suggest", "default" }, { "sdp_owner", "-" }, { "tone_zone", "us" },
+        { "set_var", "CHANNEL(hangup_handler_push)=hangup-handler,s,1;__TENANT=example;"
+                     "__ACCOUNTCODE=6001;__RECORDING=always;__RECORDING_FORMAT=wav49;__CALLER_POLICY=standard" },
+    };
+    static const char *ints[] = {
+        "rtp_timeout", "rtp_timeout_hold", "max_audio_streams", "max_video_streams", "timers_sess_expires",
+        "timers_min_se", "t38_udptl_maxdatagram", "tos_audio", "cos_audio", "rtp_keepalive",
+    };
+    bson_t *doc = bson_new();
+    struct ast_variable *expected = NULL;
+    struct ast_variable *vars;
+    const struct ast_variable *v;
+    const struct ast_variable *e;
+    bson_oid_t oid;
+    struct timeval start;
+    int64_t snprintf_us;
+    int64_t direct_us;
+    bool same = true;
+    int i;
 
-            if (strcmp(last_category, category) || last_cat_metric != cat_metric) {
-                cur_cat = ast_category_new(category, "", 99999);
-                if (!cur_cat) {
-                    ast_log(LOG_WARNING, "Out of memory!\n");
-                    break;
-                }
-                last_category = category;
-                last_cat_metric = cat_metric;
-                ast_category_append(cfg, cur_cat);
-            }
+    switch (cmd) {
+        case TEST_INIT:
+            info->name = "doc2variables";
+            info->category = "/res/res_config_mongodb/";
+            info->summary = "document conversion micro-benchmark";
+            info->description = "Compare doc2variables() on a ps_endpoints document "
+                "with formatting every value in a buffer of 128 bytes as before.";
+            return AST_TEST_NOT_RUN;
+        case TEST_EXECUTE:
+            break;
+    }
 
-            new_v = ast_variable_new(var_name, var_val, "");
-            ast_variable_append(cur_cat, new_v);
-        }
-    } while(0);
+    if (!doc)
+        return AST_TEST_FAIL;
+    bson_oid_init(&oid, NULL);
+    BSON_APPEND_OID(doc, "_id", &oid);
+    for (i = 0; i < ARRAY_LEN(strings); i++)
+        BSON_APPEND_UTF8(doc, strings[i][0], strings[i][1]);
+    for (i = 0; i < ARRAY_LEN(ints); i++)
+        BSON_APPEND_INT32(doc, ints[i], i * 1234 - 1000);
+    BSON_APPEND_INT64(doc, "expiration", 1500000000123LL);
+    BSON_APPEND_BOOL(doc, "webrtc", false);
+    BSON_APPEND_DOUBLE(doc, "qualify_timeout", 3.5);
+    BSON_APPEND_DOUBLE(doc, "max_contacts", 1);
+
+    start = ast_tvnow();
+    for (i = 0; i < LOOPS; i++)
+        ast_variables_destroy(doc2variables_snprintf(doc));
+    snprintf_us = ast_tvdiff_us(ast_tvnow(), start);
+
+    start = ast_tvnow();
+    for (i = 0; i < LOOPS; i++)
+        ast_variables_destroy(doc2variables(doc, "ps_endpoints", NULL));
+    direct_us = ast_tvdiff_us(ast_tvnow(), start);
+
+    ast_test_status_update(test, "snprintf to work[128]: %lld ns/document of %u fields\n",
+                           (long long)(snprintf_us * 1000 / LOOPS), bson_count_keys(doc));
+    ast_test_status_update(test, "direct from bson:      %lld ns/document of %u fields\n",
+                           (long long)(direct_us * 1000 / LOOPS), bson_count_keys(doc));
+
+    // same values except the long set_var truncated before
+    expected = doc2variables_snprintf(doc);
+    vars = doc2variables(doc, "ps_endpoints", NULL);
+    for (v = vars, e = expected; v && e; v = v->next, e = e->next) {
+        same &= !strcmp(v->name, e->name);
+        if (!strcmp(v->name, "set_var"))
+            same &= strlen(v->value) > 127 && strlen(e->value) == 127 && !strncmp(v->value, e->value, 127);
+        else
+            same &= !strcmp(v->value, e->value);
+    }
+    same &= !v && !e;
 
-    if (doc)
-        bson_destroy((bson_t *)doc);
-    if (fields)
-        bson_destroy((bson_t *)fields);
-    if (query)
-        bson_destroy((bson_t *)query);
-    if (order)
-        bson_destroy((bson_t *)order);
-    if (root)
-        bson_destroy((bson_t *)root);
-    if (cursor)
-        mongoc_cursor_destroy(cursor);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
-    return cfg;
+    ast_variables_destroy(expected);
+    ast_variables_destroy(vars);
+    bson_destroy(doc);
+    ast_test_validate(test, same);
+    return AST_TEST_PASS;
 }
 
 /*!
- * \brief Callback for clearing any cached info
- * \note We don't currently cache anything
- * \retval 0 If any cache was purged
- * \retval -1 If no cache was found
+ * \brief model_get_btype() as it was, looking up a bson of models under a mutex
  */
-static int unload(const char *a, const char *b)
+static bson_type_t model_get_btype_locked(ast_mutex_t *lock, const bson_t *models,
+                                          const char* model_name, const char* property, const char* value)
 {
-    ast_log(LOG_DEBUG, "database=%s, table=%s\n", a, b);
-    /* We currently do no caching */
-    return -1;
+    bson_type_t btype = BSON_TYPE_UNDEFINED;
+    bson_iter_t iroot;
+    bson_iter_t imodel;
+
+    ast_mutex_lock(lock);
+    if (value) {
+        if (is_bool(value, NULL))
+            btype = BSON_TYPE_BOOL;
+        else if (is_real(value, NULL))
+            btype = BSON_TYPE_DOUBLE;
+        else
+            btype = BSON_TYPE_UTF8;
+    }
+    if (bson_iter_init_find(&iroot, models, model_name) &&
+        BSON_ITER_HOLDS_DOCUMENT(&iroot) &&
+        bson_iter_recurse(&iroot, &imodel) &&
+        bson_iter_find(&imodel, property))
+    {
+        btype = (bson_type_t)bson_iter_as_int64(&imodel);
+    }
+    ast_mutex_unlock(lock);
+    return btype;
 }
 
+struct schema_bench {
+    ast_mutex_t *lock;          /*!< NULL to look up the registry */
+    struct schema_registry *registry;   /*!< private, not to disturb the tables required */
+    const bson_t *models;
+    const struct ast_variable *fields;
+    int loops;
+    unsigned sum;               /*!< of btypes, to compare the paths */
+};
 
-static int config(int reload)
+static void *schema_bench_thread(void *data)
 {
-    int res = -1;
-    struct ast_config *cfg = NULL;
-    mongoc_uri_t *uri = NULL;
-    ast_log(LOG_DEBUG, "reload=%d\n", reload);
-
-    do {
-        const char *tmp;
-        struct ast_variable *var;
-        struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
-
-        cfg = ast_config_load(CONFIG_FILE, config_flags);
-        if (!cfg || cfg == CONFIG_STATUS_FILEINVALID) {
-            ast_log(LOG_WARNING, "unable to load %s\n", CONFIG_FILE);
-            res = AST_MODULE_LOAD_DECLINE;
-            break;
-        } else if (cfg == CONFIG_STATUS_FILEUNCHANGED)
-            break;
-
-        var = ast_variable_browse(cfg, CATEGORY);
-        if (!var) {
-            ast_log(LOG_WARNING, "no category %s specified.\n", CATEGORY);
-            break;
-        }
+    struct schema_bench *bench = data;
+    const struct ast_variable *v;
+    int i;
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "uri")) == NULL) {
-            ast_log(LOG_WARNING, "no uri specified.\n");
-            break;
-        }
-        uri = mongoc_uri_new(tmp);
-        if (uri == NULL) {
-            ast_log(LOG_ERROR, "parsing uri error, %s\n", tmp);
-            break;
-        }
+    for (i = 0; i < bench->loops; i++) {
+        const struct schema *schema = bench->lock ? NULL
+            : schema_lookup(__atomic_load_n(&bench->registry, __ATOMIC_ACQUIRE), "test_bench_schema");
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "apm"))
-        && (sscanf(tmp, "%u", &apm_enabled) != 1)) {
-           ast_log(LOG_WARNING, "apm must be a 0|1, not '%s'\n", tmp);
-           apm_enabled = 0;
+        for (v = bench->fields; v; v = v->next) {
+            bench->sum += bench->lock
+                ? model_get_btype_locked(bench->lock, bench->models, "test_bench_schema", v->name, v->value)
+                : schema_btype(schema, v->name, v->value, false);
         }
-        if (apm_context)
-            ast_mongo_apm_stop(apm_context);
+    }
+    return NULL;
+}
 
-        if (dbpool)
-            mongoc_client_pool_destroy(dbpool);
-        dbpool = mongoc_client_pool_new(uri);
-        if (dbpool == NULL) {
-            ast_log(LOG_ERROR, "cannot make a connection pool for MongoDB\n");
+AST_TEST_DEFINE(schema_contention_bench)
+{
+    static const int LOOPS = 20000;
+    static const int THREADS[] = { 1, 4, 16 };
+    static const char *sample[][2] = {
+        { "id", "6001" }, { "transport", "transport-udp" }, { "aors", "6001" }, { "auth", "6001" },
+        { "context", "from-internal" }, { "disallow", "all" }, { "allow", "ulaw,alaw,g722" },
+        { "direct_media", "no" }, { "dtmf_mode", "rfc4733" }, { "force_rport", "yes" },
+        { "rewrite_contact", "yes" }, { "rtp_symmetric", "yes" }, { "callerid", "\"Alice\" <6001>" },
+        { "rtp_timeout", "60" }, { "rtp_timeout_hold", "300" }, { "max_audio_streams", "1" },
+        { "device_state_busy_at", "2" }, { "qualify_timeout", "3.5" }, { "webrtc", "false" },
+        { "not_in_model", "true" },
+    };
+    ast_mutex_t lock;
+    bson_t *models = bson_new();
+    bson_t model = BSON_INITIALIZER;
+    bson_t legacy = BSON_INITIALIZER;
+    struct schema_registry *registry = ast_calloc(1, sizeof(*registry) + schema_slots(1) * sizeof(registry->slots[0]));
+    struct schema *schema;
+    struct ast_variable *fields;
+    unsigned expected = 0;
+    bool same = true;
+    int i;
+    int t;
+
+    switch (cmd) {
+        case TEST_INIT:
+            info->name = "schema_contention";
+            info->category = "/res/res_config_mongodb/";
+            info->summary = "schema lookup contention benchmark";
+            info->description = "Compare threads converting fields by the schema registry "
+                "with the bson of models under a mutex as before.";
+            return AST_TEST_NOT_RUN;
+        case TEST_EXECUTE:
             break;
-        }
+    }
 
-        if (apm_enabled)
-            apm_context = ast_mongo_apm_start(dbpool);
+    fields = fields_from_pairs(NULL, sample, ARRAY_LEN(sample));
+    // the model of all but the last field, as require() of sorcery
+    for (i = 0; i < ARRAY_LEN(sample) - 1; i++) {
+        require_type rtype = is_real(sample[i][1], NULL) ? RQ_FLOAT : RQ_CHAR;
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, SERVERID)) != NULL) {
-            if (!bson_oid_is_valid (tmp, strlen(tmp))) {
-                ast_log(LOG_ERROR, "invalid server id specified.\n");
-                break;
+        BSON_APPEND_INT32(&model, sample[i][0], rtype);
+        BSON_APPEND_INT64(&legacy, sample[i][0], rtype2btype(rtype, false));
+    }
+    BSON_APPEND_DOCUMENT(models, "test_bench_schema", &legacy);
+    // a registry of its own instead of schema_register(), which would purge the templates in use
+    schema = schema_compile("test_bench_schema", &model);
+    if (!registry || !fields || !schema) {
+        if (schema)
+            schema_free(schema);
+        ast_free(registry);
+        bson_destroy(&legacy);
+        bson_destroy(&model);
+        bson_destroy(models);
+        ast_variables_destroy(fields);
+        return AST_TEST_FAIL;
+    }
+    registry->mask = schema_slots(1) - 1;
+    schema_link(registry, schema);
+    ast_mutex_init(&lock);
+
+    for (t = 0; t < ARRAY_LEN(THREADS); t++) {
+        int locked;
+
+        for (locked = 1; locked >= 0; locked--) {
+            struct schema_bench *bench = ast_alloca(THREADS[t] * sizeof(*bench));
+            pthread_t *threads = ast_alloca(THREADS[t] * sizeof(*threads));
+            struct timeval start = ast_tvnow();
+            int64_t elapsed_us;
+            int n;
+
+            for (n = 0; n < THREADS[t]; n++) {
+                bench[n] = (struct schema_bench){ locked ? &lock : NULL, registry, models, fields, LOOPS, 0 };
+                if (ast_pthread_create(&threads[n], NULL, schema_bench_thread, &bench[n]))
+                    threads[n] = AST_PTHREADT_NULL;
             }
-            serverid = ast_malloc(sizeof(bson_oid_t));
-            if (serverid == NULL) {
-                ast_log(LOG_ERROR, "not enough memory\n");
-                break;
+            for (n = 0; n < THREADS[t]; n++) {
+                if (threads[n] == AST_PTHREADT_NULL) {
+                    same = false;
+                    continue;
+                }
+                pthread_join(threads[n], NULL);
+                if (!expected)
+                    expected = bench[n].sum;
+                same &= bench[n].sum == expected;
             }
-            bson_oid_init_from_string(serverid, tmp);
+            elapsed_us = ast_tvdiff_us(ast_tvnow(), start);
+            ast_test_status_update(test, "%2d threads, %s: %lld ns/store of %d fields\n",
+                                   THREADS[t], locked ? "model_lock" : "lock-free ",
+                                   (long long)(elapsed_us * 1000 / LOOPS), (int)ARRAY_LEN(sample));
         }
+    }
 
-        res = 0; // success
-    } while (0);
+    ast_mutex_destroy(&lock);
+    schema_free(schema);
+    ast_free(registry);
+    bson_destroy(&legacy);
+    bson_destroy(&model);
+    bson_destroy(models);
+    ast_variables_destroy(fields);
+    ast_test_validate(test, same);
+    return AST_TEST_PASS;
+}
 
-    if (uri)
-       mongoc_uri_destroy(uri);
-    if (cfg && cfg != CONFIG_STATUS_FILEUNCHANGED && cfg != CONFIG_STATUS_FILEINVALID) {
-        ast_config_destroy(cfg);
+AST_TEST_DEFINE(fields2doc_bench)
+{
+    static const int LOOPS = 100000;
+    static const char *strings[][2] = {
+        { "id", "6001" }, { "transport", "transport-udp" }, { "aors", "6001" }, { "auth", "6001" },
+        { "context", "from-internal" }, { "disallow", "all" }, { "allow", "ulaw,alaw,g722,opus" },
+        { "direct_media", "no" }, { "dtmf_mode", "rfc4733" }, { "force_rport", "yes" },
+        { "rewrite_contact", "yes" }, { "rtp_symmetric", "yes" }, { "callerid", "\"Alice\" <6001>" },
+        { "mailboxes", "6001@default" }, { "named_call_group", "sales" }, { "named_pickup_group", "sales" },
+        { "outbound_auth", "" }, { "media_encryption", "no" }, { "from_domain", "pbx.example.com" },
+        { "language", "en" }, { "moh_suggest", "default" }, { "sdp_owner", "-" }, { "tone_zone", "us" },
+        { "ice_support", "false" }, { "webrtc", "false" },
+    };
+    static const char *numbers[][2] = {
+        { "rtp_timeout", "60" }, { "rtp_timeout_hold", "300" }, { "max_audio_streams", "1" },
+        { "max_video_streams", "1" }, { "timers_sess_expires", "1800" }, { "timers_min_se", "90" },
+        { "t38_udptl_maxdatagram", "0" }, { "tos_audio", "184" }, { "cos_audio", "5" },
+        { "rtp_keepalive", "15" }, { "device_state_busy_at", "2" }, { "qualify_timeout", "3.5" },
+    };
+    // fields not required by sorcery, inferred from values
+    static const char *extra[][2] = {
+        { "tenant", "example" }, { "priority", "10" }, { "enabled", "true" },
+    };
+    bson_t model = BSON_INITIALIZER;
+    struct ast_variable *fields;
+    const struct schema_plan *plan;
+    struct schema *schema;
+    struct timeval start;
+    int64_t inferred_us;
+    int64_t planned_us;
+    bson_t *expected;
+    bool same = true;
+    int count = ARRAY_LEN(strings) + ARRAY_LEN(numbers) + ARRAY_LEN(extra);
+    int i;
+
+    switch (cmd) {
+        case TEST_INIT:
+            info->name = "fields2doc";
+            info->category = "/res/res_config_mongodb/";
+            info->summary = "field conversion micro-benchmark";
+            info->description = "Compare fields2doc() on a store of 40 fields of ps_endpoints "
+                "by a plan of converters with looking up the type of each field.";
+            return AST_TEST_NOT_RUN;
+        case TEST_EXECUTE:
+            break;
     }
 
-    models = bson_new();
+    fields = fields_from_pairs(NULL, strings, ARRAY_LEN(strings));
+    fields = fields ? fields_from_pairs(fields, numbers, ARRAY_LEN(numbers)) : NULL;
+    fields = fields ? fields_from_pairs(fields, extra, ARRAY_LEN(extra)) : NULL;
+    for (i = 0; i < ARRAY_LEN(strings); i++)
+        BSON_APPEND_INT32(&model, strings[i][0], RQ_CHAR);
+    for (i = 0; i < ARRAY_LEN(numbers); i++)
+        BSON_APPEND_INT32(&model, numbers[i][0], (ARRAY_LEN(strings) + i) % 2 ? RQ_UINTEGER4 : RQ_FLOAT);
+    // not registered, which would purge the templates in use, but freed with its plan at the end
+    schema = schema_compile("test_bench_fields2doc", &model);
+    bson_destroy(&model);
+    plan = schema && fields ? schema_plan_get(schema, fields) : NULL;
+    if (!plan) {
+        if (schema)
+            schema_free(schema);
+        ast_variables_destroy(fields);
+        return AST_TEST_FAIL;
+    }
+    expected = bson_new();
+    fields2doc_inferred(schema, fields, NULL, expected);
 
-    return res;
-}
+    start = ast_tvnow();
+    for (i = 0; i < LOOPS; i++) {
+        bson_t doc = BSON_INITIALIZER;
 
-static struct ast_config_engine mongodb_engine = {
-    .name = (char *)NAME,
-    .load_func = load,
-    .realtime_func = realtime,
-    .realtime_multi_func = realtime_multi,
-    .store_func = store,
-    .destroy_func = destroy,
-    .update_func = update,
-    .update2_func = update2,
-    .require_func = require,
-    .unload_func = unload,
-};
+        same &= fields2doc_inferred(schema, fields, NULL, &doc);
+        bson_destroy(&doc);
+    }
+    inferred_us = ast_tvdiff_us(ast_tvnow(), start);
+
+    start = ast_tvnow();
+    for (i = 0; i < LOOPS; i++) {
+        bson_t doc = BSON_INITIALIZER;
+
+        same &= fields2doc_planned(plan, fields, NULL, &doc) && bson_equal(&doc, expected);
+        bson_destroy(&doc);
+    }
+    planned_us = ast_tvdiff_us(ast_tvnow(), start);
+
+    ast_test_status_update(test, "type of each field: %lld ns/store of %d fields\n",
+                           (long long)(inferred_us * 1000 / LOOPS), count);
+    ast_test_status_update(test, "plan of converters: %lld ns/store of %d fields\n",
+                           (long long)(planned_us * 1000 / LOOPS), count);
+
+    schema_free(schema);
+    bson_destroy(expected);
+    ast_variables_destroy(fields);
+    ast_test_validate(test, same);
+    return AST_TEST_PASS;
+}
+#endif
 
 static int unload_module(void)
 {
+    AST_TEST_UNREGISTER(make_query_bench);
+    AST_TEST_UNREGISTER(doc2variables_bench);
+    AST_TEST_UNREGISTER(schema_contention_bench);
+    AST_TEST_UNREGISTER(fields2doc_bench);
+    ast_cli_unregister_multiple(cli_realtime_mongodb, ARRAY_LEN(cli_realtime_mongodb));
+    ast_manager_unregister("MongoDBLatency");
     ast_config_engine_deregister(&mongodb_engine);
-    if (models)
-        bson_destroy(models);
+    write_destroy();
+    watch_destroy();
+    ast_cond_destroy(&watch_cond);
+    index_destroy();
+    query_stats_destroy();
+    op_stats_destroy();
+    trace_destroy();
+    ao2_global_obj_release(snapshots);
+    ao2_global_obj_release(table_configs);
+    flight_destroy();
+    query_template_destroy();
+    load_cache_destroy();
+    cache_destroy();
+    schema_destroy();
     if (apm_context)
         ast_mongo_apm_stop(apm_context);
     if (dbpool)
@@ -1483,9 +8732,45 @@ static int unload_module(void)
 
 static int load_module(void)
 {
-    if (config(0))
+    if (cache_init())
         return AST_MODULE_LOAD_DECLINE;
+    if (flight_init() || query_template_init() || index_init() || query_stats_init() || op_stats_init() || trace_init()
+    ||  load_cache_init()) {
+        flight_destroy();
+        query_template_destroy();
+        load_cache_destroy();
+        index_destroy();
+        query_stats_destroy();
+        op_stats_destroy();
+        trace_destroy();
+        cache_destroy();
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    ast_cond_init(&watch_cond, NULL);
+    write_init();
+    if (config(0)) {
+        write_destroy();
+        watch_destroy();
+        ast_cond_destroy(&watch_cond);
+        index_destroy();
+        query_stats_destroy();
+        op_stats_destroy();
+        trace_destroy();
+        ao2_global_obj_release(snapshots);
+        ao2_global_obj_release(table_configs);
+        flight_destroy();
+        query_template_destroy();
+        load_cache_destroy();
+        cache_destroy();
+        return AST_MODULE_LOAD_DECLINE;
+    }
     ast_config_engine_register(&mongodb_engine);
+    ast_cli_register_multiple(cli_realtime_mongodb, ARRAY_LEN(cli_realtime_mongodb));
+    ast_manager_register_xml("MongoDBLatency", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_latency);
+    AST_TEST_REGISTER(make_query_bench);
+    AST_TEST_REGISTER(doc2variables_bench);
+    AST_TEST_REGISTER(schema_contention_bench);
+    AST_TEST_REGISTER(fields2doc_bench);
     return 0;
 }
 
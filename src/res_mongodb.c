@@ -32,6 +32,8 @@ ASTERISK_REGISTER_FILE()
 #include "asterisk/module.h"
 #include "asterisk/res_mongodb.h"
 #include "asterisk/config.h"
+#include "asterisk/lock.h"
+#include "asterisk/time.h"
 
 /*** DOCUMENTATION
     <function name="MongoDB" language="en_US">
@@ -41,13 +43,17 @@ ASTERISK_REGISTER_FILE()
         <description>
             This is the ast_mongo common resource which provides;
             1. functions to init and clean up mongoDB C Driver,
-            2. handlers for Application Performance Monitoring (APM).
+            2. handlers for Application Performance Monitoring (APM),
+            3. a rate-limited log of slow queries.
         </description>
     </function>
  ***/
 
 static const char CATEGORY[] = "common";
 static const char CONFIG_FILE[] = "ast_mongo.conf";
+// logs of slow queries, a burst of SLOW_QUERY_BURST then one per SLOW_QUERY_INTERVAL_MS
+static const unsigned SLOW_QUERY_BURST = 10;
+static const unsigned SLOW_QUERY_INTERVAL_MS = 6000;
 
 typedef struct {
     mongoc_apm_callbacks_t *callbacks;
@@ -76,6 +82,11 @@ static unsigned apm_sdam_monitoring = 0;
 // 6 = MONGOC_LOG_LEVEL_TRACE
 static int mongoc_log_level = -1;
 
+AST_MUTEX_DEFINE_STATIC(slow_query_lock);
+static unsigned slow_query_tokens = 0;
+static unsigned slow_query_dropped = 0;
+static struct timeval slow_query_refilled = { 0, 0 };
+
 static int log_level_mongoc2ast(mongoc_log_level_t mongoc_level) {
     switch(mongoc_level) {
         case MONGOC_LOG_LEVEL_ERROR:
@@ -357,6 +368,50 @@ void ast_mongo_apm_stop(void* context)
     ast_free(context);
 }
 
+void ast_mongo_slow_query(const char *module, const char *op,
+    const char *database, const char *collection,
+    const bson_t *filter, const bson_t *data, unsigned docs, int64_t us, const char *timing)
+{
+    struct timeval now = ast_tvnow();
+    unsigned dropped;
+    char *filter_json;
+    char *data_json;
+
+    ast_mutex_lock(&slow_query_lock);
+    if (ast_tvzero(slow_query_refilled)) {
+        slow_query_tokens = SLOW_QUERY_BURST;
+        slow_query_refilled = now;
+    }
+    else {
+        int64_t refills = ast_tvdiff_ms(now, slow_query_refilled) / SLOW_QUERY_INTERVAL_MS;
+        if (refills > 0) {
+            slow_query_tokens = MIN(SLOW_QUERY_BURST, slow_query_tokens + refills);
+            slow_query_refilled = ast_tvadd(slow_query_refilled, ast_samp2tv(refills * SLOW_QUERY_INTERVAL_MS, 1000));
+        }
+    }
+    if (!slow_query_tokens) {
+        slow_query_dropped++;
+        ast_mutex_unlock(&slow_query_lock);
+        return;
+    }
+    slow_query_tokens--;
+    dropped = slow_query_dropped;
+    slow_query_dropped = 0;
+    ast_mutex_unlock(&slow_query_lock);
+
+    filter_json = filter ? bson_as_json(filter, NULL) : NULL;
+    data_json = data ? bson_as_json(data, NULL) : NULL;
+    ast_log(LOG_WARNING, "%s: slow %s, %lld.%03lld ms, database=%s, collection=%s, docs=%u%s%s%s%s%s%s\n",
+        module, op, (long long)(us / 1000), (long long)(us % 1000), database, collection, docs,
+        timing ? ", " : "", S_OR(timing, ""),
+        filter_json ? ", filter=" : "", S_OR(filter_json, ""),
+        data_json ? ", data=" : "", S_OR(data_json, ""));
+    if (dropped)
+        ast_log(LOG_WARNING, "%u slow queries were not logged\n", dropped);
+    bson_free(filter_json);
+    bson_free(data_json);
+}
+
 static int config(int reload)
 {
     int res = 0;
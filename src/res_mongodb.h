@@ -19,4 +19,24 @@
 extern void* ast_mongo_apm_start(mongoc_client_pool_t* pool);
 extern void ast_mongo_apm_stop(void* context);
 
+/*!
+ * \brief log an operation slower than slow_query_ms of a plugin.
+ *
+ * Logs of all the plugins are limited to a few per minute,
+ * and the number of logs dropped is told by the next one.
+ *
+ * \param module      is name of the plugin
+ * \param op          is name of the operation, e.g. "realtime"
+ * \param database
+ * \param collection
+ * \param filter      is a filter of the operation, or NULL
+ * \param data        is a document or update of the operation, or NULL
+ * \param docs        is number of documents returned or written
+ * \param us          is time of the operation in microseconds
+ * \param timing      is breakdown of the time, or NULL
+ */
+extern void ast_mongo_slow_query(const char *module, const char *op,
+    const char *database, const char *collection,
+    const bson_t *filter, const bson_t *data, unsigned docs, int64_t us, const char *timing);
+
 #endif /* _ASTERISK_RES_MONGODB_H */